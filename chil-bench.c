@@ -0,0 +1,495 @@
+/* ====================================================================
+ * Copyright (c) 2001 The OpenSSL Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. All advertising materials mentioning features or use of this
+ *    software must display the following acknowledgment:
+ *    "This product includes software developed by the OpenSSL Project
+ *    for use in the OpenSSL Toolkit. (http://www.openssl.org/)"
+ *
+ * 4. The names "OpenSSL Toolkit" and "OpenSSL Project" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For written permission, please contact
+ *    openssl-core@openssl.org.
+ *
+ * 5. Products derived from this software may not be called "OpenSSL"
+ *    nor may "OpenSSL" appear in their names without prior written
+ *    permission of the OpenSSL Project.
+ *
+ * 6. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by the OpenSSL Project
+ *    for use in the OpenSSL Toolkit (http://www.openssl.org/)"
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ * ====================================================================
+ */
+
+/*
+ * chil-bench: micro-benchmarks for the CHIL engine's own overhead, as
+ * opposed to the HSM's.  Each test runs the same operation in a loop from
+ * -threads threads for -seconds seconds, and reports the throughput and
+ * the latency distribution.
+ *
+ * Tests:
+ *     keyload  load the -key keys, private (or with -public, public),
+ *              over and over; with -writer, another thread changes the
+ *              engine's settings (SET_CALLBACK_DATA) as fast as it can
+ *              meanwhile, which readers of the settings mustn't feel
+ *     mutex    ask for random bytes, a cheap request that takes the
+ *              HWCryptoHook library's mutexes, first with the default
+ *              mutex callbacks (OpenSSL locks), then with FAST_MUTEXES
+ *     dsa      sign and verify with a -bits DSA key, at each DSA_OFFLOAD
+ *              setting in turn, to show what sending them to the HSM
+ *              gains or costs
+ *     software sign with a -bits RSA key held in software, with every
+ *              request past its deadline and SOFTWARE_FALLBACK on, so
+ *              that all of them are made in software: by BN, then in
+ *              multi-buffer batches with the best kernel the CPU has,
+ *              then with the AVX2 one
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/dsa.h>
+#include <openssl/rsa.h>
+#include <openssl/err.h>
+
+#include "e_chil.h"
+
+#define MAX_THREADS     1024
+#define MAX_KEYS        64
+#define LATENCY_BUCKETS 64
+
+static const char *prog = "chil-bench";
+
+typedef struct bench_st BENCH;
+
+typedef struct {
+    BENCH *bench;
+    int index;
+    pthread_t thread;
+    uint64_t ops, failed;
+    uint64_t total_ns, max_ns;
+    uint64_t latency[LATENCY_BUCKETS];  /* by power of 2 of nanoseconds */
+} WORKER;
+
+struct bench_st {
+    ENGINE *e;
+    const RAND_METHOD *rand;
+    const char *key_ids[MAX_KEYS];
+    int nkeys;
+    int public;
+    DSA *dsa;
+    DSA_SIG *sig;
+    RSA *rsa;
+    int batches;                /* report the software batches made */
+    unsigned char dgst[32];
+    volatile int stop;
+    /* Makes one operation, returns 1 on success */
+    int (*op) (BENCH *bench, WORKER *worker, uint64_t n);
+    WORKER workers[MAX_THREADS];
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns)
+{
+    int b = 0;
+
+    while (ns > 1 && b < LATENCY_BUCKETS - 1) {
+        ns >>= 1;
+        b++;
+    }
+    return b;
+}
+
+static void *worker_main(void *arg)
+{
+    WORKER *w = arg;
+    BENCH *bench = w->bench;
+    uint64_t n, start, ns;
+
+    for (n = 0; !bench->stop; n++) {
+        start = now_ns();
+        if (!bench->op(bench, w, n)) {
+            w->failed++;
+            ERR_clear_error();
+        }
+        ns = now_ns() - start;
+        w->ops++;
+        w->total_ns += ns;
+        if (ns > w->max_ns)
+            w->max_ns = ns;
+        w->latency[bucket_of(ns)]++;
+    }
+    OPENSSL_thread_stop();
+    return NULL;
+}
+
+static int op_keyload(BENCH *bench, WORKER *w, uint64_t n)
+{
+    const char *key_id = bench->key_ids[(w->index + n) % bench->nkeys];
+    EVP_PKEY *pkey;
+
+    if (bench->public)
+        pkey = ENGINE_load_public_key(bench->e, key_id, NULL, NULL);
+    else
+        pkey = ENGINE_load_private_key(bench->e, key_id, NULL, NULL);
+    EVP_PKEY_free(pkey);
+    return pkey != NULL;
+}
+
+static int op_rand(BENCH *bench, WORKER *w, uint64_t n)
+{
+    unsigned char buf[32];
+
+    return bench->rand->bytes(buf, sizeof(buf)) == 1;
+}
+
+static int op_dsa_sign(BENCH *bench, WORKER *w, uint64_t n)
+{
+    DSA_SIG *sig = DSA_do_sign(bench->dgst, sizeof(bench->dgst), bench->dsa);
+
+    DSA_SIG_free(sig);
+    return sig != NULL;
+}
+
+static int op_dsa_verify(BENCH *bench, WORKER *w, uint64_t n)
+{
+    return DSA_do_verify(bench->dgst, sizeof(bench->dgst), bench->sig,
+                         bench->dsa) == 1;
+}
+
+static int op_rsa_software(BENCH *bench, WORKER *w, uint64_t n)
+{
+    unsigned char in[32], sig[1024];
+
+    /* Every request from this thread is late, and so made in software */
+    if (n == 0) {
+        struct timespec ts = { 0, 2000000 };
+
+        if (!ENGINE_ctrl_cmd_string(bench->e, "DEADLINE", "1", 0))
+            return 0;
+        nanosleep(&ts, NULL);
+    }
+    memset(in, (int)n, sizeof(in));
+    return RSA_private_encrypt(sizeof(in), in, sig, bench->rsa,
+                               RSA_PKCS1_PADDING) > 0;
+}
+
+/* Makes a -bits RSA key using the engine */
+static int rsa_setup(BENCH *bench, int bits)
+{
+    BIGNUM *e = BN_new();
+    int ok;
+
+    ok = e != NULL && BN_set_word(e, RSA_F4)
+        && (bench->rsa = RSA_new_method(bench->e)) != NULL
+        && RSA_generate_key_ex(bench->rsa, bits, e, NULL);
+    BN_free(e);
+    return ok;
+}
+
+/* Makes a -bits DSA key using the engine, and a signature to verify */
+static int dsa_setup(BENCH *bench, int bits)
+{
+    if ((bench->dsa = DSA_new_method(bench->e)) == NULL
+        || !DSA_generate_parameters_ex(bench->dsa, bits, NULL, 0, NULL,
+                                       NULL, NULL)
+        || !DSA_generate_key(bench->dsa)
+        || RAND_bytes(bench->dgst, sizeof(bench->dgst)) != 1
+        || (bench->sig = DSA_do_sign(bench->dgst, sizeof(bench->dgst),
+                                     bench->dsa)) == NULL)
+        return 0;
+    return 1;
+}
+
+/* The latency below which |fraction| of the operations were, roughly */
+static double percentile_us(const uint64_t *latency, uint64_t ops,
+                            double fraction)
+{
+    uint64_t seen = 0;
+    int b;
+
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += latency[b];
+        if (seen >= fraction * ops)
+            return ((uint64_t)2 << b) / 1e3;
+    }
+    return 0;
+}
+
+/* Runs |bench->op| from |threads| threads, reports, and returns 1 if all ran */
+static int run(BENCH *bench, const char *name, int threads, double seconds,
+               int writer)
+{
+    uint64_t latency[LATENCY_BUCKETS], ops = 0, failed = 0, total = 0;
+    uint64_t max = 0, writes = 0, start, elapsed;
+    HWCRHK_STATS before, after;
+    int i, b, started;
+
+    if (bench->batches
+        && !ENGINE_ctrl_cmd(bench->e, "GET_STATS", 0, &before, NULL, 0))
+        return 0;
+
+    bench->stop = 0;
+    memset(bench->workers, 0, sizeof(bench->workers));
+    memset(latency, 0, sizeof(latency));
+    start = now_ns();
+    for (started = 0; started < threads; started++) {
+        WORKER *w = &bench->workers[started];
+
+        w->bench = bench;
+        w->index = started;
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            fprintf(stderr, "%s: cannot start thread %d\n", prog, started);
+            break;
+        }
+    }
+    if (writer) {
+        /* Changes the settings until the workers are done */
+        while (now_ns() - start < (uint64_t)(seconds * 1e9)) {
+            ENGINE_ctrl(bench->e, ENGINE_CTRL_SET_CALLBACK_DATA, 0,
+                        (void *)(uintptr_t)(writes & 1), NULL);
+            writes++;
+        }
+    } else {
+        struct timespec ts;
+
+        ts.tv_sec = (time_t)seconds;
+        ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+    bench->stop = 1;
+    for (i = 0; i < started; i++)
+        pthread_join(bench->workers[i].thread, NULL);
+    elapsed = now_ns() - start;
+
+    for (i = 0; i < started; i++) {
+        WORKER *w = &bench->workers[i];
+
+        ops += w->ops;
+        failed += w->failed;
+        total += w->total_ns;
+        if (w->max_ns > max)
+            max = w->max_ns;
+        for (b = 0; b < LATENCY_BUCKETS; b++)
+            latency[b] += w->latency[b];
+    }
+    printf("%-10s %7d %10llu %7llu %11.1f %9.1f %9.1f %9.1f %9.1f",
+           name, started, (unsigned long long)ops,
+           (unsigned long long)failed, ops / (elapsed / 1e9),
+           ops > 0 ? total / 1e3 / ops : 0.0,
+           percentile_us(latency, ops, 0.5),
+           percentile_us(latency, ops, 0.99), max / 1e3);
+    if (writer)
+        printf("  (%llu settings changes)", (unsigned long long)writes);
+    if (bench->batches
+        && ENGINE_ctrl_cmd(bench->e, "GET_STATS", 0, &after, NULL, 0))
+        printf("  (%llu in %llu batches)",
+               (unsigned long long)(after.software_batched
+                                    - before.software_batched),
+               (unsigned long long)(after.software_batches
+                                    - before.software_batches));
+    printf("\n");
+    return started == threads;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: %s -test name [options]\n"
+            " -test name       keyload, mutex, dsa or software\n"
+            " -engine id       engine to use (default chil)\n"
+            " -so_path path    path to the HWCryptoHook library\n"
+            " -threads n       threads making requests (default 64)\n"
+            " -seconds n       length of the run (default 5)\n"
+            " -key id          key to load (may be repeated)\n"
+            " -public          load public keys rather than private ones\n"
+            " -writer          change the engine's settings meanwhile\n"
+            " -bits n          size of the DSA or RSA key (default 2048)\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *test = NULL, *engine_id = "chil", *so_path = NULL;
+    static BENCH bench;
+    long threads = 64, bits = 2048;
+    double seconds = 5;
+    int ret = 1, initialised = 0, writer = 0, level;
+
+    for (argv++; *argv != NULL; argv++) {
+        const char *opt = *argv, *arg = argv[1];
+
+        if (strcmp(opt, "-h") == 0 || strcmp(opt, "-help") == 0) {
+            usage();
+            return 0;
+        }
+        if (strcmp(opt, "-public") == 0) {
+            bench.public = 1;
+            continue;
+        }
+        if (strcmp(opt, "-writer") == 0) {
+            writer = 1;
+            continue;
+        }
+        if (arg == NULL) {
+            usage();
+            return 1;
+        }
+        argv++;
+        if (strcmp(opt, "-test") == 0) {
+            test = arg;
+        } else if (strcmp(opt, "-engine") == 0) {
+            engine_id = arg;
+        } else if (strcmp(opt, "-so_path") == 0) {
+            so_path = arg;
+        } else if (strcmp(opt, "-threads") == 0) {
+            threads = strtol(arg, NULL, 10);
+        } else if (strcmp(opt, "-seconds") == 0) {
+            seconds = strtod(arg, NULL);
+        } else if (strcmp(opt, "-bits") == 0) {
+            bits = strtol(arg, NULL, 10);
+        } else if (strcmp(opt, "-key") == 0 && bench.nkeys < MAX_KEYS) {
+            bench.key_ids[bench.nkeys++] = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (test == NULL || threads <= 0 || threads > MAX_THREADS
+        || seconds <= 0 || bits < 512) {
+        usage();
+        return 1;
+    }
+    if (strcmp(test, "keyload") == 0) {
+        if (bench.nkeys == 0) {
+            fprintf(stderr, "%s: keyload needs at least one -key\n", prog);
+            return 1;
+        }
+        bench.op = op_keyload;
+    } else if (strcmp(test, "mutex") == 0) {
+        bench.op = op_rand;
+    } else if (strcmp(test, "dsa") == 0) {
+        bench.op = op_dsa_sign;
+    } else if (strcmp(test, "software") == 0) {
+        bench.op = op_rsa_software;
+    } else {
+        usage();
+        return 1;
+    }
+
+    if ((bench.e = ENGINE_by_id(engine_id)) == NULL)
+        goto end;
+    if (so_path != NULL
+        && !ENGINE_ctrl_cmd_string(bench.e, "SO_PATH", so_path, 0))
+        goto end;
+
+    printf("%-10s %7s %10s %7s %11s %9s %9s %9s %9s\n", "test", "threads",
+           "ops", "failed", "ops/s", "mean us", "p50 us", "p99 us",
+           "max us");
+    if (bench.op == op_rand) {
+        /* The mutex callbacks are chosen when the engine is initialised */
+        if (!ENGINE_ctrl_cmd_string(bench.e, "FAST_MUTEXES", "0", 0)
+            || !(initialised = ENGINE_init(bench.e))
+            || (bench.rand = ENGINE_get_RAND(bench.e)) == NULL
+            || !run(&bench, "rwlock", (int)threads, seconds, writer))
+            goto end;
+        ENGINE_finish(bench.e);
+        initialised = 0;
+        /* Finishing the engine forgets SO_PATH */
+        if ((so_path != NULL
+             && !ENGINE_ctrl_cmd_string(bench.e, "SO_PATH", so_path, 0))
+            || !ENGINE_ctrl_cmd_string(bench.e, "FAST_MUTEXES", "1", 0)
+            || !(initialised = ENGINE_init(bench.e))
+            || !run(&bench, "fast", (int)threads, seconds, writer))
+            goto end;
+    } else if (bench.op == op_dsa_sign) {
+        if (!(initialised = ENGINE_init(bench.e))
+            || !dsa_setup(&bench, (int)bits))
+            goto end;
+        for (level = 0; level <= 2; level++) {
+            char value[2] = { (char)('0' + level), '\0' }, name[16];
+
+            if (!ENGINE_ctrl_cmd_string(bench.e, "DSA_OFFLOAD", value, 0))
+                goto end;
+            bench.op = op_dsa_sign;
+            BIO_snprintf(name, sizeof(name), "sign/%d", level);
+            if (!run(&bench, name, (int)threads, seconds, writer))
+                goto end;
+            bench.op = op_dsa_verify;
+            BIO_snprintf(name, sizeof(name), "verify/%d", level);
+            if (!run(&bench, name, (int)threads, seconds, writer))
+                goto end;
+        }
+    } else if (bench.op == op_rsa_software) {
+        static const char *const modes[] = { "bn", "batch", "avx2" };
+
+        if (!ENGINE_ctrl_cmd_string(bench.e, "SOFTWARE_FALLBACK", "1", 0)
+            || !(initialised = ENGINE_init(bench.e))
+            || !rsa_setup(&bench, (int)bits))
+            goto end;
+        bench.batches = 1;
+        for (level = 0; level <= 2; level++) {
+            char value[2] = { (char)('0' + level), '\0' };
+
+            if (!ENGINE_ctrl_cmd_string(bench.e, "SOFTWARE_BATCH", value, 0)
+                || !run(&bench, modes[level], (int)threads, seconds, writer))
+                goto end;
+        }
+    } else {
+        if (!(initialised = ENGINE_init(bench.e))
+            || !run(&bench, test, (int)threads, seconds, writer))
+            goto end;
+    }
+    ret = 0;
+
+ end:
+    if (ret != 0)
+        ERR_print_errors_fp(stderr);
+    if (initialised)
+        ENGINE_finish(bench.e);
+    DSA_SIG_free(bench.sig);
+    DSA_free(bench.dsa);
+    RSA_free(bench.rsa);
+    ENGINE_free(bench.e);
+    return ret;
+}
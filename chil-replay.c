@@ -0,0 +1,657 @@
+/* ====================================================================
+ * Copyright (c) 2001 The OpenSSL Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. All advertising materials mentioning features or use of this
+ *    software must display the following acknowledgment:
+ *    "This product includes software developed by the OpenSSL Project
+ *    for use in the OpenSSL Toolkit. (http://www.openssl.org/)"
+ *
+ * 4. The names "OpenSSL Toolkit" and "OpenSSL Project" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For written permission, please contact
+ *    openssl-core@openssl.org.
+ *
+ * 5. Products derived from this software may not be called "OpenSSL"
+ *    nor may "OpenSSL" appear in their names without prior written
+ *    permission of the OpenSSL Project.
+ *
+ * 6. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by the OpenSSL Project
+ *    for use in the OpenSSL Toolkit (http://www.openssl.org/)"
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ * ====================================================================
+ */
+
+/*
+ * chil-replay: plays a trace recorded with the CHIL engine's TRACE
+ * command back against the engine, open loop: every request is submitted
+ * when it is due, at the time it started in the trace (divided by
+ * -speed), whether or not those before it have completed.  Requests are
+ * made through the engine's non-blocking submission interface, so a
+ * single thread keeps any number of them in flight.
+ *
+ * The operands are made up, once for every size in the trace: random
+ * moduli and exponents for ModExp, software RSA keys for ModExpCRT, and
+ * for requests on keys held in the HSM, the keys named with -key.  Those
+ * whose key_id hashes to a key in the trace stand in for it; the other
+ * keys in the trace are spread over them.  Key loads are replayed by
+ * loading the key again, from the submitting thread.
+ *
+ * Latencies are measured from the time a request was due rather than the
+ * time it was submitted, so that falling behind shows up in them, and are
+ * reported next to the ones recorded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <openssl/crypto.h>
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/bn.h>
+#include <openssl/err.h>
+
+#include "e_chil.h"
+
+#define NTYPES          (HWCRHK_TRACE_KEY_LOAD + 1)
+#define MAX_KEYS        256
+#define MAX_RAND_BYTES  8192
+#define POLL_RESULTS    64
+
+static const char *prog = "chil-replay";
+
+static const char *type_names[NTYPES] = {
+    NULL, "rsa", "modexp", "modexpcrt", "rand", "keyload"
+};
+
+/* The operands shared by every request of the same type and size */
+typedef struct {
+    int type;
+    int bits, exp_bits;
+    int key;                    /* index in -key, for RSA and KEY_LOAD */
+    RSA *rsa;
+    BIGNUM *a, *p, *m;
+} OPERANDS;
+
+typedef struct {
+    uint64_t due_ns;
+    uint64_t latency_ns;
+    BIGNUM *r;
+    int ops;                    /* index in the operands, -1 to skip */
+    int status;                 /* -1 until completed */
+} REQUEST;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* As the engine hashes key_ids, see HWCRHK_TRACE_RECORD */
+static uint32_t key_hash(const char *key_id)
+{
+    const char *end = strrchr(key_id, '#');
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const char *s;
+    char *num;
+    long n;
+
+    if (end != NULL && end[1] >= '0' && end[1] <= '9') {
+        n = strtol(end + 1, &num, 10);
+        if (*num != '\0' || n < 1 || n > 64)
+            end = NULL;
+    } else {
+        end = NULL;
+    }
+    for (s = key_id; *s != '\0' && s != end; s++)
+        h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+    return (uint32_t)h;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_record(const void *a, const void *b)
+{
+    return cmp_u64(&((const HWCRHK_TRACE_RECORD *)a)->start_ns,
+                   &((const HWCRHK_TRACE_RECORD *)b)->start_ns);
+}
+
+/*
+ * Reads the whole trace into |*records|, sorted by start time, since child
+ * processes append theirs out of order.
+ */
+static int trace_read(const char *file, HWCRHK_TRACE_RECORD **records,
+                      size_t *count)
+{
+    HWCRHK_TRACE_HEADER header;
+    struct stat st;
+    unsigned char *map;
+    int fd, ok = 0;
+
+    if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: %s: %s\n", prog, file, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    if ((size_t)st.st_size < sizeof(header)) {
+        fprintf(stderr, "%s: %s: not a trace\n", prog, file);
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: %s: %s\n", prog, file, strerror(errno));
+        return 0;
+    }
+
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, HWCRHK_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: %s: not a trace\n", prog, file);
+        goto end;
+    }
+    /* A torn last record is left out */
+    *count = (st.st_size - sizeof(header)) / sizeof(**records);
+    if ((*records = malloc(*count * sizeof(**records) + 1)) == NULL) {
+        fprintf(stderr, "%s: out of memory\n", prog);
+        goto end;
+    }
+    memcpy(*records, map + sizeof(header), *count * sizeof(**records));
+    qsort(*records, *count, sizeof(**records), cmp_record);
+    ok = 1;
+
+ end:
+    munmap(map, st.st_size);
+    return ok;
+}
+
+/* Maps every key hash in the trace to one of the |nkeys| keys given */
+static int map_keys(const HWCRHK_TRACE_RECORD *records, size_t count,
+                    const uint32_t *hashes, int nkeys, uint32_t **seen,
+                    int **mapped, size_t *nseen)
+{
+    size_t i, n = 0, spread = 0;
+    int k;
+
+    if ((*seen = malloc(count * sizeof(**seen) + 1)) == NULL)
+        return 0;
+    for (i = 0; i < count; i++)
+        if (records[i].type == HWCRHK_TRACE_RSA
+            || records[i].type == HWCRHK_TRACE_KEY_LOAD)
+            (*seen)[n++] = records[i].key_hash;
+    qsort(*seen, n, sizeof(**seen), cmp_u32);
+    for (i = 0, *nseen = 0; i < n; i++)
+        if (*nseen == 0 || (*seen)[*nseen - 1] != (*seen)[i])
+            (*seen)[(*nseen)++] = (*seen)[i];
+
+    if ((*mapped = malloc(*nseen * sizeof(**mapped) + 1)) == NULL)
+        return 0;
+    for (i = 0; i < *nseen; i++) {
+        (*mapped)[i] = -1;
+        for (k = 0; k < nkeys; k++)
+            if (hashes[k] == (*seen)[i])
+                (*mapped)[i] = k;
+    }
+    for (i = 0; i < *nseen && nkeys > 0; i++)
+        if ((*mapped)[i] < 0)
+            (*mapped)[i] = (int)(spread++ % nkeys);
+    return 1;
+}
+
+static int find_key(const uint32_t *seen, const int *mapped, size_t nseen,
+                    uint32_t hash)
+{
+    const uint32_t *found = bsearch(&hash, seen, nseen, sizeof(*seen),
+                                    cmp_u32);
+
+    return found != NULL ? mapped[found - seen] : -1;
+}
+
+/* Makes up the operands for a request of |ops->type| and size */
+static int operands_make(OPERANDS *ops, RSA *key)
+{
+    BIGNUM *e = NULL;
+    const BIGNUM *n = NULL;
+    int ok = 0;
+
+    switch (ops->type) {
+    case HWCRHK_TRACE_RSA:
+        ops->rsa = key;
+        RSA_up_ref(key);
+        RSA_get0_key(key, &n, NULL, NULL);
+        ok = (ops->a = BN_new()) != NULL && BN_rand_range(ops->a, n);
+        break;
+    case HWCRHK_TRACE_MOD_EXP:
+        ok = (ops->a = BN_new()) != NULL && (ops->p = BN_new()) != NULL
+            && (ops->m = BN_new()) != NULL
+            && BN_rand(ops->m, ops->bits, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ODD)
+            && BN_rand(ops->p, ops->exp_bits > 0 ? ops->exp_bits : 1,
+                       BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ANY)
+            && BN_rand_range(ops->a, ops->m);
+        break;
+    case HWCRHK_TRACE_MOD_EXP_CRT:
+        /* In software; the engine isn't the default RSA method */
+        ok = (e = BN_new()) != NULL && BN_set_word(e, RSA_F4)
+            && (ops->rsa = RSA_new()) != NULL
+            && RSA_generate_key_ex(ops->rsa, ops->bits < 512 ? 512 : ops->bits,
+                                   e, NULL)
+            && (ops->a = BN_new()) != NULL;
+        if (ok) {
+            RSA_get0_key(ops->rsa, &n, NULL, NULL);
+            ok = BN_rand_range(ops->a, n);
+        }
+        break;
+    default:
+        ok = 1;
+    }
+    BN_free(e);
+    return ok;
+}
+
+static void operands_free(OPERANDS *ops)
+{
+    RSA_free(ops->rsa);
+    BN_free(ops->a);
+    BN_free(ops->p);
+    BN_free(ops->m);
+}
+
+/* Returns the index of the operands for |rec|, making them if need be */
+static int operands_find(OPERANDS **ops, size_t *nops, size_t *cap,
+                         const HWCRHK_TRACE_RECORD *rec, int key,
+                         RSA **rsas)
+{
+    OPERANDS *o;
+    size_t i;
+
+    for (i = 0; i < *nops; i++) {
+        o = &(*ops)[i];
+        if (o->type == rec->type && o->bits == rec->bits
+            && o->exp_bits == rec->exp_bits && o->key == key)
+            return (int)i;
+    }
+    if (*nops == *cap) {
+        size_t newcap = *cap == 0 ? 16 : 2 * *cap;
+
+        if ((o = realloc(*ops, newcap * sizeof(*o))) == NULL)
+            return -1;
+        *ops = o;
+        *cap = newcap;
+    }
+    o = &(*ops)[*nops];
+    memset(o, 0, sizeof(*o));
+    o->type = rec->type;
+    o->bits = rec->bits;
+    o->exp_bits = rec->exp_bits;
+    o->key = key;
+    if (!operands_make(o, key >= 0 ? rsas[key] : NULL)) {
+        operands_free(o);
+        return -1;
+    }
+    return (int)(*nops)++;
+}
+
+/* Takes in the results available, and returns how many there were */
+static size_t collect(const HWCRHK_ASYNC_API *api, HWCRHK_ASYNC_QUEUE *queue,
+                      REQUEST *reqs)
+{
+    HWCRHK_ASYNC_RESULT results[POLL_RESULTS];
+    unsigned char buf[64];
+    uint64_t now;
+    size_t done = 0;
+    int i, n;
+
+    /* An eventfd wants 8 bytes, a pipe takes anything */
+    if (read(api->queue_fd(queue), buf, sizeof(buf)) < 0 && errno != EAGAIN)
+        return 0;
+    while ((n = api->poll(queue, results, POLL_RESULTS)) > 0) {
+        now = now_ns();
+        for (i = 0; i < n; i++) {
+            REQUEST *req = &reqs[(uintptr_t)results[i].arg];
+
+            req->latency_ns = now - req->due_ns;
+            req->status = results[i].status;
+            BN_free(req->r);
+            req->r = NULL;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Waits for completions until |until_ns|, or for good if it is 0 */
+static void wait_until(int fd, uint64_t until_ns)
+{
+    struct timespec ts;
+    fd_set rfds;
+    uint64_t now;
+
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    if (until_ns == 0) {
+        pselect(fd + 1, &rfds, NULL, NULL, NULL, NULL);
+        return;
+    }
+    if ((now = now_ns()) >= until_ns)
+        return;
+    ts.tv_sec = (until_ns - now) / 1000000000;
+    ts.tv_nsec = (until_ns - now) % 1000000000;
+    pselect(fd + 1, &rfds, NULL, NULL, &ts, NULL);
+}
+
+static void print_row(const char *type, const char *what, uint64_t *lat,
+                      size_t n, size_t failed)
+{
+    if (n == 0)
+        return;
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    printf("%-10s %-9s %9zu %7zu %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+           type, what, n, failed, lat[n / 2] / 1e6, lat[n * 90 / 100] / 1e6,
+           lat[n * 99 / 100] / 1e6, lat[n * 999 / 1000] / 1e6,
+           lat[n - 1] / 1e6);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: %s -trace file [options]\n"
+            " -trace file      trace recorded with the TRACE command\n"
+            " -engine id       engine to use (default chil)\n"
+            " -so_path path    path to the HWCryptoHook library\n"
+            " -key id          key to make RSA requests and key loads\n"
+            "                  with (may be repeated)\n"
+            " -speed x         replay x times as fast (default 1)\n"
+            " -inflight n      MAX_SIMULTANEOUS for the engine\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *trace = NULL, *engine_id = "chil", *so_path = NULL;
+    const char *key_ids[MAX_KEYS];
+    uint32_t hashes[MAX_KEYS], *seen = NULL;
+    RSA *rsas[MAX_KEYS];
+    int *mapped = NULL, nkeys = 0, k, ret = 1, initialised = 0;
+    double speed = 1.0;
+    long inflight = 0;
+    ENGINE *e = NULL;
+    EVP_PKEY *pkey;
+    HWCRHK_ASYNC_API api;
+    HWCRHK_ASYNC_QUEUE *queue = NULL;
+    HWCRHK_TRACE_RECORD *records = NULL;
+    REQUEST *reqs = NULL;
+    OPERANDS *ops = NULL;
+    uint64_t *lat = NULL, start, end, lag, max_lag = 0;
+    size_t count = 0, nseen = 0, nops = 0, opscap = 0, i, j;
+    size_t outstanding = 0, skipped = 0, failed = 0, n, nfailed;
+    static unsigned char randbuf[MAX_RAND_BYTES];
+    char numbuf[32];
+    double secs;
+
+    for (argv++; *argv != NULL; argv++) {
+        const char *opt = *argv, *arg = argv[1];
+
+        if (strcmp(opt, "-h") == 0 || strcmp(opt, "-help") == 0) {
+            usage();
+            return 0;
+        }
+        if (arg == NULL) {
+            usage();
+            return 1;
+        }
+        argv++;
+        if (strcmp(opt, "-trace") == 0) {
+            trace = arg;
+        } else if (strcmp(opt, "-engine") == 0) {
+            engine_id = arg;
+        } else if (strcmp(opt, "-so_path") == 0) {
+            so_path = arg;
+        } else if (strcmp(opt, "-key") == 0 && nkeys < MAX_KEYS) {
+            key_ids[nkeys] = arg;
+            hashes[nkeys] = key_hash(arg);
+            rsas[nkeys++] = NULL;
+        } else if (strcmp(opt, "-speed") == 0) {
+            speed = strtod(arg, NULL);
+        } else if (strcmp(opt, "-inflight") == 0) {
+            inflight = strtol(arg, NULL, 10);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (trace == NULL || speed <= 0 || inflight < 0) {
+        usage();
+        return 1;
+    }
+
+    if (!trace_read(trace, &records, &count))
+        return 1;
+    if (!map_keys(records, count, hashes, nkeys, &seen, &mapped, &nseen)
+        || (reqs = calloc(count + 1, sizeof(*reqs))) == NULL
+        || (lat = malloc((count + 1) * sizeof(*lat))) == NULL) {
+        fprintf(stderr, "%s: out of memory\n", prog);
+        goto end;
+    }
+
+    if ((e = ENGINE_by_id(engine_id)) == NULL)
+        goto end;
+    if (so_path != NULL && !ENGINE_ctrl_cmd_string(e, "SO_PATH", so_path, 0))
+        goto end;
+    if (inflight > 0) {
+        BIO_snprintf(numbuf, sizeof(numbuf), "%ld", inflight);
+        if (!ENGINE_ctrl_cmd_string(e, "MAX_SIMULTANEOUS", numbuf, 0))
+            goto end;
+    }
+    if (!(initialised = ENGINE_init(e))
+        || !ENGINE_ctrl_cmd(e, "GET_ASYNC_API", 0, &api, NULL, 0)
+        || (queue = api.queue_new()) == NULL)
+        goto end;
+    for (k = 0; k < nkeys; k++) {
+        if ((pkey = ENGINE_load_private_key(e, key_ids[k], NULL,
+                                            NULL)) == NULL)
+            goto end;
+        rsas[k] = EVP_PKEY_get1_RSA(pkey);
+        EVP_PKEY_free(pkey);
+        if (rsas[k] == NULL)
+            goto end;
+    }
+
+    /* Everything is made up before the clock starts */
+    for (i = 0; i < count; i++) {
+        const HWCRHK_TRACE_RECORD *rec = &records[i];
+
+        reqs[i].status = -1;
+        reqs[i].ops = -1;
+        k = -1;
+        if (rec->type == HWCRHK_TRACE_RSA
+            || rec->type == HWCRHK_TRACE_KEY_LOAD) {
+            if ((k = find_key(seen, mapped, nseen, rec->key_hash)) < 0) {
+                skipped++;
+                continue;
+            }
+        } else if (rec->type < HWCRHK_TRACE_MOD_EXP
+                   || rec->type > HWCRHK_TRACE_RAND_BYTES
+                   || (rec->type == HWCRHK_TRACE_MOD_EXP && rec->bits == 0)) {
+            skipped++;
+            continue;
+        }
+        if ((reqs[i].ops = operands_find(&ops, &nops, &opscap, rec, k,
+                                         rsas)) < 0) {
+            fprintf(stderr, "%s: cannot make %s operands of %d bits\n",
+                    prog, type_names[rec->type], rec->bits);
+            goto end;
+        }
+    }
+
+    start = now_ns();
+    for (i = 0; i < count; i++) {
+        REQUEST *req = &reqs[i];
+        const OPERANDS *o;
+        uint64_t token = 0;
+        size_t len;
+
+        if (req->ops < 0)
+            continue;
+        o = &ops[req->ops];
+        req->due_ns = start + (uint64_t)(records[i].start_ns / speed);
+        /*
+         * Completions are timed when they are collected, so they are
+         * collected even when this request is already due
+         */
+        outstanding -= collect(&api, queue, reqs);
+        while (now_ns() < req->due_ns) {
+            wait_until(api.queue_fd(queue), req->due_ns);
+            outstanding -= collect(&api, queue, reqs);
+        }
+        if ((lag = now_ns() - req->due_ns) > max_lag)
+            max_lag = lag;
+
+        switch (o->type) {
+        case HWCRHK_TRACE_KEY_LOAD:
+            pkey = ENGINE_load_private_key(e, key_ids[o->key], NULL, NULL);
+            req->latency_ns = now_ns() - req->due_ns;
+            req->status = pkey != NULL;
+            EVP_PKEY_free(pkey);
+            ERR_clear_error();
+            continue;
+        case HWCRHK_TRACE_RAND_BYTES:
+            len = o->bits / 8 > MAX_RAND_BYTES ? MAX_RAND_BYTES : o->bits / 8;
+            token = api.submit_rand_bytes(queue, randbuf, len > 0 ? len : 1,
+                                          (void *)(uintptr_t)i);
+            break;
+        default:
+            if ((req->r = BN_new()) == NULL)
+                break;
+            if (o->type == HWCRHK_TRACE_RSA) {
+                token = api.submit_rsa(queue, req->r, o->a, o->rsa,
+                                       (void *)(uintptr_t)i);
+            } else if (o->type == HWCRHK_TRACE_MOD_EXP) {
+                token = api.submit_mod_exp(queue, req->r, o->a, o->p, o->m,
+                                           (void *)(uintptr_t)i);
+            } else {
+                const BIGNUM *p, *q, *dmp1, *dmq1, *iqmp;
+
+                RSA_get0_factors(o->rsa, &p, &q);
+                RSA_get0_crt_params(o->rsa, &dmp1, &dmq1, &iqmp);
+                token = api.submit_mod_exp_crt(queue, req->r, o->a, p, q,
+                                               dmp1, dmq1, iqmp,
+                                               (void *)(uintptr_t)i);
+            }
+        }
+        if (token == 0) {
+            BN_free(req->r);
+            req->r = NULL;
+            req->status = 0;
+            req->latency_ns = now_ns() - req->due_ns;
+            ERR_clear_error();
+        } else {
+            outstanding++;
+        }
+    }
+    while (outstanding > 0) {
+        wait_until(api.queue_fd(queue), 0);
+        outstanding -= collect(&api, queue, reqs);
+    }
+    end = now_ns();
+
+    for (i = 0; i < count; i++)
+        if (reqs[i].ops >= 0 && reqs[i].status == 0)
+            failed++;
+    secs = (end - start) / 1e9;
+    printf("%s: %zu requests in %.3fs (%.1f/s) at %gx, %zu skipped, "
+           "%zu failed, up to %.3fms behind\n", prog, count - skipped, secs,
+           secs > 0 ? (count - skipped) / secs : 0.0, speed, skipped, failed,
+           max_lag / 1e6);
+    printf("%-10s %-9s %9s %7s %9s %9s %9s %9s %9s\n", "type", "", "count",
+           "failed", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (k = 1; k < NTYPES; k++) {
+        for (i = n = nfailed = 0; i < count; i++) {
+            if (records[i].type != k || reqs[i].ops < 0)
+                continue;
+            lat[n++] = reqs[i].latency_ns;
+            nfailed += reqs[i].status == 0;
+        }
+        print_row(type_names[k], "replayed", lat, n, nfailed);
+        for (i = n = nfailed = 0; i < count; i++) {
+            if (records[i].type != k || reqs[i].ops < 0)
+                continue;
+            lat[n++] = (uint64_t)records[i].duration_us * 1000;
+            nfailed += records[i].result != 0;
+        }
+        print_row("", "recorded", lat, n, nfailed);
+    }
+    ret = 0;
+
+ end:
+    if (ret != 0)
+        ERR_print_errors_fp(stderr);
+    if (queue != NULL)
+        api.queue_free(queue);
+    for (j = 0; j < nops; j++)
+        operands_free(&ops[j]);
+    for (k = 0; k < nkeys; k++)
+        RSA_free(rsas[k]);
+    if (reqs != NULL)
+        for (i = 0; i < count; i++)
+            BN_free(reqs[i].r);
+    free(ops);
+    free(reqs);
+    free(lat);
+    free(seen);
+    free(mapped);
+    free(records);
+    if (initialised)
+        ENGINE_finish(e);
+    ENGINE_free(e);
+    return ret;
+}
@@ -0,0 +1,550 @@
+/* ====================================================================
+ * Copyright (c) 2001 The OpenSSL Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. All advertising materials mentioning features or use of this
+ *    software must display the following acknowledgment:
+ *    "This product includes software developed by the OpenSSL Project
+ *    for use in the OpenSSL Toolkit. (http://www.openssl.org/)"
+ *
+ * 4. The names "OpenSSL Toolkit" and "OpenSSL Project" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For written permission, please contact
+ *    openssl-core@openssl.org.
+ *
+ * 5. Products derived from this software may not be called "OpenSSL"
+ *    nor may "OpenSSL" appear in their names without prior written
+ *    permission of the OpenSSL Project.
+ *
+ * 6. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by the OpenSSL Project
+ *    for use in the OpenSSL Toolkit (http://www.openssl.org/)"
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ * ====================================================================
+ */
+
+/*
+ * chil-sign: bulk RSA signing of a stream of digests through the CHIL
+ * engine.  The engine and the key are loaded once, and the digests are
+ * handed to the engine's RSA_BATCH command a window at a time, so that
+ * up to -inflight signatures are being computed at any moment.  The
+ * signatures are written out in input order.
+ *
+ * Input records are one of:
+ *     raw  fixed size binary digests (the size of -md, or -len)
+ *     hex  one hex encoded digest per line
+ *     lp   a 4 byte big-endian length followed by that many bytes
+ * and output records use the same encodings, raw being fixed at the
+ * size of the modulus.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <openssl/crypto.h>
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <openssl/objects.h>
+#include <openssl/err.h>
+
+#include "e_chil.h"
+
+#define FORMAT_RAW 0
+#define FORMAT_HEX 1
+#define FORMAT_LP  2
+
+#define MAX_RECORD 1024
+#define READ_CHUNK 65536
+
+static const char *prog = "chil-sign";
+
+/*
+ * Input, either a memory mapped file or a buffered file descriptor.
+ * Records are parsed straight out of |buf|; for a descriptor the buffer
+ * is refilled (and compacted) as records are consumed.
+ */
+typedef struct {
+    int fd;
+    int mapped;
+    unsigned char *buf;
+    size_t len, pos, cap;
+    int eof;
+} READER;
+
+static int reader_open(READER *rd, const char *file)
+{
+    struct stat st;
+
+    memset(rd, 0, sizeof(*rd));
+    if (file == NULL) {
+        rd->fd = STDIN_FILENO;
+    } else if ((rd->fd = open(file, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: %s: %s\n", prog, file, strerror(errno));
+        return 0;
+    }
+
+    if (fstat(rd->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            rd->mapped = 1;
+            rd->eof = 1;
+            return 1;
+        }
+        rd->buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, rd->fd, 0);
+        if (rd->buf != MAP_FAILED) {
+            madvise(rd->buf, st.st_size, MADV_SEQUENTIAL);
+            rd->mapped = 1;
+            rd->len = st.st_size;
+            rd->eof = 1;
+            return 1;
+        }
+        rd->buf = NULL;
+    }
+
+    rd->cap = READ_CHUNK;
+    if ((rd->buf = malloc(rd->cap)) == NULL) {
+        fprintf(stderr, "%s: out of memory\n", prog);
+        return 0;
+    }
+    return 1;
+}
+
+static void reader_close(READER *rd)
+{
+    if (rd->mapped) {
+        if (rd->buf != NULL)
+            munmap(rd->buf, rd->len);
+    } else {
+        free(rd->buf);
+    }
+    if (rd->fd != STDIN_FILENO)
+        close(rd->fd);
+}
+
+/*
+ * Make sure at least |want| unread bytes are buffered, unless the input
+ * ends first.  Returns the number of unread bytes available.
+ */
+static size_t reader_fill(READER *rd, size_t want)
+{
+    ssize_t n;
+
+    while (rd->len - rd->pos < want && !rd->eof) {
+        if (rd->pos > 0) {
+            memmove(rd->buf, rd->buf + rd->pos, rd->len - rd->pos);
+            rd->len -= rd->pos;
+            rd->pos = 0;
+        }
+        if (rd->len == rd->cap) {
+            unsigned char *tmp = realloc(rd->buf, rd->cap * 2);
+
+            if (tmp == NULL)
+                break;
+            rd->buf = tmp;
+            rd->cap *= 2;
+        }
+        n = read(rd->fd, rd->buf + rd->len, rd->cap - rd->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            rd->eof = 1;
+        else
+            rd->len += n;
+    }
+    return rd->len - rd->pos;
+}
+
+static int hexval(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/*
+ * Read one record into |out|.  Returns 1 on success, 0 at the end of the
+ * input and -1 on a malformed record.
+ */
+static int reader_next(READER *rd, int format, size_t reclen,
+                       unsigned char *out, size_t *outlen)
+{
+    size_t avail, i, n;
+
+    switch (format) {
+    case FORMAT_RAW:
+        avail = reader_fill(rd, reclen);
+        if (avail == 0)
+            return 0;
+        if (avail < reclen)
+            return -1;
+        memcpy(out, rd->buf + rd->pos, reclen);
+        rd->pos += reclen;
+        *outlen = reclen;
+        return 1;
+
+    case FORMAT_LP:
+        avail = reader_fill(rd, 4);
+        if (avail == 0)
+            return 0;
+        if (avail < 4)
+            return -1;
+        n = ((size_t)rd->buf[rd->pos] << 24)
+            | ((size_t)rd->buf[rd->pos + 1] << 16)
+            | ((size_t)rd->buf[rd->pos + 2] << 8)
+            | (size_t)rd->buf[rd->pos + 3];
+        if (n > MAX_RECORD || reader_fill(rd, 4 + n) < 4 + n)
+            return -1;
+        memcpy(out, rd->buf + rd->pos + 4, n);
+        rd->pos += 4 + n;
+        *outlen = n;
+        return 1;
+
+    case FORMAT_HEX:
+        for (;;) {
+            unsigned char *line, *nl;
+
+            avail = reader_fill(rd, 2 * MAX_RECORD + 2);
+            if (avail == 0)
+                return 0;
+            line = rd->buf + rd->pos;
+            nl = memchr(line, '\n', avail);
+            n = nl != NULL ? (size_t)(nl - line) : avail;
+            rd->pos += nl != NULL ? n + 1 : n;
+
+            while (n > 0 && isspace(line[n - 1]))
+                n--;
+            if (n == 0)
+                continue;       /* skip blank lines */
+            if (n % 2 != 0 || n / 2 > MAX_RECORD)
+                return -1;
+            for (i = 0; i < n / 2; i++) {
+                int hi = hexval(line[2 * i]), lo = hexval(line[2 * i + 1]);
+
+                if (hi < 0 || lo < 0)
+                    return -1;
+                out[i] = (unsigned char)((hi << 4) | lo);
+            }
+            *outlen = n / 2;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+static int write_record(FILE *out, int format, const unsigned char *buf,
+                        size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char lenbuf[4];
+    size_t i;
+
+    switch (format) {
+    case FORMAT_LP:
+        lenbuf[0] = (unsigned char)(len >> 24);
+        lenbuf[1] = (unsigned char)(len >> 16);
+        lenbuf[2] = (unsigned char)(len >> 8);
+        lenbuf[3] = (unsigned char)len;
+        if (fwrite(lenbuf, 1, 4, out) != 4)
+            return 0;
+        /* fall through */
+    case FORMAT_RAW:
+        return fwrite(buf, 1, len, out) == len;
+    case FORMAT_HEX:
+        for (i = 0; i < len; i++) {
+            putc(hex[buf[i] >> 4], out);
+            putc(hex[buf[i] & 0xf], out);
+        }
+        return putc('\n', out) != EOF;
+    }
+    return 0;
+}
+
+static int parse_format(const char *s)
+{
+    if (strcmp(s, "raw") == 0)
+        return FORMAT_RAW;
+    if (strcmp(s, "hex") == 0)
+        return FORMAT_HEX;
+    if (strcmp(s, "lp") == 0)
+        return FORMAT_LP;
+    return -1;
+}
+
+/*
+ * Wrap a digest in a DER encoded DigestInfo, as RSA_sign() does.  With no
+ * digest the input is assumed to be encoded already.
+ */
+static int encode_digest(const EVP_MD *md, const unsigned char *dgst,
+                         size_t dlen, unsigned char *out, size_t *outlen)
+{
+    X509_SIG *sig;
+    X509_ALGOR *alg;
+    ASN1_OCTET_STRING *digest;
+    unsigned char *p = out;
+    int len = -1;
+
+    if (md == NULL) {
+        memcpy(out, dgst, dlen);
+        *outlen = dlen;
+        return 1;
+    }
+    if (dlen != (size_t)EVP_MD_size(md))
+        return 0;
+    if ((sig = X509_SIG_new()) == NULL)
+        return 0;
+    X509_SIG_getm(sig, &alg, &digest);
+    if (X509_ALGOR_set0(alg, OBJ_nid2obj(EVP_MD_type(md)), V_ASN1_NULL, NULL)
+        && ASN1_OCTET_STRING_set(digest, dgst, (int)dlen)
+        && i2d_X509_SIG(sig, NULL) <= MAX_RECORD)
+        len = i2d_X509_SIG(sig, &p);
+    X509_SIG_free(sig);
+    if (len <= 0)
+        return 0;
+    *outlen = len;
+    return 1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: %s -key key_id [options]\n"
+            " -key id          key to sign with\n"
+            " -engine id       engine to use (default chil)\n"
+            " -so_path path    path to the HWCryptoHook library\n"
+            " -in file         read digests from file (default stdin)\n"
+            " -out file        write signatures to file (default stdout)\n"
+            " -inform fmt      raw, hex or lp (default raw)\n"
+            " -outform fmt     raw, hex or lp (default raw)\n"
+            " -md name         digest algorithm (default sha256), or none\n"
+            "                  if the input is already DigestInfo encoded\n"
+            " -len n           raw record size when -md is none\n"
+            " -inflight n      signatures in flight at once (default 32)\n"
+            " -window n        records handed to the engine at a time\n"
+            "                  (default 8 * inflight)\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *key_id = NULL, *engine_id = "chil", *so_path = NULL;
+    const char *infile = NULL, *outfile = NULL, *mdname = "sha256";
+    int inform = FORMAT_RAW, outform = FORMAT_RAW;
+    long inflight = 32, window = 0, reclen = 0;
+    const EVP_MD *md = NULL;
+    ENGINE *e = NULL;
+    EVP_PKEY *pkey = NULL;
+    RSA *rsa = NULL;
+    READER rd;
+    FILE *out = stdout;
+    HWCRHK_RSA_BATCH batch;
+    HWCRHK_RSA_BATCH_ITEM *items = NULL;
+    unsigned char *inbuf = NULL, *outbuf = NULL, dgst[MAX_RECORD];
+    unsigned long done = 0, failed = 0;
+    struct timespec start, end;
+    double secs;
+    size_t i, n, dlen, siglen;
+    int ret = 1, rv = 1, reader_ok = 0, initialised = 0;
+    char numbuf[32];
+
+    for (argv++; *argv != NULL; argv++) {
+        const char *opt = *argv, *arg = argv[1];
+
+        if (strcmp(opt, "-h") == 0 || strcmp(opt, "-help") == 0) {
+            usage();
+            return 0;
+        }
+        if (arg == NULL) {
+            usage();
+            return 1;
+        }
+        argv++;
+        if (strcmp(opt, "-key") == 0)
+            key_id = arg;
+        else if (strcmp(opt, "-engine") == 0)
+            engine_id = arg;
+        else if (strcmp(opt, "-so_path") == 0)
+            so_path = arg;
+        else if (strcmp(opt, "-in") == 0)
+            infile = arg;
+        else if (strcmp(opt, "-out") == 0)
+            outfile = arg;
+        else if (strcmp(opt, "-inform") == 0)
+            inform = parse_format(arg);
+        else if (strcmp(opt, "-outform") == 0)
+            outform = parse_format(arg);
+        else if (strcmp(opt, "-md") == 0)
+            mdname = arg;
+        else if (strcmp(opt, "-len") == 0)
+            reclen = strtol(arg, NULL, 10);
+        else if (strcmp(opt, "-inflight") == 0)
+            inflight = strtol(arg, NULL, 10);
+        else if (strcmp(opt, "-window") == 0)
+            window = strtol(arg, NULL, 10);
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (key_id == NULL || inform < 0 || outform < 0 || inflight <= 0
+        || window < 0) {
+        usage();
+        return 1;
+    }
+    if (window == 0)
+        window = 8 * inflight;
+
+    if (strcmp(mdname, "none") != 0
+        && (md = EVP_get_digestbyname(mdname)) == NULL) {
+        fprintf(stderr, "%s: unknown digest %s\n", prog, mdname);
+        return 1;
+    }
+    if (md != NULL && reclen == 0)
+        reclen = EVP_MD_size(md);
+    if (inform == FORMAT_RAW && (reclen <= 0 || reclen > MAX_RECORD)) {
+        fprintf(stderr, "%s: raw input needs a record size (-len)\n", prog);
+        return 1;
+    }
+
+    /* Load the engine and the key once for the whole run */
+    if ((e = ENGINE_by_id(engine_id)) == NULL)
+        goto end;
+    if (so_path != NULL && !ENGINE_ctrl_cmd_string(e, "SO_PATH", so_path, 0))
+        goto end;
+    BIO_snprintf(numbuf, sizeof(numbuf), "%ld", inflight);
+    if (!ENGINE_ctrl_cmd_string(e, "MAX_SIMULTANEOUS", numbuf, 0)
+        || !(initialised = ENGINE_init(e)))
+        goto end;
+    if ((pkey = ENGINE_load_private_key(e, key_id, NULL, NULL)) == NULL
+        || (rsa = EVP_PKEY_get1_RSA(pkey)) == NULL)
+        goto end;
+    siglen = RSA_size(rsa);
+
+    if (!(reader_ok = reader_open(&rd, infile)))
+        goto end;
+    if (outfile != NULL && (out = fopen(outfile, "wb")) == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", prog, outfile, strerror(errno));
+        goto end;
+    }
+
+    items = calloc(window, sizeof(*items));
+    inbuf = malloc(window * MAX_RECORD);
+    outbuf = malloc(window * siglen);
+    if (items == NULL || inbuf == NULL || outbuf == NULL) {
+        fprintf(stderr, "%s: out of memory\n", prog);
+        goto end;
+    }
+    batch.items = items;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        for (n = 0; n < (size_t)window; n++) {
+            HWCRHK_RSA_BATCH_ITEM *item = &items[n];
+
+            rv = reader_next(&rd, inform, reclen, dgst, &dlen);
+            if (rv < 0)
+                fprintf(stderr, "%s: record %lu: malformed input\n",
+                        prog, done + n + 1);
+            if (rv <= 0)
+                break;
+            item->rsa = rsa;
+            item->padding = RSA_PKCS1_PADDING;
+            item->in = inbuf + n * MAX_RECORD;
+            item->out = outbuf + n * siglen;
+            if (!encode_digest(md, dgst, dlen, inbuf + n * MAX_RECORD,
+                               &item->inlen)) {
+                fprintf(stderr, "%s: record %lu: bad digest\n",
+                        prog, done + n + 1);
+                rv = -1;
+                break;
+            }
+        }
+        if (n > 0) {
+            batch.count = n;
+            ENGINE_ctrl_cmd(e, "RSA_BATCH", 0, &batch, NULL, 0);
+            ERR_clear_error();
+
+            /* Stop at the first failure so the output stays in order */
+            for (i = 0; i < n; i++) {
+                if (!items[i].status) {
+                    fprintf(stderr, "%s: record %lu: %s\n", prog,
+                            done + 1, ERR_error_string(items[i].error, NULL));
+                    failed++;
+                    rv = -1;
+                    break;
+                }
+                if (!write_record(out, outform, items[i].out,
+                                  items[i].outlen)) {
+                    fprintf(stderr, "%s: write error\n", prog);
+                    rv = -1;
+                    break;
+                }
+                done++;
+            }
+        }
+        if (rv <= 0)
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (fflush(out) != 0)
+        rv = -1;
+    if (rv == 0)
+        ret = 0;
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%s: %lu signatures in %.3fs (%.1f/s), %lu failed\n",
+            prog, done, secs, secs > 0 ? done / secs : 0.0, failed);
+
+ end:
+    if (ret != 0)
+        ERR_print_errors_fp(stderr);
+    if (out != NULL && out != stdout)
+        fclose(out);
+    if (reader_ok)
+        reader_close(&rd);
+    free(items);
+    free(inbuf);
+    free(outbuf);
+    RSA_free(rsa);
+    EVP_PKEY_free(pkey);
+    if (initialised)
+        ENGINE_finish(e);
+    ENGINE_free(e);
+    return ret;
+}
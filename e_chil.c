@@ -61,7 +61,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
 #include <ltdl.h>
 #include <openssl/crypto.h>
 #include <openssl/pem.h>
@@ -71,12 +84,37 @@
 #ifndef OPENSSL_NO_RSA
 # include <openssl/rsa.h>
 #endif
+#ifndef OPENSSL_NO_DSA
+# include <openssl/dsa.h>
+#endif
 #ifndef OPENSSL_NO_DH
 # include <openssl/dh.h>
 #endif
 #include <openssl/bn.h>
 
 #include "config.h"
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
+#if defined(HAVE_LINUX_FUTEX_H) && defined(HAVE_SYS_SYSCALL_H)
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# define HWCRHK_USE_FUTEX
+#endif
+/* The multi-buffer software exponentiation, see hwcrhk_mb_mod_exp() */
+#if defined(__x86_64__) && defined(__GNUC__) && defined(HAVE_CPUID_H) \
+    && defined(HAVE_IMMINTRIN_H) && !defined(HWCRHK_NO_MULTIBUFFER)
+# include <cpuid.h>
+# include <immintrin.h>
+# define HWCRHK_MB
+/* Older <cpuid.h> lack these */
+# ifndef bit_AVX512IFMA
+#  define bit_AVX512IFMA        (1 << 21)
+# endif
+# ifndef bit_ADX
+#  define bit_ADX               (1 << 19)
+# endif
+#endif
 
 /*-
  * Attribution notice: nCipher have said several times that it's OK for
@@ -88,11 +126,14 @@
  * [Richard Levitte]
  */
 #include "vendor_defns/hwcryptohook.h"
+#include "e_chil.h"
 
 #define HWCRHK_LIB_NAME "CHIL engine"
 #include "e_chil_err.c"
 
 static CRYPTO_RWLOCK *chil_lock;
+static CRYPTO_THREAD_LOCAL hwcrhk_thread_key;
+static void hwcrhk_thread_free(void *arg);
 
 static int hwcrhk_destroy(ENGINE *e);
 static int hwcrhk_init(ENGINE *e);
@@ -105,6 +146,11 @@ static int hwcrhk_mutex_init(HWCryptoHook_Mutex *,
 static int hwcrhk_mutex_lock(HWCryptoHook_Mutex *);
 static void hwcrhk_mutex_unlock(HWCryptoHook_Mutex *);
 static void hwcrhk_mutex_destroy(HWCryptoHook_Mutex *);
+static int hwcrhk_fast_mutex_init(HWCryptoHook_Mutex *,
+                                  HWCryptoHook_CallerContext *);
+static int hwcrhk_fast_mutex_lock(HWCryptoHook_Mutex *);
+static void hwcrhk_fast_mutex_unlock(HWCryptoHook_Mutex *);
+static void hwcrhk_fast_mutex_destroy(HWCryptoHook_Mutex *);
 
 /* BIGNUM stuff */
 static int hwcrhk_bn_mod_exp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
@@ -112,6 +158,8 @@ static int hwcrhk_bn_mod_exp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
 
 #ifndef OPENSSL_NO_RSA
 /* RSA stuff */
+static int hwcrhk_rsa_priv_enc(int flen, const unsigned char *from,
+                               unsigned char *to, RSA *rsa, int padding);
 static int hwcrhk_rsa_mod_exp(BIGNUM *r, const BIGNUM *I, RSA *rsa,
                               BN_CTX *ctx);
 /* This function is aliased to mod_exp (with the mont stuff dropped). */
@@ -119,6 +167,26 @@ static int hwcrhk_rsa_bn_mod_exp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
                                const BIGNUM *m, BN_CTX *ctx,
                                BN_MONT_CTX *m_ctx);
 static int hwcrhk_rsa_finish(RSA *rsa);
+static void hwcrhk_rsa_ex_new(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                              int idx, long argl, void *argp);
+static void hwcrhk_rsa_mont_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                                 int idx, long argl, void *argp);
+static int hwcrhk_rsa_batch(HWCRHK_RSA_BATCH *batch);
+static int hwcrhk_keys_set_max_resident(int max);
+static int hwcrhk_keys_top(HWCRHK_TOP_KEYS *top);
+#endif
+
+#ifndef OPENSSL_NO_DSA
+/* DSA stuff */
+/* This function is aliased to mod_exp (with the DSA and mont dropped). */
+static int hwcrhk_dsa_bn_mod_exp(DSA *dsa, BIGNUM *r, const BIGNUM *a,
+                                 const BIGNUM *p, const BIGNUM *m,
+                                 BN_CTX *ctx, BN_MONT_CTX *m_ctx);
+/* Dual exponentiation, a1^p1 * a2^p2 mod m, for signature verification */
+static int hwcrhk_dsa_mod_exp(DSA *dsa, BIGNUM *rr, const BIGNUM *a1,
+                              const BIGNUM *p1, const BIGNUM *a2,
+                              const BIGNUM *p2, const BIGNUM *m,
+                              BN_CTX *ctx, BN_MONT_CTX *in_mont);
 #endif
 
 #ifndef OPENSSL_NO_DH
@@ -128,12 +196,18 @@ static int hwcrhk_dh_bn_mod_exp(const DH *dh, BIGNUM *r,
                              const BIGNUM *a, const BIGNUM *p,
                              const BIGNUM *m, BN_CTX *ctx,
                              BN_MONT_CTX *m_ctx);
+/* Takes a key pair from the pool if it can */
+static int hwcrhk_dh_generate_key(DH *dh);
 #endif
 
 /* RAND stuff */
 static int hwcrhk_rand_bytes(unsigned char *buf, int num);
 static int hwcrhk_rand_status(void);
 
+/* Non-blocking submission stuff */
+static void hwcrhk_get_async_api(HWCRHK_ASYNC_API *api);
+static void hwcrhk_get_load_api(HWCRHK_LOAD_API *api);
+
 /* KM stuff */
 static EVP_PKEY *hwcrhk_load_privkey(ENGINE *eng, const char *key_id,
                                      UI_METHOD *ui_method,
@@ -161,6 +235,7 @@ static HWCryptoHook_MPI *hwcrhk_mpi_alloc(size_t size);
 static HWCryptoHook_MPI *hwcrhk_mpi_resize(HWCryptoHook_MPI *mpi, size_t size);
 static void hwcrhk_mpi_free(HWCryptoHook_MPI *mpi);
 static HWCryptoHook_MPI *hwcrhk_mpi_bn2mpi(const BIGNUM *bn);
+static int hwcrhk_mpi_set_bn(HWCryptoHook_MPI *mpi, const BIGNUM *bn);
 static BIGNUM *hwcrhk_mpi_mpi2bn(const HWCryptoHook_MPI *mpi, BIGNUM *ret);
 
 
@@ -170,6 +245,34 @@ static BIGNUM *hwcrhk_mpi_mpi2bn(const HWCryptoHook_MPI *mpi, BIGNUM *ret);
 #define HWCRHK_CMD_THREAD_LOCKING       (ENGINE_CMD_BASE + 2)
 #define HWCRHK_CMD_SET_USER_INTERFACE   (ENGINE_CMD_BASE + 3)
 #define HWCRHK_CMD_SET_CALLBACK_DATA    (ENGINE_CMD_BASE + 4)
+#define HWCRHK_CMD_MAX_SIMULTANEOUS     (ENGINE_CMD_BASE + 5)
+#define HWCRHK_CMD_RSA_BATCH            (ENGINE_CMD_BASE + 6)
+#define HWCRHK_CMD_GET_ASYNC_API        (ENGINE_CMD_BASE + 7)
+#define HWCRHK_CMD_LIMITER              (ENGINE_CMD_BASE + 8)
+#define HWCRHK_CMD_LIMITER_MAX          (ENGINE_CMD_BASE + 9)
+#define HWCRHK_CMD_LIMITER_WAIT         (ENGINE_CMD_BASE + 10)
+#define HWCRHK_CMD_DEADLINE             (ENGINE_CMD_BASE + 11)
+#define HWCRHK_CMD_SOFTWARE_FALLBACK    (ENGINE_CMD_BASE + 12)
+#define HWCRHK_CMD_GET_STATS            (ENGINE_CMD_BASE + 13)
+#define HWCRHK_CMD_BREAKER              (ENGINE_CMD_BASE + 14)
+#define HWCRHK_CMD_BREAKER_WINDOW       (ENGINE_CMD_BASE + 15)
+#define HWCRHK_CMD_BREAKER_TIMEOUT      (ENGINE_CMD_BASE + 16)
+#define HWCRHK_CMD_BREAKER_PROBE        (ENGINE_CMD_BASE + 17)
+#define HWCRHK_CMD_KEY_REPLICAS         (ENGINE_CMD_BASE + 18)
+#define HWCRHK_CMD_LAZY_INIT            (ENGINE_CMD_BASE + 19)
+#define HWCRHK_CMD_FAST_MUTEXES         (ENGINE_CMD_BASE + 20)
+#define HWCRHK_CMD_DSA_OFFLOAD          (ENGINE_CMD_BASE + 21)
+#define HWCRHK_CMD_DH_POOL_DEPTH        (ENGINE_CMD_BASE + 22)
+#define HWCRHK_CMD_DH_POOL_GROUP        (ENGINE_CMD_BASE + 23)
+#define HWCRHK_CMD_SPLIT_CRT            (ENGINE_CMD_BASE + 24)
+#define HWCRHK_CMD_SOFTWARE_BATCH       (ENGINE_CMD_BASE + 25)
+#define HWCRHK_CMD_SIGN_CACHE           (ENGINE_CMD_BASE + 26)
+#define HWCRHK_CMD_SIGN_CACHE_TTL       (ENGINE_CMD_BASE + 27)
+#define HWCRHK_CMD_KEY_INDEX            (ENGINE_CMD_BASE + 28)
+#define HWCRHK_CMD_KEY_RESIDENCY        (ENGINE_CMD_BASE + 29)
+#define HWCRHK_CMD_TOP_KEYS             (ENGINE_CMD_BASE + 30)
+#define HWCRHK_CMD_GET_LOAD_API         (ENGINE_CMD_BASE + 31)
+#define HWCRHK_CMD_TRACE                (ENGINE_CMD_BASE + 32)
 static const ENGINE_CMD_DEFN hwcrhk_cmd_defns[] = {
     {HWCRHK_CMD_SO_PATH,
      "SO_PATH",
@@ -191,12 +294,127 @@ static const ENGINE_CMD_DEFN hwcrhk_cmd_defns[] = {
      "SET_CALLBACK_DATA",
      "Set the global user interface extra data (internal)",
      ENGINE_CMD_FLAG_INTERNAL},
+    {HWCRHK_CMD_MAX_SIMULTANEOUS,
+     "MAX_SIMULTANEOUS",
+     "Specifies how many requests may be in flight at once (0 = default)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_RSA_BATCH,
+     "RSA_BATCH",
+     "Perform a batch of RSA private key operations (internal)",
+     ENGINE_CMD_FLAG_INTERNAL},
+    {HWCRHK_CMD_GET_ASYNC_API,
+     "GET_ASYNC_API",
+     "Get the non-blocking submission functions (internal)",
+     ENGINE_CMD_FLAG_INTERNAL},
+    {HWCRHK_CMD_LIMITER,
+     "LIMITER",
+     "Adaptive concurrency limit: off (0), reject (1) or defer (2) excess requests",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_LIMITER_MAX,
+     "LIMITER_MAX",
+     "Specifies the highest concurrency limit (0 = MAX_SIMULTANEOUS)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_LIMITER_WAIT,
+     "LIMITER_WAIT",
+     "Specifies how many milliseconds deferred requests may wait",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_DEADLINE,
+     "DEADLINE",
+     "Sets a deadline, in milliseconds from now, for the calling thread's requests (0 = none)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_SOFTWARE_FALLBACK,
+     "SOFTWARE_FALLBACK",
+     "Computes software keys' requests the HSM can't take in time in software (non-zero) or not (zero)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_GET_STATS,
+     "GET_STATS",
+     "Get the engine's counters (internal)",
+     ENGINE_CMD_FLAG_INTERNAL},
+    {HWCRHK_CMD_BREAKER,
+     "BREAKER",
+     "Specifies how many failures open the circuit breaker (0 = off)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_BREAKER_WINDOW,
+     "BREAKER_WINDOW",
+     "Specifies the window, in milliseconds, in which failures are counted",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_BREAKER_TIMEOUT,
+     "BREAKER_TIMEOUT",
+     "Specifies how many milliseconds a request may take before it counts as failed (0 = no limit)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_BREAKER_PROBE,
+     "BREAKER_PROBE",
+     "Specifies how many milliseconds apart the HSM is probed while the breaker is open",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_KEY_REPLICAS,
+     "KEY_REPLICAS",
+     "Specifies how many times each private key is loaded (key_id#N overrides)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_LAZY_INIT,
+     "LAZY_INIT",
+     "Loads the library in the background after ENGINE_init (non-zero) or in ENGINE_init (zero)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_FAST_MUTEXES,
+     "FAST_MUTEXES",
+     "Gives the library spinning mutexes (non-zero) or OpenSSL locks (zero)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_DSA_OFFLOAD,
+     "DSA_OFFLOAD",
+     "Sends DSA signing (1), or signing and verification (2), to the HSM (0 = neither)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_DH_POOL_DEPTH,
+     "DH_POOL_DEPTH",
+     "Specifies how many DH key pairs to make ahead of demand for each pool group (0 = off)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_DH_POOL_GROUP,
+     "DH_POOL_GROUP",
+     "Adds a DH group to the pool: modp2048, ffdhe2048, ... or a file of PEM DH parameters",
+     ENGINE_CMD_FLAG_STRING},
+    {HWCRHK_CMD_SPLIT_CRT,
+     "SPLIT_CRT",
+     "Splits CRT operations on software keys of at least this many bits into two parallel requests (0 = never)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_SOFTWARE_BATCH,
+     "SOFTWARE_BATCH",
+     "Batches software exponentiations with the best vector kernel (1, default), AVX2 only (2), or not (0)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_SIGN_CACHE,
+     "SIGN_CACHE",
+     "Specifies how many signatures made with HSM keys to keep for identical requests (0 = off)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_SIGN_CACHE_TTL,
+     "SIGN_CACHE_TTL",
+     "Specifies how many milliseconds cached signatures are kept (0 = no limit)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_KEY_INDEX,
+     "KEY_INDEX",
+     "Specifies a file in which to record the public keys of the keys loaded (empty = none)",
+     ENGINE_CMD_FLAG_STRING},
+    {HWCRHK_CMD_KEY_RESIDENCY,
+     "KEY_RESIDENCY",
+     "Specifies how many key handles may stay loaded, least recently used ones being unloaded (0 = no limit)",
+     ENGINE_CMD_FLAG_NUMERIC},
+    {HWCRHK_CMD_TOP_KEYS,
+     "TOP_KEYS",
+     "Get the keys with the most requests or the slowest ones (internal)",
+     ENGINE_CMD_FLAG_INTERNAL},
+    {HWCRHK_CMD_GET_LOAD_API,
+     "GET_LOAD_API",
+     "Get the functions reporting the load on the HSM (internal)",
+     ENGINE_CMD_FLAG_INTERNAL},
+    {HWCRHK_CMD_TRACE,
+     "TRACE",
+     "Specifies a file in which to record the requests made to the HSM (empty = none)",
+     ENGINE_CMD_FLAG_STRING},
     {0, NULL, NULL, 0}
 };
 
 #ifndef OPENSSL_NO_RSA
 static RSA_METHOD *hwcrhk_rsa = NULL;
 #endif
+#ifndef OPENSSL_NO_DSA
+static DSA_METHOD *hwcrhk_dsa = NULL;
+#endif
 #ifndef OPENSSL_NO_DH
 static DH_METHOD *hwcrhk_dh = NULL;
 #endif
@@ -226,6 +444,9 @@ static const char *engine_hwcrhk_id_alt = "ncipher";
  */
 struct HWCryptoHook_MutexValue {
     CRYPTO_RWLOCK *lock;
+    /* With FAST_MUTEXES, the lock itself, see hwcrhk_fast_mutex_lock() */
+    int state;
+    int spins;
 };
 
 /*
@@ -249,7 +470,6 @@ struct HWCryptoHook_CallerContextValue {
 };
 
 static BIO *logstream = NULL;
-static int disable_mutex_callbacks = 0;
 
 /*
  * One might wonder why these are needed, since one can pass down at least a
@@ -266,8 +486,105 @@ static int disable_mutex_callbacks = 0;
  * know what user interface callbacks to call, and having callback data from
  * the application may be a nice thing as well, so we need to keep track of
  * that globally.
+ *
+ * That, and the rest of the engine's settings, make up a snapshot that is
+ * never changed once published.  Snapshots live in a small ring: writers,
+ * with chil_lock held, fill in the slot after the current one and then
+ * publish it by advancing |generation|, so that a slot is only written
+ * again HWCRHK_CONFIG_SLOTS - 1 changes later.  Readers take no lock and
+ * write nothing shared: hwcrhk_config_get() copies the current snapshot
+ * and starts again in the unlikely case that so many changes were
+ * published meanwhile that its slot may have been reused.  Nothing is
+ * allocated, so settings may be changed as often as an application likes,
+ * for instance SET_CALLBACK_DATA for every connection.
+ */
+#define HWCRHK_CONFIG_SLOTS             8       /* a power of 2 */
+
+typedef struct {
+    HWCryptoHook_CallerContext password_context;
+    int fork_check;             /* "SimpleForkCheck" */
+    int disable_mutex_callbacks;
+    int fast_mutexes;
+    int maxsimultaneous;
+} HWCRHK_CONFIG;
+
+#define HWCRHK_CONFIG_DEFAULT   { { NULL, NULL, NULL }, 1, 0, 0, 0 }
+
+static struct {
+    unsigned int generation;    /* slots[generation % SLOTS] is current */
+    HWCRHK_CONFIG slots[HWCRHK_CONFIG_SLOTS];
+} hwcrhk_configs = { 0, { HWCRHK_CONFIG_DEFAULT } };
+
+/*
+ * Handed to the library as its caller context, which it keeps: the
+ * callbacks look up the current snapshot's instead, see hwcrhk_get_pass().
  */
-static HWCryptoHook_CallerContext password_context = { NULL, NULL, NULL };
+static HWCryptoHook_CallerContext hwcrhk_caller_context;
+
+/* Field by field, as a slot may be written while it is being read */
+static void hwcrhk_config_move(HWCRHK_CONFIG *to, const HWCRHK_CONFIG *from)
+{
+    __atomic_store_n(&to->password_context.password_callback,
+                     __atomic_load_n(&from->password_context.password_callback,
+                                     __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&to->password_context.ui_method,
+                     __atomic_load_n(&from->password_context.ui_method,
+                                     __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&to->password_context.callback_data,
+                     __atomic_load_n(&from->password_context.callback_data,
+                                     __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&to->fork_check,
+                     __atomic_load_n(&from->fork_check, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&to->disable_mutex_callbacks,
+                     __atomic_load_n(&from->disable_mutex_callbacks,
+                                     __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&to->fast_mutexes,
+                     __atomic_load_n(&from->fast_mutexes, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&to->maxsimultaneous,
+                     __atomic_load_n(&from->maxsimultaneous, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+static void hwcrhk_config_get(HWCRHK_CONFIG *config)
+{
+    unsigned int generation, now;
+
+    do {
+        generation = __atomic_load_n(&hwcrhk_configs.generation,
+                                     __ATOMIC_ACQUIRE);
+        hwcrhk_config_move(config, &hwcrhk_configs.slots[generation
+                                       & (HWCRHK_CONFIG_SLOTS - 1)]);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        now = __atomic_load_n(&hwcrhk_configs.generation, __ATOMIC_RELAXED);
+    } while (now - generation >= HWCRHK_CONFIG_SLOTS - 1);
+}
+
+/* With chil_lock held, until hwcrhk_config_publish() */
+static void hwcrhk_config_copy(HWCRHK_CONFIG *config)
+{
+    *config = hwcrhk_configs.slots[hwcrhk_configs.generation
+                                   & (HWCRHK_CONFIG_SLOTS - 1)];
+}
+
+static void hwcrhk_config_publish(const HWCRHK_CONFIG *config)
+{
+    unsigned int next = hwcrhk_configs.generation + 1;
+
+    /* Readers that see the slot change see |generation| move on */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    hwcrhk_config_move(&hwcrhk_configs.slots[next
+                           & (HWCRHK_CONFIG_SLOTS - 1)], config);
+    __atomic_store_n(&hwcrhk_configs.generation, next, __ATOMIC_RELEASE);
+}
+
+static void hwcrhk_config_reset(void)
+{
+    static const HWCRHK_CONFIG config = HWCRHK_CONFIG_DEFAULT;
+
+    hwcrhk_config_publish(&config);
+}
 
 /* Stuff to pass to the HWCryptoHook library */
 static HWCryptoHook_InitInfo hwcrhk_globals = {
@@ -282,7 +599,7 @@ static HWCryptoHook_InitInfo hwcrhk_globals = {
     /*
      * The next few are mutex stuff: we write wrapper functions around the OS
      * mutex functions.  We initialise them to 0 here, and change that to
-     * actual function pointers in hwcrhk_init() if dynamic locks are
+     * actual function pointers in get_context() if dynamic locks are
      * supported (that is, if the application programmer has made sure of
      * setting up callbacks bafore starting this engine) *and* if
      * disable_mutex_callbacks hasn't been set by a call to
@@ -331,6 +648,8 @@ static int bind_helper(ENGINE *e)
     chil_lock = CRYPTO_THREAD_lock_new();
     if (chil_lock == NULL)
         goto err;
+    if (!CRYPTO_THREAD_init_local(&hwcrhk_thread_key, hwcrhk_thread_free))
+        goto err;
 
 #ifndef OPENSSL_NO_RSA
     /* Setup RSA_METHOD */
@@ -351,8 +670,7 @@ static int bind_helper(ENGINE *e)
                                  RSA_meth_get_pub_enc(ossl_rsa_meth))
         || !RSA_meth_set_pub_dec(hwcrhk_rsa,
                                  RSA_meth_get_pub_dec(ossl_rsa_meth))
-        || !RSA_meth_set_priv_enc(hwcrhk_rsa,
-                                 RSA_meth_get_priv_enc(ossl_rsa_meth))
+        || !RSA_meth_set_priv_enc(hwcrhk_rsa, hwcrhk_rsa_priv_enc)
         || !RSA_meth_set_priv_dec(hwcrhk_rsa,
                                  RSA_meth_get_priv_dec(ossl_rsa_meth))
         || !RSA_meth_set_mod_exp(hwcrhk_rsa, hwcrhk_rsa_mod_exp)
@@ -362,6 +680,23 @@ static int bind_helper(ENGINE *e)
     }
 #endif
 
+#ifndef OPENSSL_NO_DSA
+    /*
+     * Setup DSA Method.  Signing and verification are OpenSSL's, which call
+     * back into the method for the exponentiations: g^k mod p when signing
+     * and g^u1 * y^u2 mod p when verifying.
+     */
+    hwcrhk_dsa = DSA_meth_dup(DSA_OpenSSL());
+    if (hwcrhk_dsa == NULL)
+        goto err;
+
+    if (   !DSA_meth_set1_name(hwcrhk_dsa, "CHIL DSA method")
+        || !DSA_meth_set_bn_mod_exp(hwcrhk_dsa, hwcrhk_dsa_bn_mod_exp)
+        || !DSA_meth_set_mod_exp(hwcrhk_dsa, hwcrhk_dsa_mod_exp)) {
+        goto err;
+    }
+#endif
+
 #ifndef OPENSSL_NO_DH
     /* Setup DH Method */
     hwcrhk_dh = DH_meth_new("CHIL DH method", 0);
@@ -370,11 +705,14 @@ static int bind_helper(ENGINE *e)
 
     /* Much the same for Diffie-Hellman */
     ossl_dh_meth = DH_OpenSSL();
-    if (   !DH_meth_set_generate_key(hwcrhk_dh,
-                                DH_meth_get_generate_key(ossl_dh_meth))
+    if (   !DH_meth_set_generate_key(hwcrhk_dh, hwcrhk_dh_generate_key)
         || !DH_meth_set_compute_key(hwcrhk_dh,
                                 DH_meth_get_compute_key(ossl_dh_meth))
-        || !DH_meth_set_bn_mod_exp(hwcrhk_dh, hwcrhk_dh_bn_mod_exp)) {
+        || !DH_meth_set_bn_mod_exp(hwcrhk_dh, hwcrhk_dh_bn_mod_exp)
+        /* which frees the Montgomery context generate_key caches */
+        || !DH_meth_set_init(hwcrhk_dh, DH_meth_get_init(ossl_dh_meth))
+        || !DH_meth_set_finish(hwcrhk_dh,
+                               DH_meth_get_finish(ossl_dh_meth))) {
         goto err;
     }
 
@@ -386,6 +724,9 @@ static int bind_helper(ENGINE *e)
 #ifndef OPENSSL_NO_RSA
         !ENGINE_set_RSA(e, hwcrhk_rsa) ||
 #endif
+#ifndef OPENSSL_NO_DSA
+        !ENGINE_set_DSA(e, hwcrhk_dsa) ||
+#endif
 #ifndef OPENSSL_NO_DH
         !ENGINE_set_DH(e, hwcrhk_dh) ||
 #endif
@@ -415,6 +756,10 @@ static int bind_helper(ENGINE *e)
     RSA_meth_free(hwcrhk_rsa);
     hwcrhk_rsa = NULL;
 #endif
+#ifndef OPENSSL_NO_DSA
+    DSA_meth_free(hwcrhk_dsa);
+    hwcrhk_dsa = NULL;
+#endif
 #ifndef OPENSSL_NO_DH
     DH_meth_free(hwcrhk_dh);
     hwcrhk_dh = NULL;
@@ -434,8 +779,332 @@ static HWCryptoHook_ContextHandle hwcrhk_context = 0;
 #ifndef OPENSSL_NO_RSA
 /* Index for KM handle.  Not really used yet. */
 static int hndidx_rsa = -1;
+/* Set once an RSA key has been looked at for an embedded key id */
+static int hndidx_rsa_embed = -1;
+/* The Montgomery contexts of a software key's primes, see HWCRHK_CRT_MONT */
+static int hndidx_rsa_mont = -1;
+
+/*
+ * What hndidx_rsa points at: the handles of a key loaded from the HSM.  A
+ * handle appears to serialise the requests made on it inside the library,
+ * so a hot key can be loaded more than once and its requests spread over
+ * the replicas in turn.
+ */
+# define HWCRHK_KEY_MAX_REPLICAS 64
+
+/*
+ * The requests made on a key, updated atomically.  Their latencies are
+ * counted in a log-linear histogram, with four buckets for every power of
+ * two microseconds from 16us, the last one taking anything over a second.
+ * The buckets are halved when one of them is about to overflow, which
+ * only favours recent requests a little.
+ */
+# define HWCRHK_LATENCY_BUCKETS 64
+# define HWCRHK_LATENCY_HALVE   0x80000000U
+
+typedef struct {
+    uint64_t ops;
+    uint64_t errors;
+    uint32_t latency[HWCRHK_LATENCY_BUCKETS];
+} HWCRHK_KEY_STATS;
+
+typedef struct hwcrhk_key_st HWCRHK_KEY;
+struct hwcrhk_key_st {
+    HWCRHK_KEY *prev, *next;    /* in hwcrhk_keys */
+    HWCRHK_KEY *older, *newer;  /* resident keys, see hwcrhk_keys */
+    char *name;
+    uint64_t serial;            /* never reused, unlike the address */
+    uint32_t trace_hash;        /* of the name, see HWCRHK_TRACE_RECORD */
+    HWCryptoHook_PassphraseContext ppctx; /* the loader's, for reloads */
+    unsigned int generation;    /* of the handles, see hwcrhk_fork */
+    unsigned int cursor;        /* round-robin cursor, updated atomically */
+    int replicas;               /* asked for */
+    int count;                  /* loaded */
+    int loading;                /* by one thread, which the others wait for */
+    int resident;               /* between older and newer */
+    int users;                  /* requests under way, with a residency limit */
+    HWCRHK_KEY_STATS stats;
+    HWCryptoHook_RSAKeyHandle handles[1];
+};
+
+/* The number of replicas for keys whose key_id doesn't say */
+static int hwcrhk_key_replicas = 1;
+
+/* The serial number of the last key allocated, updated atomically */
+static uint64_t hwcrhk_key_serial = 0;
+
+/*
+ * Every key loaded, so that they can be loaded again after a fork.  With
+ * "KEY_RESIDENCY", no more than that many handles stay loaded: the keys
+ * whose handles are loaded are kept in order of use, and those that
+ * aren't in use are unloaded, least recently used first, to make room for
+ * others.  A key that isn't loaded is treated as though it had been loaded
+ * before a fork, and loaded again when it is next used.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* signalled when a key is no longer loading,
+                                 * or room may have been made */
+    HWCRHK_KEY *head;
+    int max_resident;           /* "KEY_RESIDENCY", 0 for no limit */
+    int resident;               /* handles loaded, with a limit */
+    int pending;                /* handles being loaded or unloaded */
+    HWCRHK_KEY *oldest, *newest;
+} hwcrhk_keys = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
 #endif
 
+/*
+ * Fork handling.  Unless the library was told to expect it with
+ * SimpleForkCheck, its context and key handles are of no use in a child
+ * process, and may not be unloaded or finished there either.  A child
+ * therefore starts a new generation: the context is created again when
+ * it is first needed, and the keys loaded so far are loaded again in the
+ * background, or on demand if a request gets to them first.  Anything
+ * left over from an older generation is leaked on purpose.
+ */
+static struct {
+    pthread_mutex_t lock;
+    unsigned int generation;    /* only changes in hwcrhk_atfork_child() */
+    unsigned int context_generation;
+    int registered;
+    int reloading;              /* |reloader| has yet to be joined */
+    pthread_t reloader;
+} hwcrhk_fork = { PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Log messages, from the library as well as from the engine, are copied
+ * into a ring and written to |logstream| by a thread of their own, so
+ * that no request ever waits on the BIO.  The ring is a bounded MPSC
+ * queue: producers claim a slot by advancing |tail| and publish it by
+ * setting the slot's sequence number, and messages that find the ring full
+ * are dropped and counted.
+ *
+ * |logstream| is only dereferenced between hwcrhk_log_read_lock() and
+ * hwcrhk_log_read_unlock().  Readers are counted per epoch: a reader is
+ * counted in the epoch it saw when it started, and hwcrhk_log_swap()
+ * replaces the BIO, moves on to the next epoch and sleeps until the
+ * readers of the previous one are gone before freeing the old BIO.  Those
+ * are only the readers that started before the swap, so it never waits on
+ * later ones, however busy the log.
+ */
+#define HWCRHK_LOG_SLOTS                512     /* a power of 2 */
+#define HWCRHK_LOG_MAX_MESSAGE          256
+
+typedef struct {
+    size_t seq;
+    char message[HWCRHK_LOG_MAX_MESSAGE];
+} HWCRHK_LOG_SLOT;
+
+static struct {
+    size_t tail;                /* the next slot to claim */
+    size_t head;                /* the next slot to drain, drainer only */
+    uint64_t dropped;
+    unsigned int epoch;
+    unsigned int readers[2];    /* of |logstream|, by epoch parity */
+    int swapping;               /* hwcrhk_log_swap() waits for |gone| */
+    int running;                /* the drainer has been started */
+    int sleeping;               /* the drainer waits for |cond| */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_mutex_t swap_lock;  /* one swap at a time */
+    pthread_cond_t gone;        /* the previous epoch's readers are */
+    /* The rest is only touched with |lock| held */
+    int initialised;            /* the sequence numbers are set */
+    int stopping;
+    pthread_t thread;
+    HWCRHK_LOG_SLOT slots[HWCRHK_LOG_SLOTS];
+} hwcrhk_log = {
+    0, 0, 0, 0, {0, 0}, 0, 0, 0,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+static void hwcrhk_log_read_unlock(unsigned int epoch)
+{
+    if (__atomic_sub_fetch(&hwcrhk_log.readers[epoch & 1], 1,
+                           __ATOMIC_SEQ_CST) == 0
+        && __atomic_load_n(&hwcrhk_log.swapping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&hwcrhk_log.swap_lock);
+        pthread_cond_broadcast(&hwcrhk_log.gone);
+        pthread_mutex_unlock(&hwcrhk_log.swap_lock);
+    }
+}
+
+/* Sets |*epoch| to what hwcrhk_log_read_unlock() wants back */
+static BIO *hwcrhk_log_read_lock(unsigned int *epoch)
+{
+    unsigned int e;
+
+    for (;;) {
+        e = __atomic_load_n(&hwcrhk_log.epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&hwcrhk_log.readers[e & 1], 1, __ATOMIC_SEQ_CST);
+        /* Counted in |e| only if no swap has moved on from it meanwhile */
+        if (__atomic_load_n(&hwcrhk_log.epoch, __ATOMIC_SEQ_CST) == e)
+            break;
+        hwcrhk_log_read_unlock(e);
+    }
+    *epoch = e;
+    return __atomic_load_n(&logstream, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Takes over |bio|, which may be NULL.  The wait is bounded by the longest
+ * read under way, the drainer's being a ring's worth of messages.
+ */
+static void hwcrhk_log_swap(BIO *bio)
+{
+    BIO *old;
+    unsigned int e;
+
+    pthread_mutex_lock(&hwcrhk_log.swap_lock);
+    old = __atomic_exchange_n(&logstream, bio, __ATOMIC_SEQ_CST);
+    e = __atomic_fetch_add(&hwcrhk_log.epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&hwcrhk_log.swapping, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&hwcrhk_log.readers[e & 1], __ATOMIC_SEQ_CST) != 0)
+        pthread_cond_wait(&hwcrhk_log.gone, &hwcrhk_log.swap_lock);
+    __atomic_store_n(&hwcrhk_log.swapping, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&hwcrhk_log.swap_lock);
+    BIO_free(old);
+}
+
+static void hwcrhk_log_write(const char *message)
+{
+    unsigned int epoch;
+    BIO *bio = hwcrhk_log_read_lock(&epoch);
+
+    if (bio != NULL)
+        BIO_printf(bio, "%s\n", message);
+    hwcrhk_log_read_unlock(epoch);
+}
+
+static void *hwcrhk_log_main(void *arg)
+{
+    HWCRHK_LOG_SLOT *slot;
+    uint64_t dropped, reported = 0;
+    size_t head = hwcrhk_log.head, n;
+    char note[64];
+    unsigned int epoch;
+    BIO *bio;
+
+    for (;;) {
+        /* A ring's worth at a time, so that hwcrhk_log_swap() gets a turn */
+        bio = hwcrhk_log_read_lock(&epoch);
+        for (n = 0; n < HWCRHK_LOG_SLOTS; n++) {
+            slot = &hwcrhk_log.slots[head & (HWCRHK_LOG_SLOTS - 1)];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != head + 1)
+                break;
+            if (bio != NULL)
+                BIO_printf(bio, "%s\n", slot->message);
+            __atomic_store_n(&slot->seq, head + HWCRHK_LOG_SLOTS,
+                             __ATOMIC_RELEASE);
+            head++;
+        }
+        dropped = __atomic_load_n(&hwcrhk_log.dropped, __ATOMIC_RELAXED);
+        if (dropped != reported && bio != NULL) {
+            BIO_snprintf(note, sizeof(note),
+                         "CHIL engine: %llu log messages dropped",
+                         (unsigned long long)(dropped - reported));
+            BIO_printf(bio, "%s\n", note);
+        }
+        reported = dropped;
+        hwcrhk_log_read_unlock(epoch);
+        hwcrhk_log.head = head;
+        if (n == HWCRHK_LOG_SLOTS)
+            continue;
+
+        pthread_mutex_lock(&hwcrhk_log.lock);
+        __atomic_store_n(&hwcrhk_log.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != head + 1) {
+            if (hwcrhk_log.stopping) {
+                hwcrhk_log.sleeping = 0;
+                pthread_mutex_unlock(&hwcrhk_log.lock);
+                break;
+            }
+            pthread_cond_wait(&hwcrhk_log.cond, &hwcrhk_log.lock);
+        }
+        hwcrhk_log.sleeping = 0;
+        pthread_mutex_unlock(&hwcrhk_log.lock);
+    }
+
+    OPENSSL_thread_stop();
+    return NULL;
+}
+
+static int hwcrhk_log_start(void)
+{
+    size_t i;
+    int running;
+
+    pthread_mutex_lock(&hwcrhk_log.lock);
+    if (!hwcrhk_log.running && !hwcrhk_log.stopping) {
+        if (!hwcrhk_log.initialised) {
+            for (i = 0; i < HWCRHK_LOG_SLOTS; i++)
+                hwcrhk_log.slots[i].seq = i;
+            hwcrhk_log.head = hwcrhk_log.tail = 0;
+            hwcrhk_log.initialised = 1;
+        }
+        if (pthread_create(&hwcrhk_log.thread, NULL, hwcrhk_log_main,
+                           NULL) == 0)
+            __atomic_store_n(&hwcrhk_log.running, 1, __ATOMIC_RELEASE);
+    }
+    running = hwcrhk_log.running;
+    pthread_mutex_unlock(&hwcrhk_log.lock);
+    return running;
+}
+
+/* Writes out what is left in the ring and stops the drainer */
+static void hwcrhk_log_stop(void)
+{
+    pthread_mutex_lock(&hwcrhk_log.lock);
+    if (!hwcrhk_log.running) {
+        pthread_mutex_unlock(&hwcrhk_log.lock);
+        return;
+    }
+    hwcrhk_log.stopping = 1;
+    pthread_cond_signal(&hwcrhk_log.cond);
+    pthread_mutex_unlock(&hwcrhk_log.lock);
+
+    pthread_join(hwcrhk_log.thread, NULL);
+
+    pthread_mutex_lock(&hwcrhk_log.lock);
+    __atomic_store_n(&hwcrhk_log.running, 0, __ATOMIC_RELEASE);
+    hwcrhk_log.stopping = 0;
+    pthread_mutex_unlock(&hwcrhk_log.lock);
+}
+
+/* Never blocks, but for waking the drainer up */
+static void hwcrhk_log_push(const char *message)
+{
+    HWCRHK_LOG_SLOT *slot;
+    size_t pos = __atomic_load_n(&hwcrhk_log.tail, __ATOMIC_RELAXED);
+    size_t seq;
+
+    for (;;) {
+        slot = &hwcrhk_log.slots[pos & (HWCRHK_LOG_SLOTS - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&hwcrhk_log.tail, &pos, pos + 1,
+                                            1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if ((ptrdiff_t)(seq - pos) < 0) {
+            /* Still holds the message from the previous lap */
+            __atomic_add_fetch(&hwcrhk_log.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&hwcrhk_log.tail, __ATOMIC_RELAXED);
+        }
+    }
+    OPENSSL_strlcpy(slot->message, message, sizeof(slot->message));
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&hwcrhk_log.sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&hwcrhk_log.lock);
+        pthread_cond_signal(&hwcrhk_log.cond);
+        pthread_mutex_unlock(&hwcrhk_log.lock);
+    }
+}
+
 /*
  * These are the function pointers that are (un)set when the library has
  * successfully (un)loaded.
@@ -492,17 +1161,50 @@ static const char *n_hwcrhk_ModExpCRT = "HWCryptoHook_ModExpCRT";
  * checking and error handling is probably down there.
  */
 
-/* utility function to obtain a context */
-static int get_context(HWCryptoHook_ContextHandle * hac,
-                       HWCryptoHook_CallerContext * cac)
+/*
+ * utility function to obtain a context, with the current settings.  The
+ * password callbacks look the caller context up again when they are
+ * called, so the one handed to the library here is only for show.
+ */
+static int get_context(HWCryptoHook_ContextHandle * hac)
 {
     char tempbuf[1024];
     HWCryptoHook_ErrMsgBuf rmsg;
+    HWCRHK_CONFIG config;
 
     rmsg.buf = tempbuf;
     rmsg.size = sizeof(tempbuf);
 
-    *hac = p_hwcrhk_Init(&hwcrhk_globals, sizeof(hwcrhk_globals), &rmsg, cac);
+    hwcrhk_config_get(&config);
+    if (config.fork_check)
+        hwcrhk_globals.flags |= HWCryptoHook_InitFlags_SimpleForkCheck;
+    else
+        hwcrhk_globals.flags &= ~HWCryptoHook_InitFlags_SimpleForkCheck;
+    hwcrhk_globals.maxsimultaneous = config.maxsimultaneous;
+
+    /*
+     * Check if the application decided to support dynamic locks, and if it
+     * does, use them.
+     */
+    if (config.disable_mutex_callbacks == 0 && config.fast_mutexes) {
+        hwcrhk_globals.mutex_init = hwcrhk_fast_mutex_init;
+        hwcrhk_globals.mutex_acquire = hwcrhk_fast_mutex_lock;
+        hwcrhk_globals.mutex_release = hwcrhk_fast_mutex_unlock;
+        hwcrhk_globals.mutex_destroy = hwcrhk_fast_mutex_destroy;
+    } else if (config.disable_mutex_callbacks == 0) {
+        hwcrhk_globals.mutex_init = hwcrhk_mutex_init;
+        hwcrhk_globals.mutex_acquire = hwcrhk_mutex_lock;
+        hwcrhk_globals.mutex_release = hwcrhk_mutex_unlock;
+        hwcrhk_globals.mutex_destroy = hwcrhk_mutex_destroy;
+    } else {
+        hwcrhk_globals.mutex_init = NULL;
+        hwcrhk_globals.mutex_acquire = NULL;
+        hwcrhk_globals.mutex_release = NULL;
+        hwcrhk_globals.mutex_destroy = NULL;
+    }
+
+    *hac = p_hwcrhk_Init(&hwcrhk_globals, sizeof(hwcrhk_globals), &rmsg,
+                         &hwcrhk_caller_context);
     if (!*hac)
         return 0;
     return 1;
@@ -514,570 +1216,5442 @@ static void release_context(HWCryptoHook_ContextHandle hac)
     p_hwcrhk_Finish(hac);
 }
 
-/* Destructor (complements the "ENGINE_chil()" constructor) */
-static int hwcrhk_destroy(ENGINE *e)
-{
-    free_HWCRHK_LIBNAME();
-    ERR_unload_HWCRHK_strings();
-    CRYPTO_THREAD_lock_free(chil_lock);
-    return 1;
-}
+#ifndef OPENSSL_NO_RSA
+static void hwcrhk_keys_reload_start(void);
+static void hwcrhk_keys_reload_stop(void);
+#endif
 
-/* (de)initialisation functions. */
-static int hwcrhk_init(ENGINE *e)
+/*
+ * Make sure hwcrhk_context belongs to this process, creating a new one
+ * after a fork.  Returns 0 if that fails.
+ */
+static int hwcrhk_context_current(void)
 {
-    HWCryptoHook_Init_t *p1;
-    HWCryptoHook_Finish_t *p2;
-    HWCryptoHook_ModExp_t *p3;
+    HWCryptoHook_ContextHandle hac;
+    int ok;
+
+    if (__atomic_load_n(&hwcrhk_fork.context_generation, __ATOMIC_ACQUIRE)
+        == hwcrhk_fork.generation)
+        return 1;
+
+    pthread_mutex_lock(&hwcrhk_fork.lock);
+    ok = hwcrhk_fork.context_generation == hwcrhk_fork.generation;
+    if (!ok && get_context(&hac)) {
+        hwcrhk_context = hac;
+        __atomic_store_n(&hwcrhk_fork.context_generation,
+                         hwcrhk_fork.generation, __ATOMIC_RELEASE);
 #ifndef OPENSSL_NO_RSA
-    HWCryptoHook_RSA_t *p4;
-    HWCryptoHook_RSALoadKey_t *p5;
-    HWCryptoHook_RSAGetPublicKey_t *p6;
-    HWCryptoHook_RSAUnloadKey_t *p7;
+        hwcrhk_keys_reload_start();
 #endif
-    HWCryptoHook_RandomBytes_t *p8;
-    HWCryptoHook_ModExpCRT_t *p9;
-    const char *hwcrhk_name = get_HWCRHK_LIBNAME();
-    char *hwcrhk_libname = NULL;
-
-    if (hwcrhk_dso != NULL) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_INIT, HWCRHK_R_ALREADY_LOADED);
-        goto err;
+        ok = 1;
     }
+    pthread_mutex_unlock(&hwcrhk_fork.lock);
+    return ok;
+}
 
-    if (lt_dlinit() != 0) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_INIT, ERR_R_SYS_LIB);
-        ERR_add_error_data(2, "ltdl message: ", lt_dlerror());
-        goto err;
-    }
+/*
+ * The HWCryptoHook calls are synchronous within each calling thread, so the
+ * only way to keep several requests in flight on behalf of one caller is to
+ * make the calls from other threads.  This is a small pool of worker
+ * threads for that purpose.  Threads are started on demand, up to the
+ * number of simultaneous requests the library was told to expect, and are
+ * stopped in hwcrhk_finish().
+ *
+ * Jobs are intrusive: the submitter owns the HWCRHK_JOB and must keep it
+ * (and whatever it points at) alive until the job function has returned.
+ */
+#define HWCRHK_DEFAULT_SIMULTANEOUS 32
+#define HWCRHK_POOL_MAX_THREADS 256
+
+typedef struct hwcrhk_job_st HWCRHK_JOB;
+struct hwcrhk_job_st {
+    void (*fn) (void *arg);
+    void *arg;
+    HWCRHK_JOB *next;
+};
 
-    if (strncmp(hwcrhk_name, "lib", 3) != 0) {
-        /*
-        * hwcrhk_libname is the same as hwcrhk_name, but with "lib" prefixed.
-        * Make space for it
-        */
-        if ((hwcrhk_libname = malloc(strlen(hwcrhk_name) + 4)) == NULL) {
-            HWCRHKerr(HWCRHK_F_HWCRHK_INIT, ERR_R_MALLOC_FAILURE);
-            goto err;
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    HWCRHK_JOB *head, *tail;
+    int queued;
+    int idle;
+    int stopping;
+    int nthreads;
+    pthread_t threads[HWCRHK_POOL_MAX_THREADS];
+} hwcrhk_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int hwcrhk_simultaneous(void)
+{
+    HWCRHK_CONFIG config;
+
+    hwcrhk_config_get(&config);
+    if (config.maxsimultaneous > 0)
+        return config.maxsimultaneous;
+    return HWCRHK_DEFAULT_SIMULTANEOUS;
+}
+
+static void *hwcrhk_pool_worker(void *arg)
+{
+    HWCRHK_JOB *job;
+
+    pthread_mutex_lock(&hwcrhk_pool.lock);
+    for (;;) {
+        while (hwcrhk_pool.head == NULL && !hwcrhk_pool.stopping) {
+            hwcrhk_pool.idle++;
+            pthread_cond_wait(&hwcrhk_pool.cond, &hwcrhk_pool.lock);
+            hwcrhk_pool.idle--;
         }
-        strcpy(hwcrhk_libname, "lib");
-        strcat(hwcrhk_libname, hwcrhk_name);
+        /* When stopping, whatever was queued is still run first */
+        if ((job = hwcrhk_pool.head) == NULL)
+            break;
+        if ((hwcrhk_pool.head = job->next) == NULL)
+            hwcrhk_pool.tail = NULL;
+        hwcrhk_pool.queued--;
+        pthread_mutex_unlock(&hwcrhk_pool.lock);
+
+        job->fn(job->arg);
+
+        pthread_mutex_lock(&hwcrhk_pool.lock);
     }
+    pthread_mutex_unlock(&hwcrhk_pool.lock);
 
-    /* Attempt to load libnfhwcrhk.so/nfhwcrhk.dll/whatever. */
-    if (hwcrhk_libname != NULL) {
-        hwcrhk_dso = lt_dlopenext(hwcrhk_libname);
+    OPENSSL_thread_stop();
+    return NULL;
+}
+
+/*
+ * Queue a job, starting another worker if none is free to pick it up.
+ * Returns 0 if there is no worker at all to run it, in which case the
+ * caller must run it itself.
+ */
+static int hwcrhk_pool_submit(HWCRHK_JOB *job)
+{
+    int max = hwcrhk_simultaneous();
+
+    if (max > HWCRHK_POOL_MAX_THREADS)
+        max = HWCRHK_POOL_MAX_THREADS;
+
+    pthread_mutex_lock(&hwcrhk_pool.lock);
+    if (hwcrhk_pool.stopping) {
+        pthread_mutex_unlock(&hwcrhk_pool.lock);
+        return 0;
     }
-    if (hwcrhk_dso == NULL && (hwcrhk_dso = lt_dlopenext(hwcrhk_name)) == NULL) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_INIT, HWCRHK_R_DSO_FAILURE);
-        goto err;
+    if (hwcrhk_pool.queued >= hwcrhk_pool.idle
+        && hwcrhk_pool.nthreads < max
+        && pthread_create(&hwcrhk_pool.threads[hwcrhk_pool.nthreads], NULL,
+                          hwcrhk_pool_worker, NULL) == 0)
+        hwcrhk_pool.nthreads++;
+    if (hwcrhk_pool.nthreads == 0) {
+        pthread_mutex_unlock(&hwcrhk_pool.lock);
+        return 0;
     }
-    free(hwcrhk_libname);
 
-#define BINDIT(t, name) (t *)lt_dlsym(hwcrhk_dso, name)
-    if ((p1 = BINDIT(HWCryptoHook_Init_t, n_hwcrhk_Init)) == NULL
-        || (p2 = BINDIT(HWCryptoHook_Finish_t, n_hwcrhk_Finish)) == NULL
-        || (p3 = BINDIT(HWCryptoHook_ModExp_t, n_hwcrhk_ModExp)) == NULL
+    job->next = NULL;
+    if (hwcrhk_pool.tail != NULL)
+        hwcrhk_pool.tail->next = job;
+    else
+        hwcrhk_pool.head = job;
+    hwcrhk_pool.tail = job;
+    hwcrhk_pool.queued++;
+    pthread_cond_signal(&hwcrhk_pool.cond);
+    pthread_mutex_unlock(&hwcrhk_pool.lock);
+    return 1;
+}
+
+/* Run everything still queued and wait for all workers to exit */
+static void hwcrhk_pool_stop(void)
+{
+    int i, n;
+
+    pthread_mutex_lock(&hwcrhk_pool.lock);
+    hwcrhk_pool.stopping = 1;
+    pthread_cond_broadcast(&hwcrhk_pool.cond);
+    n = hwcrhk_pool.nthreads;
+    pthread_mutex_unlock(&hwcrhk_pool.lock);
+
+    for (i = 0; i < n; i++)
+        pthread_join(hwcrhk_pool.threads[i], NULL);
+
+    pthread_mutex_lock(&hwcrhk_pool.lock);
+    hwcrhk_pool.nthreads = 0;
+    hwcrhk_pool.stopping = 0;
+    pthread_mutex_unlock(&hwcrhk_pool.lock);
+}
+
 #ifndef OPENSSL_NO_RSA
-        || (p4 = BINDIT(HWCryptoHook_RSA_t, n_hwcrhk_RSA)) == NULL
-        || (p5 = BINDIT(HWCryptoHook_RSALoadKey_t, n_hwcrhk_RSALoadKey)) == NULL
-        || (p6 = BINDIT(HWCryptoHook_RSAGetPublicKey_t, n_hwcrhk_RSAGetPublicKey)) == NULL
-        || (p7 = BINDIT(HWCryptoHook_RSAUnloadKey_t, n_hwcrhk_RSAUnloadKey)) == NULL
-#endif
-        || (p8 = BINDIT(HWCryptoHook_RandomBytes_t, n_hwcrhk_RandomBytes)) == NULL
-        || (p9 = BINDIT(HWCryptoHook_ModExpCRT_t, n_hwcrhk_ModExpCRT)) == NULL) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_INIT, HWCRHK_R_DSO_FAILURE);
-        goto err;
+/*
+ * Unloading a key is a round trip to the HSM, which RSA_free() shouldn't
+ * have to wait for.  Handles are queued instead, and unloaded in batches
+ * by a reaper thread.  When the queue is full, or the thread can't be
+ * started, they are unloaded on the spot.  HWCryptoHook_Finish must not
+ * be called with keys still loaded, so hwcrhk_finish() flushes the queue
+ * first.
+ */
+# define HWCRHK_REAPER_QUEUE 1024
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    HWCryptoHook_RSAKeyHandle handles[HWCRHK_REAPER_QUEUE];
+    int head;
+    int count;
+    int running;
+    int stopping;
+    pthread_t thread;
+} hwcrhk_reaper = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void *hwcrhk_reaper_main(void *arg)
+{
+    HWCryptoHook_RSAKeyHandle batch[HWCRHK_REAPER_QUEUE];
+    int i, n;
+
+    pthread_mutex_lock(&hwcrhk_reaper.lock);
+    for (;;) {
+        while (hwcrhk_reaper.count == 0 && !hwcrhk_reaper.stopping)
+            pthread_cond_wait(&hwcrhk_reaper.cond, &hwcrhk_reaper.lock);
+        if (hwcrhk_reaper.count == 0)
+            break;
+        for (n = 0; hwcrhk_reaper.count > 0; n++) {
+            batch[n] = hwcrhk_reaper.handles[hwcrhk_reaper.head];
+            hwcrhk_reaper.head = (hwcrhk_reaper.head + 1) % HWCRHK_REAPER_QUEUE;
+            hwcrhk_reaper.count--;
+        }
+        pthread_mutex_unlock(&hwcrhk_reaper.lock);
+
+        for (i = 0; i < n; i++)
+            p_hwcrhk_RSAUnloadKey(batch[i], NULL);
+
+        pthread_mutex_lock(&hwcrhk_reaper.lock);
+    }
+    pthread_mutex_unlock(&hwcrhk_reaper.lock);
+
+    OPENSSL_thread_stop();
+    return NULL;
+}
+
+static void hwcrhk_reaper_add(const HWCryptoHook_RSAKeyHandle *handles, int n)
+{
+    int i = 0;
+
+    pthread_mutex_lock(&hwcrhk_reaper.lock);
+    if (!hwcrhk_reaper.running && !hwcrhk_reaper.stopping
+        && pthread_create(&hwcrhk_reaper.thread, NULL, hwcrhk_reaper_main,
+                          NULL) == 0)
+        hwcrhk_reaper.running = 1;
+    if (hwcrhk_reaper.running && !hwcrhk_reaper.stopping) {
+        for (; i < n && hwcrhk_reaper.count < HWCRHK_REAPER_QUEUE; i++) {
+            hwcrhk_reaper.handles[(hwcrhk_reaper.head + hwcrhk_reaper.count)
+                                  % HWCRHK_REAPER_QUEUE] = handles[i];
+            hwcrhk_reaper.count++;
+        }
+        pthread_cond_signal(&hwcrhk_reaper.cond);
+    }
+    pthread_mutex_unlock(&hwcrhk_reaper.lock);
+
+    for (; i < n; i++)
+        p_hwcrhk_RSAUnloadKey(handles[i], NULL);
+}
+
+/* Unload everything queued and wait for the reaper to exit */
+static void hwcrhk_reaper_stop(void)
+{
+    pthread_mutex_lock(&hwcrhk_reaper.lock);
+    if (!hwcrhk_reaper.running) {
+        pthread_mutex_unlock(&hwcrhk_reaper.lock);
+        return;
+    }
+    hwcrhk_reaper.stopping = 1;
+    pthread_cond_signal(&hwcrhk_reaper.cond);
+    pthread_mutex_unlock(&hwcrhk_reaper.lock);
+
+    pthread_join(hwcrhk_reaper.thread, NULL);
+
+    pthread_mutex_lock(&hwcrhk_reaper.lock);
+    hwcrhk_reaper.running = 0;
+    hwcrhk_reaper.stopping = 0;
+    pthread_mutex_unlock(&hwcrhk_reaper.lock);
+}
+#endif
+
+static uint64_t hwcrhk_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Per-thread state.  A thread's deadline applies to every request it makes
+ * until it is changed; worker threads take on the deadline of whoever
+ * handed them the work.  A deadline of 0 means none.
+ */
+typedef struct {
+    uint64_t deadline_ns;
+} HWCRHK_THREAD;
+
+static void hwcrhk_thread_free(void *arg)
+{
+    OPENSSL_free(arg);
+}
+
+static uint64_t hwcrhk_deadline_get(void)
+{
+    HWCRHK_THREAD *t = CRYPTO_THREAD_get_local(&hwcrhk_thread_key);
+
+    return t != NULL ? t->deadline_ns : 0;
+}
+
+static int hwcrhk_deadline_set(uint64_t deadline_ns)
+{
+    HWCRHK_THREAD *t = CRYPTO_THREAD_get_local(&hwcrhk_thread_key);
+
+    if (t == NULL) {
+        if (deadline_ns == 0)
+            return 1;
+        if ((t = OPENSSL_zalloc(sizeof(*t))) == NULL)
+            return 0;
+        if (!CRYPTO_THREAD_set_local(&hwcrhk_thread_key, t)) {
+            OPENSSL_free(t);
+            return 0;
+        }
+    }
+    t->deadline_ns = deadline_ns;
+    return 1;
+}
+
+/* Counters handed out by "GET_STATS", only ever updated atomically */
+static HWCRHK_STATS hwcrhk_stats;
+
+#define hwcrhk_stats_inc(field) \
+    __atomic_add_fetch(&hwcrhk_stats.field, 1, __ATOMIC_RELAXED)
+
+/*
+ * Whether requests the HSM can't take in time are computed in software
+ * instead, where all the operands are at hand.
+ */
+static int hwcrhk_software_fallback = 0;
+
+/*
+ * Whether software exponentiations are batched, see hwcrhk_mb_mod_exp(),
+ * and with which kernel.  Only AVX2 is there to compare the two on CPUs
+ * that have both.
+ */
+#define HWCRHK_SOFTWARE_BATCH_OFF       0
+#define HWCRHK_SOFTWARE_BATCH_BEST      1
+#define HWCRHK_SOFTWARE_BATCH_AVX2      2
+
+static int hwcrhk_software_batch = HWCRHK_SOFTWARE_BATCH_BEST;
+
+#ifndef OPENSSL_NO_DSA
+/*
+ * Which DSA exponentiations go to the HSM: none, as the default, only the
+ * one made when signing, or also the two made when verifying, since the
+ * library has no dual exponentiation.  See chil-bench -test dsa.
+ */
+# define HWCRHK_DSA_OFFLOAD_NONE        0
+# define HWCRHK_DSA_OFFLOAD_SIGN        1
+# define HWCRHK_DSA_OFFLOAD_ALL         2
+
+static int hwcrhk_dsa_offload = HWCRHK_DSA_OFFLOAD_NONE;
+#endif
+
+/*
+ * The size, in bits, from which CRT operations on keys held in software
+ * are split in two, see hwcrhk_mod_exp_crt_split().  0 never splits them.
+ */
+static int hwcrhk_split_crt_bits = 0;
+
+/*
+ * Admission control in front of the HSM.  Every request handed to the
+ * library is bracketed by hwcrhk_op_begin() and hwcrhk_op_end().  With the
+ * limiter enabled, at most |limit| requests are let through at a time,
+ * and |limit| follows an AIMD rule driven by the observed latency: it
+ * grows by one per round trip while requests complete within
+ * HWCRHK_LIMIT_TOLERANCE times the baseline latency and the limit is
+ * actually being used, and shrinks by HWCRHK_LIMIT_BACKOFF when they take
+ * longer, i.e. when requests start to queue inside the library or the
+ * module.  Requests over the limit fail straight away with
+ * HWCRHK_R_OVERLOADED or, in defer mode, wait a bounded time for a slot.
+ *
+ * The admission path is a compare-and-swap on the in-flight counter; the
+ * limit itself is recomputed under a lock that is only ever tried.
+ */
+#define HWCRHK_LIMIT_OFF        0
+#define HWCRHK_LIMIT_REJECT     1
+#define HWCRHK_LIMIT_DEFER      2
+#define HWCRHK_LIMIT_TOLERANCE  2
+#define HWCRHK_LIMIT_BACKOFF    0.9
+#define HWCRHK_LIMIT_WINDOW     256
+#define HWCRHK_LIMIT_DEFAULT_WAIT 100   /* milliseconds */
+
+static struct {
+    int mode;
+    int max;                    /* 0 = number of simultaneous requests */
+    int wait_ms;
+    unsigned int inflight;
+    unsigned int limit;
+    unsigned int waiters;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* The rest is only touched with |lock| held */
+    double climit;
+    uint64_t base_ns;           /* baseline (no queueing) latency */
+    uint64_t window_min_ns;
+    unsigned int window_samples;
+    uint64_t last_backoff_ns;
+} hwcrhk_limiter = {
+    HWCRHK_LIMIT_OFF, 0, HWCRHK_LIMIT_DEFAULT_WAIT, 0, 0, 0,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t deadline_ns;
+    unsigned int inflight;      /* including this one, at admission */
+} HWCRHK_OP;
+
+/*
+ * Moving average of the time requests take once they are handed to the
+ * library, queueing inside it and the module included, updated
+ * atomically; each new one counts for 1/HWCRHK_SERVICE_WEIGHT.
+ */
+#define HWCRHK_SERVICE_WEIGHT   16
+
+static uint64_t hwcrhk_service_ns = 0;
+
+/* hwcrhk_op_begin() results */
+#define HWCRHK_OP_FAIL          0
+#define HWCRHK_OP_HSM           1
+#define HWCRHK_OP_SOFTWARE      2
+
+static int hwcrhk_limiter_max(void)
+{
+    if (hwcrhk_limiter.max > 0)
+        return hwcrhk_limiter.max;
+    return hwcrhk_simultaneous();
+}
+
+static void hwcrhk_limiter_reset(void)
+{
+    pthread_mutex_lock(&hwcrhk_limiter.lock);
+    hwcrhk_limiter.climit = hwcrhk_limiter_max();
+    __atomic_store_n(&hwcrhk_limiter.limit, (unsigned int)hwcrhk_limiter.climit,
+                     __ATOMIC_RELAXED);
+    hwcrhk_limiter.base_ns = 0;
+    hwcrhk_limiter.window_min_ns = 0;
+    hwcrhk_limiter.window_samples = 0;
+    pthread_cond_broadcast(&hwcrhk_limiter.cond);
+    pthread_mutex_unlock(&hwcrhk_limiter.lock);
+}
+
+/* Take an in-flight slot if there is one below the limit */
+static int hwcrhk_limiter_try(unsigned int *inflight)
+{
+    unsigned int cur = __atomic_load_n(&hwcrhk_limiter.inflight,
+                                       __ATOMIC_RELAXED);
+
+    do {
+        if (cur >= __atomic_load_n(&hwcrhk_limiter.limit, __ATOMIC_RELAXED))
+            return 0;
+    } while (!__atomic_compare_exchange_n(&hwcrhk_limiter.inflight, &cur,
+                                          cur + 1, 1, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+    *inflight = cur + 1;
+    return 1;
+}
+
+/* Wait for a slot, giving up after LIMITER_WAIT or at |until_ns| */
+static int hwcrhk_limiter_wait(unsigned int *inflight, uint64_t now,
+                               uint64_t until_ns)
+{
+    struct timespec deadline;
+    uint64_t wait_ns = (uint64_t)hwcrhk_limiter.wait_ms * 1000000;
+    int ok, rv = 0;
+
+    if (until_ns != 0 && until_ns - now < wait_ns)
+        wait_ns = until_ns - now;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_ns / 1000000000;
+    deadline.tv_nsec += (long)(wait_ns % 1000000000);
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&hwcrhk_limiter.lock);
+    hwcrhk_limiter.waiters++;
+    while (!(ok = hwcrhk_limiter_try(inflight)) && rv == 0)
+        rv = pthread_cond_timedwait(&hwcrhk_limiter.cond, &hwcrhk_limiter.lock,
+                                    &deadline);
+    hwcrhk_limiter.waiters--;
+    pthread_mutex_unlock(&hwcrhk_limiter.lock);
+    return ok;
+}
+
+static void hwcrhk_limiter_sample(const HWCRHK_OP *op, uint64_t now)
+{
+    uint64_t lat = now - op->start_ns;
+    unsigned int limit;
+
+    if (pthread_mutex_trylock(&hwcrhk_limiter.lock) != 0)
+        return;
+
+    if (hwcrhk_limiter.window_samples == 0
+        || lat < hwcrhk_limiter.window_min_ns)
+        hwcrhk_limiter.window_min_ns = lat;
+    if (++hwcrhk_limiter.window_samples >= HWCRHK_LIMIT_WINDOW) {
+        /*
+         * The baseline follows the lowest latency seen, and only creeps
+         * upwards so that sustained queueing can't pass itself off as the
+         * new normal.
+         */
+        if (hwcrhk_limiter.base_ns == 0
+            || hwcrhk_limiter.window_min_ns < hwcrhk_limiter.base_ns)
+            hwcrhk_limiter.base_ns = hwcrhk_limiter.window_min_ns;
+        else
+            hwcrhk_limiter.base_ns +=
+                (hwcrhk_limiter.window_min_ns - hwcrhk_limiter.base_ns) / 8;
+        hwcrhk_limiter.window_samples = 0;
+    }
+    if (hwcrhk_limiter.base_ns == 0)
+        hwcrhk_limiter.base_ns = lat;
+
+    if (lat > HWCRHK_LIMIT_TOLERANCE * hwcrhk_limiter.base_ns) {
+        /* At most one backoff per round trip */
+        if (now - hwcrhk_limiter.last_backoff_ns > lat) {
+            hwcrhk_limiter.climit *= HWCRHK_LIMIT_BACKOFF;
+            hwcrhk_limiter.last_backoff_ns = now;
+        }
+    } else if (op->inflight + 1 >= (unsigned int)hwcrhk_limiter.climit) {
+        hwcrhk_limiter.climit += 1.0 / hwcrhk_limiter.climit;
+    }
+    if (hwcrhk_limiter.climit < 1)
+        hwcrhk_limiter.climit = 1;
+    if (hwcrhk_limiter.climit > hwcrhk_limiter_max())
+        hwcrhk_limiter.climit = hwcrhk_limiter_max();
+
+    limit = (unsigned int)hwcrhk_limiter.climit;
+    if (limit > __atomic_load_n(&hwcrhk_limiter.limit, __ATOMIC_RELAXED))
+        pthread_cond_broadcast(&hwcrhk_limiter.cond);
+    __atomic_store_n(&hwcrhk_limiter.limit, limit, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&hwcrhk_limiter.lock);
+}
+
+/*
+ * Circuit breaker.  A module that hangs or reboots makes every call block
+ * until the library gives up, one thread after another.  Once |threshold|
+ * requests have failed, or taken longer than |timeout_ms|, within
+ * |window_ms| of each other, the breaker opens and requests are refused
+ * straight away (or computed in software, see hwcrhk_op_begin()) while a
+ * background thread probes the module with a small RandomBytes request
+ * every |probe_ms|.  The first probe that succeeds closes it again.
+ */
+#define HWCRHK_BREAKER_CLOSED   0
+#define HWCRHK_BREAKER_OPEN     1
+#define HWCRHK_BREAKER_DEFAULT_WINDOW   10000   /* milliseconds */
+#define HWCRHK_BREAKER_DEFAULT_PROBE    1000    /* milliseconds */
+
+static struct {
+    int threshold;              /* 0 = off */
+    int window_ms;
+    int timeout_ms;             /* 0 = only errors count */
+    int probe_ms;
+    int state;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* wakes the prober up */
+    /* The rest is only touched with |lock| held */
+    int failures;
+    uint64_t window_start_ns;
+    int probing;                /* the prober is running */
+    int joinable;               /* |prober| has yet to be joined */
+    int stopping;
+    pthread_t prober;
+} hwcrhk_breaker = {
+    0, HWCRHK_BREAKER_DEFAULT_WINDOW, 0, HWCRHK_BREAKER_DEFAULT_PROBE,
+    HWCRHK_BREAKER_CLOSED, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+static int hwcrhk_breaker_open(void)
+{
+    return __atomic_load_n(&hwcrhk_breaker.state, __ATOMIC_ACQUIRE)
+        == HWCRHK_BREAKER_OPEN;
+}
+
+static void *hwcrhk_breaker_prober(void *arg)
+{
+    char tempbuf[1024];
+    HWCryptoHook_ErrMsgBuf rmsg;
+    unsigned char buf[8];
+    struct timespec next;
+    int ret;
+
+    rmsg.buf = tempbuf;
+    rmsg.size = sizeof(tempbuf);
+
+    pthread_mutex_lock(&hwcrhk_breaker.lock);
+    while (!hwcrhk_breaker.stopping && hwcrhk_breaker_open()) {
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec += hwcrhk_breaker.probe_ms / 1000;
+        next.tv_nsec += (long)(hwcrhk_breaker.probe_ms % 1000) * 1000000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&hwcrhk_breaker.cond, &hwcrhk_breaker.lock,
+                                   &next) != ETIMEDOUT)
+            continue;
+        pthread_mutex_unlock(&hwcrhk_breaker.lock);
+
+        ret = p_hwcrhk_RandomBytes(hwcrhk_context, buf, sizeof(buf), &rmsg);
+
+        pthread_mutex_lock(&hwcrhk_breaker.lock);
+        if (ret == 0) {
+            hwcrhk_breaker.failures = 0;
+            __atomic_store_n(&hwcrhk_breaker.state, HWCRHK_BREAKER_CLOSED,
+                             __ATOMIC_RELEASE);
+            hwcrhk_log_message(&logstream,
+                               "CHIL engine: HSM circuit breaker closed");
+        }
+    }
+    hwcrhk_breaker.probing = 0;
+    pthread_mutex_unlock(&hwcrhk_breaker.lock);
+
+    OPENSSL_cleanse(buf, sizeof(buf));
+    OPENSSL_thread_stop();
+    return NULL;
+}
+
+static void hwcrhk_breaker_failure(uint64_t now)
+{
+    pthread_mutex_lock(&hwcrhk_breaker.lock);
+    if (hwcrhk_breaker.threshold == 0 || hwcrhk_breaker.stopping
+        || hwcrhk_breaker_open())
+        goto end;
+    if (hwcrhk_breaker.failures == 0 || now - hwcrhk_breaker.window_start_ns
+        > (uint64_t)hwcrhk_breaker.window_ms * 1000000) {
+        hwcrhk_breaker.failures = 0;
+        hwcrhk_breaker.window_start_ns = now;
+    }
+    if (++hwcrhk_breaker.failures < hwcrhk_breaker.threshold)
+        goto end;
+
+    /* Without a prober, nothing would ever close the breaker again */
+    if (!hwcrhk_breaker.probing) {
+        if (hwcrhk_breaker.joinable) {
+            pthread_join(hwcrhk_breaker.prober, NULL);
+            hwcrhk_breaker.joinable = 0;
+        }
+        if (pthread_create(&hwcrhk_breaker.prober, NULL,
+                           hwcrhk_breaker_prober, NULL) != 0)
+            goto end;
+        hwcrhk_breaker.probing = hwcrhk_breaker.joinable = 1;
+    }
+    __atomic_store_n(&hwcrhk_breaker.state, HWCRHK_BREAKER_OPEN,
+                     __ATOMIC_RELEASE);
+    hwcrhk_stats_inc(breaker_trips);
+    hwcrhk_log_message(&logstream, "CHIL engine: HSM circuit breaker opened");
+
+ end:
+    pthread_mutex_unlock(&hwcrhk_breaker.lock);
+}
+
+/* Close the breaker and stop the prober */
+static void hwcrhk_breaker_reset(void)
+{
+    pthread_mutex_lock(&hwcrhk_breaker.lock);
+    hwcrhk_breaker.stopping = 1;
+    pthread_cond_broadcast(&hwcrhk_breaker.cond);
+    if (hwcrhk_breaker.joinable) {
+        pthread_mutex_unlock(&hwcrhk_breaker.lock);
+        pthread_join(hwcrhk_breaker.prober, NULL);
+        pthread_mutex_lock(&hwcrhk_breaker.lock);
+        hwcrhk_breaker.joinable = 0;
+    }
+    hwcrhk_breaker.stopping = 0;
+    hwcrhk_breaker.failures = 0;
+    __atomic_store_n(&hwcrhk_breaker.state, HWCRHK_BREAKER_CLOSED,
+                     __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&hwcrhk_breaker.lock);
+}
+
+/*
+ * Called before handing a request to the library.  Returns HWCRHK_OP_HSM
+ * if the request is to be made, in which case hwcrhk_op_end() must follow.
+ * Requests that are turned away, or that are already past the calling
+ * thread's deadline, are never submitted: with |software| set and
+ * SOFTWARE_FALLBACK on, the caller is told to compute the result itself
+ * (HWCRHK_OP_SOFTWARE), otherwise HWCRHK_OP_FAIL is returned with an error
+ * raised on behalf of |func|.
+ */
+static int hwcrhk_op_begin(HWCRHK_OP *op, int func, int software)
+{
+    int reason = HWCRHK_R_OVERLOADED;
+    int admitted = 1;
+
+    op->deadline_ns = hwcrhk_deadline_get();
+    op->start_ns = hwcrhk_now_ns();
+    if (op->deadline_ns != 0 && op->start_ns >= op->deadline_ns) {
+        reason = HWCRHK_R_DEADLINE_EXCEEDED;
+        goto refused;
+    }
+    if (!hwcrhk_context_current()) {
+        reason = HWCRHK_R_UNIT_FAILURE;
+        goto refused;
+    }
+    if (hwcrhk_breaker_open()) {
+        reason = HWCRHK_R_HSM_UNAVAILABLE;
+        goto refused;
+    }
+
+    switch (hwcrhk_limiter.mode) {
+    case HWCRHK_LIMIT_OFF:
+        op->inflight = __atomic_add_fetch(&hwcrhk_limiter.inflight, 1,
+                                          __ATOMIC_RELAXED);
+        break;
+    case HWCRHK_LIMIT_REJECT:
+        admitted = hwcrhk_limiter_try(&op->inflight);
+        break;
+    case HWCRHK_LIMIT_DEFER:
+        if (!hwcrhk_limiter_try(&op->inflight)) {
+            admitted = hwcrhk_limiter_wait(&op->inflight, op->start_ns,
+                                           op->deadline_ns);
+            op->start_ns = hwcrhk_now_ns();
+        }
+        break;
+    }
+    if (!admitted) {
+        if (op->deadline_ns != 0 && op->start_ns >= op->deadline_ns)
+            reason = HWCRHK_R_DEADLINE_EXCEEDED;
+        goto refused;
+    }
+    return HWCRHK_OP_HSM;
+
+ refused:
+    if (reason == HWCRHK_R_DEADLINE_EXCEEDED)
+        hwcrhk_stats_inc(deadline_dropped);
+    else if (reason == HWCRHK_R_HSM_UNAVAILABLE)
+        hwcrhk_stats_inc(breaker_rejected);
+    else if (reason == HWCRHK_R_OVERLOADED)
+        hwcrhk_stats_inc(overloaded);
+    if (software && hwcrhk_software_fallback) {
+        hwcrhk_stats_inc(software_fallbacks);
+        return HWCRHK_OP_SOFTWARE;
+    }
+    HWCRHKerr(func, reason);
+    return HWCRHK_OP_FAIL;
+}
+
+static void hwcrhk_service_sample(uint64_t ns)
+{
+    uint64_t avg = __atomic_load_n(&hwcrhk_service_ns, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        next = avg == 0 ? ns : avg - avg / HWCRHK_SERVICE_WEIGHT
+                               + ns / HWCRHK_SERVICE_WEIGHT;
+    } while (!__atomic_compare_exchange_n(&hwcrhk_service_ns, &avg, next, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+}
+
+/* Called with the library's return code once the request is done */
+static void hwcrhk_op_end(HWCRHK_OP *op, int ret)
+{
+    uint64_t now = hwcrhk_now_ns();
+
+    __atomic_sub_fetch(&hwcrhk_limiter.inflight, 1, __ATOMIC_RELEASE);
+    if (op->deadline_ns != 0 && now > op->deadline_ns)
+        hwcrhk_stats_inc(deadline_late);
+    if (ret >= 0)
+        hwcrhk_service_sample(now - op->start_ns);
+    if (hwcrhk_breaker.threshold > 0
+        && (ret == HWCRYPTOHOOK_ERROR_FAILED
+            || ret == HWCRYPTOHOOK_ERROR_FALLBACK
+            || (hwcrhk_breaker.timeout_ms > 0 && now - op->start_ns
+                > (uint64_t)hwcrhk_breaker.timeout_ms * 1000000)))
+        hwcrhk_breaker_failure(now);
+    if (hwcrhk_limiter.mode == HWCRHK_LIMIT_OFF)
+        return;
+
+    /* Failures say nothing about queueing */
+    if (ret >= 0)
+        hwcrhk_limiter_sample(op, now);
+    if (__atomic_load_n(&hwcrhk_limiter.waiters, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&hwcrhk_limiter.lock);
+        pthread_cond_signal(&hwcrhk_limiter.cond);
+        pthread_mutex_unlock(&hwcrhk_limiter.lock);
+    }
+}
+
+/*
+ * "GET_LOAD_API".  Requests wait to be sent to the HSM in the limiter's
+ * defer mode and on the worker pool's queue (non-blocking submissions and
+ * split CRT halves), and inside the library once there are more in flight
+ * than it is allowed to have at once.  A new request is estimated to wait
+ * for those ahead of it beyond that number, which drain at the rate
+ * requests complete: as many as are in flight (or the number of slots,
+ * if fewer) per average service time.
+ */
+static void hwcrhk_load_get(HWCRHK_LOAD *load)
+{
+    uint64_t ahead;
+
+    load->inflight = __atomic_load_n(&hwcrhk_limiter.inflight,
+                                     __ATOMIC_RELAXED);
+    load->waiting = __atomic_load_n(&hwcrhk_limiter.waiters, __ATOMIC_RELAXED)
+                    + __atomic_load_n(&hwcrhk_pool.queued, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&hwcrhk_limiter.mode, __ATOMIC_RELAXED)
+        != HWCRHK_LIMIT_OFF)
+        load->slots = __atomic_load_n(&hwcrhk_limiter.limit, __ATOMIC_RELAXED);
+    else
+        load->slots = hwcrhk_simultaneous();
+    if (load->slots == 0)
+        load->slots = 1;
+    load->service_ns = __atomic_load_n(&hwcrhk_service_ns, __ATOMIC_RELAXED);
+
+    ahead = (uint64_t)load->inflight + load->waiting + 1;
+    load->queue_delay_ns = ahead > load->slots
+        ? (ahead - load->slots) * load->service_ns
+          / (load->inflight > load->slots ? load->inflight : load->slots)
+        : 0;
+}
+
+static uint64_t hwcrhk_load_queue_delay_ns(void)
+{
+    HWCRHK_LOAD load;
+
+    hwcrhk_load_get(&load);
+    return load.queue_delay_ns;
+}
+
+static void hwcrhk_get_load_api(HWCRHK_LOAD_API *api)
+{
+    memset(api, 0, sizeof(*api));
+    api->get = hwcrhk_load_get;
+    api->queue_delay_ns = hwcrhk_load_queue_delay_ns;
+}
+
+/*
+ * "TRACE" records every request handed to the library, and every key
+ * handle loaded, in a file that chil-replay plays back.  The records go
+ * through a bounded MPSC ring like the log messages' (see hwcrhk_log),
+ * and are written out in batches by a thread of their own; those that
+ * find the ring full are dropped and counted.  The file is opened with
+ * O_APPEND, so that child processes can add their records to it.
+ */
+#define HWCRHK_TRACE_SLOTS              4096    /* a power of 2 */
+#define HWCRHK_TRACE_BATCH              256
+
+typedef struct {
+    size_t seq;
+    HWCRHK_TRACE_RECORD record;
+} HWCRHK_TRACE_SLOT;
+
+static struct {
+    size_t tail;                /* the next slot to claim */
+    size_t head;                /* the next slot to drain, drainer only */
+    uint64_t dropped;
+    int active;                 /* records are wanted */
+    int writers;                /* in hwcrhk_trace_add() while active */
+    int running;                /* the drainer has been started */
+    int sleeping;               /* the drainer waits for |cond| */
+    int fd;
+    uint64_t start_ns;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* The rest is only touched with |lock| held */
+    int initialised;            /* the sequence numbers are set */
+    int stopping;
+    pthread_t thread;
+    HWCRHK_TRACE_SLOT slots[HWCRHK_TRACE_SLOTS];
+} hwcrhk_trace = {
+    0, 0, 0, 0, 0, 0, 0, -1, 0, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER
+};
+
+static void hwcrhk_trace_write(const HWCRHK_TRACE_RECORD *records, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)records;
+    size_t len = n * sizeof(*records);
+    ssize_t done;
+
+    while (len > 0) {
+        if ((done = write(hwcrhk_trace.fd, p, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            /* Nothing more will get through */
+            __atomic_add_fetch(&hwcrhk_trace.dropped,
+                               len / sizeof(*records), __ATOMIC_RELAXED);
+            return;
+        }
+        p += done;
+        len -= done;
+    }
+}
+
+static void *hwcrhk_trace_main(void *arg)
+{
+    HWCRHK_TRACE_RECORD batch[HWCRHK_TRACE_BATCH];
+    HWCRHK_TRACE_SLOT *slot;
+    size_t head = hwcrhk_trace.head, n;
+
+    for (;;) {
+        for (n = 0; n < HWCRHK_TRACE_BATCH; n++) {
+            slot = &hwcrhk_trace.slots[head & (HWCRHK_TRACE_SLOTS - 1)];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != head + 1)
+                break;
+            batch[n] = slot->record;
+            __atomic_store_n(&slot->seq, head + HWCRHK_TRACE_SLOTS,
+                             __ATOMIC_RELEASE);
+            head++;
+        }
+        if (n > 0)
+            hwcrhk_trace_write(batch, n);
+        hwcrhk_trace.head = head;
+        if (n == HWCRHK_TRACE_BATCH)
+            continue;
+
+        pthread_mutex_lock(&hwcrhk_trace.lock);
+        __atomic_store_n(&hwcrhk_trace.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != head + 1) {
+            if (hwcrhk_trace.stopping) {
+                hwcrhk_trace.sleeping = 0;
+                pthread_mutex_unlock(&hwcrhk_trace.lock);
+                break;
+            }
+            pthread_cond_wait(&hwcrhk_trace.cond, &hwcrhk_trace.lock);
+        }
+        hwcrhk_trace.sleeping = 0;
+        pthread_mutex_unlock(&hwcrhk_trace.lock);
+    }
+
+    return NULL;
+}
+
+/* Started on the first record, in a child process too */
+static int hwcrhk_trace_start(void)
+{
+    size_t i;
+    int running;
+
+    pthread_mutex_lock(&hwcrhk_trace.lock);
+    if (hwcrhk_trace.active && !hwcrhk_trace.running
+        && !hwcrhk_trace.stopping) {
+        if (!hwcrhk_trace.initialised) {
+            for (i = 0; i < HWCRHK_TRACE_SLOTS; i++)
+                hwcrhk_trace.slots[i].seq = i;
+            hwcrhk_trace.head = hwcrhk_trace.tail = 0;
+            hwcrhk_trace.initialised = 1;
+        }
+        if (pthread_create(&hwcrhk_trace.thread, NULL, hwcrhk_trace_main,
+                           NULL) == 0)
+            __atomic_store_n(&hwcrhk_trace.running, 1, __ATOMIC_RELEASE);
+    }
+    running = hwcrhk_trace.running;
+    pthread_mutex_unlock(&hwcrhk_trace.lock);
+    return running;
+}
+
+/*
+ * Writes out what is left in the ring, stops the drainer and the trace.
+ * Records still being added are waited for, and the ring is set up afresh
+ * for the next trace, so that none of this one's ends up in its file.
+ */
+static void hwcrhk_trace_stop(void)
+{
+    pthread_mutex_lock(&hwcrhk_trace.lock);
+    __atomic_store_n(&hwcrhk_trace.active, 0, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&hwcrhk_trace.writers, __ATOMIC_SEQ_CST) > 0)
+        pthread_cond_wait(&hwcrhk_trace.cond, &hwcrhk_trace.lock);
+    if (hwcrhk_trace.running) {
+        hwcrhk_trace.stopping = 1;
+        pthread_cond_signal(&hwcrhk_trace.cond);
+        pthread_mutex_unlock(&hwcrhk_trace.lock);
+
+        pthread_join(hwcrhk_trace.thread, NULL);
+
+        pthread_mutex_lock(&hwcrhk_trace.lock);
+        __atomic_store_n(&hwcrhk_trace.running, 0, __ATOMIC_RELEASE);
+        hwcrhk_trace.stopping = 0;
+    }
+    hwcrhk_trace.initialised = 0;
+    if (hwcrhk_trace.fd >= 0)
+        close(hwcrhk_trace.fd);
+    hwcrhk_trace.fd = -1;
+    pthread_mutex_unlock(&hwcrhk_trace.lock);
+}
+
+/* "TRACE": an empty |path| stops the trace */
+static int hwcrhk_trace_set_path(const char *path)
+{
+    HWCRHK_TRACE_HEADER header;
+    struct timespec ts;
+    int fd;
+
+    hwcrhk_trace_stop();
+    if (*path == '\0')
+        return 1;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                   0644)) < 0) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_TRACE_FAILURE);
+        ERR_add_error_data(3, path, ": ", strerror(errno));
+        return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HWCRHK_TRACE_MAGIC, sizeof(header.magic));
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.realtime_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_TRACE_FAILURE);
+        ERR_add_error_data(3, path, ": ", strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    pthread_mutex_lock(&hwcrhk_trace.lock);
+    hwcrhk_trace.fd = fd;
+    hwcrhk_trace.start_ns = hwcrhk_now_ns();
+    __atomic_store_n(&hwcrhk_trace.active, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&hwcrhk_trace.lock);
+    return 1;
+}
+
+/*
+ * Records a request that started at |start_ns| and has just completed
+ * with the library's return code |ret|.  Never blocks, but for waking the
+ * drainer up, and costs a single load when there is no trace.
+ */
+static void hwcrhk_trace_add(int type, uint64_t start_ns, int bits,
+                             int exp_bits, uint32_t key_hash, int ret)
+{
+    HWCRHK_TRACE_SLOT *slot;
+    HWCRHK_TRACE_RECORD *record;
+    uint64_t now;
+    size_t pos, seq;
+
+    if (!__atomic_load_n(&hwcrhk_trace.active, __ATOMIC_ACQUIRE))
+        return;
+    /* hwcrhk_trace_stop() waits for those that see it still active */
+    __atomic_add_fetch(&hwcrhk_trace.writers, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&hwcrhk_trace.active, __ATOMIC_SEQ_CST)
+        || (!__atomic_load_n(&hwcrhk_trace.running, __ATOMIC_ACQUIRE)
+            && !hwcrhk_trace_start()))
+        goto end;
+    now = hwcrhk_now_ns();
+
+    pos = __atomic_load_n(&hwcrhk_trace.tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &hwcrhk_trace.slots[pos & (HWCRHK_TRACE_SLOTS - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&hwcrhk_trace.tail, &pos,
+                                            pos + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if ((ptrdiff_t)(seq - pos) < 0) {
+            /* Still holds the record from the previous lap */
+            __atomic_add_fetch(&hwcrhk_trace.dropped, 1, __ATOMIC_RELAXED);
+            goto end;
+        } else {
+            pos = __atomic_load_n(&hwcrhk_trace.tail, __ATOMIC_RELAXED);
+        }
+    }
+    record = &slot->record;
+    record->start_ns = start_ns > hwcrhk_trace.start_ns
+                       ? start_ns - hwcrhk_trace.start_ns : 0;
+    record->duration_us = (now - start_ns) / 1000 > UINT32_MAX
+                          ? UINT32_MAX : (uint32_t)((now - start_ns) / 1000);
+    record->key_hash = key_hash;
+    record->bits = bits > UINT16_MAX ? UINT16_MAX : bits;
+    record->exp_bits = exp_bits > UINT16_MAX ? UINT16_MAX : exp_bits;
+    record->type = type;
+    record->result = ret < INT8_MIN ? INT8_MIN : ret > 0 ? 0 : ret;
+    record->reserved = 0;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&hwcrhk_trace.sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&hwcrhk_trace.lock);
+        pthread_cond_signal(&hwcrhk_trace.cond);
+        pthread_mutex_unlock(&hwcrhk_trace.lock);
+    }
+
+ end:
+    if (__atomic_sub_fetch(&hwcrhk_trace.writers, 1, __ATOMIC_SEQ_CST) == 0
+        && !__atomic_load_n(&hwcrhk_trace.active, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&hwcrhk_trace.lock);
+        pthread_cond_broadcast(&hwcrhk_trace.cond);
+        pthread_mutex_unlock(&hwcrhk_trace.lock);
+    }
+}
+
+/*
+ * With "LAZY_INIT", ENGINE_init() only starts a thread that loads the
+ * library and creates the context, and requests wait for it in
+ * hwcrhk_ready().  |state| goes from IDLE to LOADING when the thread is
+ * started and to DONE, with |ok| and |error| set, once it is through.
+ */
+#define HWCRHK_LAZY_IDLE                0
+#define HWCRHK_LAZY_LOADING             1
+#define HWCRHK_LAZY_DONE                2
+
+static struct {
+    int enabled;                /* "LAZY_INIT" */
+    int state;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* signalled when |state| becomes DONE */
+    /* The rest is only touched with |lock| held, or once |state| is DONE */
+    int ok;
+    unsigned long error;        /* why the initialisation failed */
+    int joinable;               /* |thread| has yet to be joined */
+    pthread_t thread;
+} hwcrhk_lazy = {
+    0, HWCRHK_LAZY_IDLE, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * Called before anything that needs the library.  Returns HWCRHK_OP_HSM
+ * once it is loaded.  While a lazy initialisation is under way, the caller
+ * waits for it, for no longer than the calling thread's deadline, unless
+ * |software| is set and SOFTWARE_FALLBACK on, in which case it is told to
+ * compute the result itself (HWCRHK_OP_SOFTWARE).  Otherwise,
+ * HWCRHK_OP_FAIL is returned with an error raised on behalf of |func|.
+ */
+static int hwcrhk_ready(int func, int software)
+{
+    struct timespec until;
+    uint64_t deadline_ns, now, wait_ns;
+    char buf[256];
+    int rv = 0;
+
+    if (__atomic_load_n(&hwcrhk_lazy.state, __ATOMIC_ACQUIRE)
+        == HWCRHK_LAZY_LOADING) {
+        if (software && hwcrhk_software_fallback) {
+            hwcrhk_stats_inc(software_fallbacks);
+            return HWCRHK_OP_SOFTWARE;
+        }
+
+        deadline_ns = hwcrhk_deadline_get();
+        if (deadline_ns != 0) {
+            now = hwcrhk_now_ns();
+            wait_ns = deadline_ns > now ? deadline_ns - now : 0;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += wait_ns / 1000000000;
+            until.tv_nsec += (long)(wait_ns % 1000000000);
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+        }
+
+        pthread_mutex_lock(&hwcrhk_lazy.lock);
+        while (hwcrhk_lazy.state == HWCRHK_LAZY_LOADING && rv == 0) {
+            if (deadline_ns != 0)
+                rv = pthread_cond_timedwait(&hwcrhk_lazy.cond,
+                                            &hwcrhk_lazy.lock, &until);
+            else
+                rv = pthread_cond_wait(&hwcrhk_lazy.cond, &hwcrhk_lazy.lock);
+        }
+        pthread_mutex_unlock(&hwcrhk_lazy.lock);
+        if (rv != 0
+            && __atomic_load_n(&hwcrhk_lazy.state, __ATOMIC_ACQUIRE)
+               == HWCRHK_LAZY_LOADING) {
+            hwcrhk_stats_inc(deadline_dropped);
+            HWCRHKerr(func, HWCRHK_R_DEADLINE_EXCEEDED);
+            return HWCRHK_OP_FAIL;
+        }
+    }
+
+    if (hwcrhk_lazy.state == HWCRHK_LAZY_DONE && !hwcrhk_lazy.ok) {
+        HWCRHKerr(func, HWCRHK_R_NOT_INITIALISED);
+        if (hwcrhk_lazy.error != 0) {
+            ERR_error_string_n(hwcrhk_lazy.error, buf, sizeof(buf));
+            ERR_add_error_data(2, "initialisation failed: ", buf);
+        }
+        return HWCRHK_OP_FAIL;
+    }
+    if (!hwcrhk_context) {
+        HWCRHKerr(func, HWCRHK_R_NOT_INITIALISED);
+        return HWCRHK_OP_FAIL;
+    }
+    return HWCRHK_OP_HSM;
+}
+
+#ifndef OPENSSL_NO_DH
+/*
+ * Ephemeral DH key pairs made ahead of demand.  "DH_POOL_GROUP" names the
+ * groups to make them for and "DH_POOL_DEPTH" how many to keep of each.
+ * Filler threads, started by hwcrhk_init(), compute them with the DH
+ * method's own exponentiation, so on the HSM, and generate_key takes one
+ * instead of making a round trip when the DH has the same p, q, g and
+ * private key length as a pool group.  A pair is handed out once and then
+ * forgotten; the pool is emptied in hwcrhk_finish() and in a child process.
+ */
+# define HWCRHK_DH_POOL_MAX_DEPTH       1024
+# define HWCRHK_DH_POOL_FILLERS         2
+# define HWCRHK_DH_POOL_RETRY_MS        100
+
+typedef struct {
+    BIGNUM *pub_key;
+    BIGNUM *priv_key;
+} HWCRHK_DH_PAIR;
+
+typedef struct hwcrhk_dh_group_st HWCRHK_DH_GROUP;
+struct hwcrhk_dh_group_st {
+    DH *params;
+    int count;                  /* pairs at hand */
+    int filling;                /* pairs being computed */
+    HWCRHK_DH_GROUP *next;
+    HWCRHK_DH_PAIR pairs[HWCRHK_DH_POOL_MAX_DEPTH];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* signalled when fillers have work */
+    HWCRHK_DH_GROUP *groups;
+    int depth;                  /* "DH_POOL_DEPTH" */
+    int active;                 /* the engine is initialised */
+    int stopping;
+    int nthreads;
+    pthread_t threads[HWCRHK_DH_POOL_FILLERS];
+} hwcrhk_dh_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static const struct {
+    const char *name;
+    BIGNUM *(*prime) (BIGNUM *bn);
+} hwcrhk_dh_modp_groups[] = {
+    /* RFC 3526, with a generator of 2 */
+    {"modp1536", BN_get_rfc3526_prime_1536},
+    {"modp2048", BN_get_rfc3526_prime_2048},
+    {"modp3072", BN_get_rfc3526_prime_3072},
+    {"modp4096", BN_get_rfc3526_prime_4096},
+    {"modp6144", BN_get_rfc3526_prime_6144},
+    {"modp8192", BN_get_rfc3526_prime_8192},
+};
+
+# ifdef NID_ffdhe2048
+static const struct {
+    const char *name;
+    int nid;
+} hwcrhk_dh_ffdhe_groups[] = {
+    /* RFC 7919 */
+    {"ffdhe2048", NID_ffdhe2048},
+    {"ffdhe3072", NID_ffdhe3072},
+    {"ffdhe4096", NID_ffdhe4096},
+    {"ffdhe6144", NID_ffdhe6144},
+    {"ffdhe8192", NID_ffdhe8192},
+};
+# endif
+
+static int hwcrhk_dh_pool_match(const DH *a, const DH *b)
+{
+    const BIGNUM *pa, *qa, *ga, *pb, *qb, *gb;
+
+    DH_get0_pqg(a, &pa, &qa, &ga);
+    DH_get0_pqg(b, &pb, &qb, &gb);
+    if (pa == NULL || ga == NULL || pb == NULL || gb == NULL)
+        return 0;
+    if ((qa == NULL) != (qb == NULL))
+        return 0;
+    return BN_cmp(pa, pb) == 0 && BN_cmp(ga, gb) == 0
+        && (qa == NULL || BN_cmp(qa, qb) == 0)
+        && DH_get_length(a) == DH_get_length(b);
+}
+
+/*
+ * Makes the parameters for |name|: one of the groups above, or else the
+ * name of a file of PEM encoded DH parameters.
+ */
+static DH *hwcrhk_dh_pool_params(const char *name)
+{
+    BIGNUM *p = NULL, *g = NULL;
+    DH *dh = NULL;
+    BIO *in;
+    size_t i;
+
+    for (i = 0; i < sizeof(hwcrhk_dh_modp_groups) / sizeof(hwcrhk_dh_modp_groups[0]); i++) {
+        if (strcmp(name, hwcrhk_dh_modp_groups[i].name) != 0)
+            continue;
+        if ((dh = DH_new()) == NULL
+            || (p = hwcrhk_dh_modp_groups[i].prime(NULL)) == NULL
+            || (g = BN_new()) == NULL
+            || !BN_set_word(g, 2)
+            || !DH_set0_pqg(dh, p, NULL, g)) {
+            BN_free(p);
+            BN_free(g);
+            DH_free(dh);
+            return NULL;
+        }
+        return dh;
+    }
+# ifdef NID_ffdhe2048
+    for (i = 0; i < sizeof(hwcrhk_dh_ffdhe_groups) / sizeof(hwcrhk_dh_ffdhe_groups[0]); i++) {
+        if (strcmp(name, hwcrhk_dh_ffdhe_groups[i].name) == 0)
+            return DH_new_by_nid(hwcrhk_dh_ffdhe_groups[i].nid);
+    }
+# endif
+    if ((in = BIO_new_file(name, "r")) == NULL)
+        return NULL;
+    dh = PEM_read_bio_DHparams(in, NULL, NULL, NULL);
+    BIO_free(in);
+    return dh;
+}
+
+static void hwcrhk_dh_pool_empty(HWCRHK_DH_GROUP *group, int keep)
+{
+    while (group->count > keep) {
+        group->count--;
+        BN_free(group->pairs[group->count].pub_key);
+        BN_clear_free(group->pairs[group->count].priv_key);
+    }
+}
+
+/* The group most in need of another pair, if any */
+static HWCRHK_DH_GROUP *hwcrhk_dh_pool_neediest(void)
+{
+    HWCRHK_DH_GROUP *group, *neediest = NULL;
+
+    for (group = hwcrhk_dh_pool.groups; group != NULL; group = group->next) {
+        if (group->count + group->filling < hwcrhk_dh_pool.depth
+            && (neediest == NULL
+                || group->count + group->filling
+                   < neediest->count + neediest->filling))
+            neediest = group;
+    }
+    return neediest;
+}
+
+/*
+ * Computes a pair with OpenSSL's generate_key on a copy of the group's
+ * parameters, which calls back into hwcrhk_dh_bn_mod_exp().
+ */
+static int hwcrhk_dh_pool_generate(const DH *params, HWCRHK_DH_PAIR *pair)
+{
+    const BIGNUM *pub_key, *priv_key;
+    DH *dh;
+    int ok = 0;
+
+    if ((dh = DHparams_dup((DH *)params)) == NULL
+        || !DH_set_method(dh, hwcrhk_dh)
+        || !DH_meth_get_generate_key(DH_OpenSSL())(dh))
+        goto err;
+    DH_get0_key(dh, &pub_key, &priv_key);
+    pair->pub_key = BN_dup(pub_key);
+    pair->priv_key = BN_dup(priv_key);
+    if (pair->pub_key == NULL || pair->priv_key == NULL) {
+        BN_free(pair->pub_key);
+        BN_clear_free(pair->priv_key);
+        goto err;
+    }
+    ok = 1;
+ err:
+    DH_free(dh);
+    return ok;
+}
+
+static void *hwcrhk_dh_pool_filler(void *arg)
+{
+    HWCRHK_DH_GROUP *group;
+    HWCRHK_DH_PAIR pair;
+    struct timespec retry;
+    int ok;
+
+    pthread_mutex_lock(&hwcrhk_dh_pool.lock);
+    for (;;) {
+        while (!hwcrhk_dh_pool.stopping
+               && (group = hwcrhk_dh_pool_neediest()) == NULL)
+            pthread_cond_wait(&hwcrhk_dh_pool.cond, &hwcrhk_dh_pool.lock);
+        if (hwcrhk_dh_pool.stopping)
+            break;
+        group->filling++;
+        pthread_mutex_unlock(&hwcrhk_dh_pool.lock);
+
+        if (!(ok = hwcrhk_dh_pool_generate(group->params, &pair)))
+            ERR_clear_error();
+
+        pthread_mutex_lock(&hwcrhk_dh_pool.lock);
+        group->filling--;
+        if (ok && group->count < hwcrhk_dh_pool.depth) {
+            group->pairs[group->count++] = pair;
+        } else if (ok) {
+            BN_free(pair.pub_key);
+            BN_clear_free(pair.priv_key);
+        } else if (!hwcrhk_dh_pool.stopping) {
+            /* Don't spin while the HSM is unavailable */
+            clock_gettime(CLOCK_REALTIME, &retry);
+            retry.tv_nsec += (long)HWCRHK_DH_POOL_RETRY_MS * 1000000;
+            if (retry.tv_nsec >= 1000000000) {
+                retry.tv_sec++;
+                retry.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&hwcrhk_dh_pool.cond, &hwcrhk_dh_pool.lock,
+                                   &retry);
+        }
+    }
+    pthread_mutex_unlock(&hwcrhk_dh_pool.lock);
+
+    OPENSSL_thread_stop();
+    return NULL;
+}
+
+/* Starts whatever fillers are missing.  Called with the lock held. */
+static void hwcrhk_dh_pool_fill(void)
+{
+    while (hwcrhk_dh_pool.active && !hwcrhk_dh_pool.stopping
+           && hwcrhk_dh_pool.depth > 0 && hwcrhk_dh_pool.groups != NULL
+           && hwcrhk_dh_pool.nthreads < HWCRHK_DH_POOL_FILLERS
+           && pthread_create(&hwcrhk_dh_pool.threads[hwcrhk_dh_pool.nthreads],
+                             NULL, hwcrhk_dh_pool_filler, NULL) == 0)
+        hwcrhk_dh_pool.nthreads++;
+    pthread_cond_broadcast(&hwcrhk_dh_pool.cond);
+}
+
+static int hwcrhk_dh_pool_add_group(const char *name)
+{
+    HWCRHK_DH_GROUP *group, **last;
+    DH *params;
+
+    if ((params = hwcrhk_dh_pool_params(name)) == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+        ERR_add_error_data(2, "group=", name);
+        return 0;
+    }
+
+    pthread_mutex_lock(&hwcrhk_dh_pool.lock);
+    for (last = &hwcrhk_dh_pool.groups; *last != NULL; last = &(*last)->next) {
+        if (hwcrhk_dh_pool_match((*last)->params, params)) {
+            pthread_mutex_unlock(&hwcrhk_dh_pool.lock);
+            DH_free(params);
+            return 1;
+        }
+    }
+    if ((group = OPENSSL_zalloc(sizeof(*group))) == NULL) {
+        pthread_mutex_unlock(&hwcrhk_dh_pool.lock);
+        DH_free(params);
+        HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    group->params = params;
+    *last = group;
+    hwcrhk_dh_pool_fill();
+    pthread_mutex_unlock(&hwcrhk_dh_pool.lock);
+    return 1;
+}
+
+static void hwcrhk_dh_pool_set_depth(int depth)
+{
+    HWCRHK_DH_GROUP *group;
+
+    pthread_mutex_lock(&hwcrhk_dh_pool.lock);
+    hwcrhk_dh_pool.depth = depth;
+    for (group = hwcrhk_dh_pool.groups; group != NULL; group = group->next)
+        hwcrhk_dh_pool_empty(group, depth);
+    hwcrhk_dh_pool_fill();
+    pthread_mutex_unlock(&hwcrhk_dh_pool.lock);
+}
+
+/*
+ * Hands out a pair for |dh|'s group, if the pool has one.  Returns 1 and
+ * sets the keys of |dh| on success.
+ */
+static int hwcrhk_dh_pool_take(DH *dh)
+{
+    HWCRHK_DH_GROUP *group;
+    HWCRHK_DH_PAIR pair;
+    int found = 0;
+
+    if (__atomic_load_n(&hwcrhk_dh_pool.depth, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    pthread_mutex_lock(&hwcrhk_dh_pool.lock);
+    for (group = hwcrhk_dh_pool.groups; group != NULL; group = group->next) {
+        if (!hwcrhk_dh_pool_match(group->params, dh))
+            continue;
+        if (group->count > 0) {
+            pair = group->pairs[--group->count];
+            found = 1;
+        }
+        /* Restarts the fillers in a child process, too */
+        hwcrhk_dh_pool_fill();
+        break;
+    }
+    pthread_mutex_unlock(&hwcrhk_dh_pool.lock);
+
+    if (group == NULL)
+        return 0;
+    if (found && DH_set0_key(dh, pair.pub_key, pair.priv_key)) {
+        hwcrhk_stats_inc(dh_pool_hits);
+        return 1;
+    }
+    if (found) {
+        BN_free(pair.pub_key);
+        BN_clear_free(pair.priv_key);
+    }
+    hwcrhk_stats_inc(dh_pool_misses);
+    return 0;
+}
+
+static void hwcrhk_dh_pool_start(void)
+{
+    pthread_mutex_lock(&hwcrhk_dh_pool.lock);
+    hwcrhk_dh_pool.active = 1;
+    hwcrhk_dh_pool_fill();
+    pthread_mutex_unlock(&hwcrhk_dh_pool.lock);
+}
+
+/* Stops the fillers and throws away the pairs made so far */
+static void hwcrhk_dh_pool_stop(void)
+{
+    HWCRHK_DH_GROUP *group;
+    int i, n;
+
+    pthread_mutex_lock(&hwcrhk_dh_pool.lock);
+    hwcrhk_dh_pool.active = 0;
+    hwcrhk_dh_pool.stopping = 1;
+    pthread_cond_broadcast(&hwcrhk_dh_pool.cond);
+    n = hwcrhk_dh_pool.nthreads;
+    pthread_mutex_unlock(&hwcrhk_dh_pool.lock);
+
+    for (i = 0; i < n; i++)
+        pthread_join(hwcrhk_dh_pool.threads[i], NULL);
+
+    pthread_mutex_lock(&hwcrhk_dh_pool.lock);
+    hwcrhk_dh_pool.nthreads = 0;
+    hwcrhk_dh_pool.stopping = 0;
+    for (group = hwcrhk_dh_pool.groups; group != NULL; group = group->next)
+        hwcrhk_dh_pool_empty(group, 0);
+    pthread_mutex_unlock(&hwcrhk_dh_pool.lock);
+}
+
+static void hwcrhk_dh_pool_free(void)
+{
+    HWCRHK_DH_GROUP *group;
+
+    while ((group = hwcrhk_dh_pool.groups) != NULL) {
+        hwcrhk_dh_pool.groups = group->next;
+        hwcrhk_dh_pool_empty(group, 0);
+        DH_free(group->params);
+        OPENSSL_free(group);
+    }
+}
+#endif
+
+#ifndef OPENSSL_NO_RSA
+/*
+ * Signature cache.  Raw RSA over a deterministically padded block always
+ * gives the same result, so with "SIGN_CACHE" the results of private key
+ * encryptions with keys held in the HSM are kept, and a request with the
+ * same key, padding and input is answered without going to the HSM.  The
+ * lookup is made before the padding, see hwcrhk_rsa_priv_enc(), since
+ * OpenSSL blinds the padded block before hwcrhk_rsa_mod_exp() sees it.
+ *
+ * The entries come from a single allocation, made from the secure heap
+ * when the application has set one up, and are cleansed as soon as they
+ * are evicted or expire.  Keys are told apart by their serial number, as
+ * the address of a key that was freed may be given to another.
+ */
+# define HWCRHK_SIGN_CACHE_MAX_SIZE     65536
+# define HWCRHK_SIGN_CACHE_MAX_BYTES    512     /* keys of up to 4096 bits */
+
+typedef struct hwcrhk_sign_entry_st HWCRHK_SIGN_ENTRY;
+struct hwcrhk_sign_entry_st {
+    HWCRHK_SIGN_ENTRY *next;            /* in its bucket, or free */
+    HWCRHK_SIGN_ENTRY *older, *newer;   /* in order of use */
+    uint64_t key;                       /* serial, 0 when free */
+    uint64_t hash;
+    uint64_t expires_ns;                /* 0 for never */
+    int padding;
+    int inlen, siglen;
+    unsigned char in[HWCRHK_SIGN_CACHE_MAX_BYTES];
+    unsigned char sig[HWCRHK_SIGN_CACHE_MAX_BYTES];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int size;                           /* "SIGN_CACHE", 0 when off */
+    uint64_t ttl_ns;                    /* "SIGN_CACHE_TTL", 0 for none */
+    HWCRHK_SIGN_ENTRY *entries;         /* |size| of them */
+    HWCRHK_SIGN_ENTRY **buckets;        /* |mask| + 1 of them */
+    size_t mask;
+    HWCRHK_SIGN_ENTRY *free;
+    HWCRHK_SIGN_ENTRY *oldest, *newest;
+} hwcrhk_sign_cache = {
+    PTHREAD_MUTEX_INITIALIZER, 0, (uint64_t)60 * 1000000000
+};
+
+/* FNV-1a, continuing from |h| */
+# define HWCRHK_FNV_BASIS       0xcbf29ce484222325ULL
+
+static uint64_t hwcrhk_fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Over the key and padding as well as the input */
+static uint64_t hwcrhk_sign_cache_hash(uint64_t key, int padding,
+                                       const unsigned char *in, int inlen)
+{
+    uint64_t h = HWCRHK_FNV_BASIS ^ key;
+
+    h = hwcrhk_fnv1a(h, &padding, sizeof(padding));
+    return hwcrhk_fnv1a(h, in, inlen);
+}
+
+/* Called with the lock held */
+static void hwcrhk_sign_cache_unlink(HWCRHK_SIGN_ENTRY *entry)
+{
+    HWCRHK_SIGN_ENTRY **pp;
+
+    for (pp = &hwcrhk_sign_cache.buckets[entry->hash
+                                         & hwcrhk_sign_cache.mask];
+         *pp != entry; pp = &(*pp)->next)
+        continue;
+    *pp = entry->next;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        hwcrhk_sign_cache.oldest = entry->newer;
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        hwcrhk_sign_cache.newest = entry->older;
+
+    OPENSSL_cleanse(entry, sizeof(*entry));
+    entry->next = hwcrhk_sign_cache.free;
+    hwcrhk_sign_cache.free = entry;
+}
+
+/* Called with the lock held, makes |entry| the newest */
+static void hwcrhk_sign_cache_touch(HWCRHK_SIGN_ENTRY *entry)
+{
+    if (hwcrhk_sign_cache.newest == entry)
+        return;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        hwcrhk_sign_cache.oldest = entry->newer;
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+
+    entry->newer = NULL;
+    entry->older = hwcrhk_sign_cache.newest;
+    if (entry->older != NULL)
+        entry->older->newer = entry;
+    else
+        hwcrhk_sign_cache.oldest = entry;
+    hwcrhk_sign_cache.newest = entry;
+}
+
+/* Called with the lock held.  Expired entries are evicted on the way. */
+static HWCRHK_SIGN_ENTRY *hwcrhk_sign_cache_find(uint64_t key, uint64_t hash,
+                                                 int padding,
+                                                 const unsigned char *in,
+                                                 int inlen)
+{
+    HWCRHK_SIGN_ENTRY *entry;
+
+    for (entry = hwcrhk_sign_cache.buckets[hash & hwcrhk_sign_cache.mask];
+         entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->key == key
+            && entry->padding == padding && entry->inlen == inlen
+            && memcmp(entry->in, in, inlen) == 0)
+            break;
+    }
+    if (entry != NULL && entry->expires_ns != 0
+        && entry->expires_ns <= hwcrhk_now_ns()) {
+        hwcrhk_sign_cache_unlink(entry);
+        entry = NULL;
+    }
+    return entry;
+}
+
+/*
+ * Copies the signature of |in| with |key| to |sig|, which has room for
+ * HWCRHK_SIGN_CACHE_MAX_BYTES.  Returns its length, or 0 if it isn't kept.
+ */
+static int hwcrhk_sign_cache_get(HWCRHK_KEY *key, int padding,
+                                 const unsigned char *in, int inlen,
+                                 unsigned char *sig)
+{
+    HWCRHK_SIGN_ENTRY *entry;
+    uint64_t hash;
+    int siglen = 0;
+
+    hash = hwcrhk_sign_cache_hash(key->serial, padding, in, inlen);
+    pthread_mutex_lock(&hwcrhk_sign_cache.lock);
+    if (hwcrhk_sign_cache.size == 0) {
+        pthread_mutex_unlock(&hwcrhk_sign_cache.lock);
+        return 0;
+    }
+    entry = hwcrhk_sign_cache_find(key->serial, hash, padding, in, inlen);
+    if (entry != NULL) {
+        memcpy(sig, entry->sig, entry->siglen);
+        siglen = entry->siglen;
+        hwcrhk_sign_cache_touch(entry);
+    }
+    pthread_mutex_unlock(&hwcrhk_sign_cache.lock);
+
+    if (siglen > 0)
+        hwcrhk_stats_inc(sign_cache_hits);
+    else
+        hwcrhk_stats_inc(sign_cache_misses);
+    return siglen;
+}
+
+/* Keeps a signature, in place of the least recently used if it's full */
+static void hwcrhk_sign_cache_put(HWCRHK_KEY *key, int padding,
+                                  const unsigned char *in, int inlen,
+                                  const unsigned char *sig, int siglen)
+{
+    HWCRHK_SIGN_ENTRY *entry, **bucket;
+    uint64_t hash;
+
+    hash = hwcrhk_sign_cache_hash(key->serial, padding, in, inlen);
+    pthread_mutex_lock(&hwcrhk_sign_cache.lock);
+    if (hwcrhk_sign_cache.size == 0) {
+        pthread_mutex_unlock(&hwcrhk_sign_cache.lock);
+        return;
+    }
+    /* Another thread may have got there first */
+    entry = hwcrhk_sign_cache_find(key->serial, hash, padding, in, inlen);
+    if (entry == NULL) {
+        if (hwcrhk_sign_cache.free == NULL)
+            hwcrhk_sign_cache_unlink(hwcrhk_sign_cache.oldest);
+        entry = hwcrhk_sign_cache.free;
+        hwcrhk_sign_cache.free = entry->next;
+
+        entry->key = key->serial;
+        entry->hash = hash;
+        entry->padding = padding;
+        entry->inlen = inlen;
+        memcpy(entry->in, in, inlen);
+        bucket = &hwcrhk_sign_cache.buckets[hash & hwcrhk_sign_cache.mask];
+        entry->next = *bucket;
+        *bucket = entry;
+        entry->older = hwcrhk_sign_cache.newest;
+        entry->newer = NULL;
+        if (entry->older != NULL)
+            entry->older->newer = entry;
+        else
+            hwcrhk_sign_cache.oldest = entry;
+        hwcrhk_sign_cache.newest = entry;
+    } else {
+        hwcrhk_sign_cache_touch(entry);
+    }
+    entry->siglen = siglen;
+    memcpy(entry->sig, sig, siglen);
+    entry->expires_ns = hwcrhk_sign_cache.ttl_ns == 0 ? 0
+        : hwcrhk_now_ns() + hwcrhk_sign_cache.ttl_ns;
+    pthread_mutex_unlock(&hwcrhk_sign_cache.lock);
+}
+
+/* Evicts the signatures made with |key|, which is going away */
+static void hwcrhk_sign_cache_forget(HWCRHK_KEY *key)
+{
+    HWCRHK_SIGN_ENTRY *entry, *newer;
+
+    if (__atomic_load_n(&hwcrhk_sign_cache.size, __ATOMIC_RELAXED) == 0)
+        return;
+
+    pthread_mutex_lock(&hwcrhk_sign_cache.lock);
+    for (entry = hwcrhk_sign_cache.oldest; entry != NULL; entry = newer) {
+        newer = entry->newer;
+        if (entry->key == key->serial)
+            hwcrhk_sign_cache_unlink(entry);
+    }
+    pthread_mutex_unlock(&hwcrhk_sign_cache.lock);
+}
+
+/* Throws away the signatures kept so far and makes room for |size| */
+static int hwcrhk_sign_cache_resize(int size)
+{
+    HWCRHK_SIGN_ENTRY *entries = NULL, *old_entries;
+    HWCRHK_SIGN_ENTRY **buckets = NULL, **old_buckets;
+    size_t nbuckets = 0;
+    int i, old_size;
+
+    if (size > 0) {
+        for (nbuckets = 1; nbuckets < (size_t)size; nbuckets <<= 1)
+            continue;
+        entries = OPENSSL_secure_zalloc(size * sizeof(*entries));
+        buckets = OPENSSL_zalloc(nbuckets * sizeof(*buckets));
+        if (entries == NULL || buckets == NULL) {
+            OPENSSL_secure_free(entries);
+            OPENSSL_free(buckets);
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_MALLOC_FAILURE);
+            return 0;
+        }
+        for (i = 0; i < size - 1; i++)
+            entries[i].next = &entries[i + 1];
+    }
+
+    pthread_mutex_lock(&hwcrhk_sign_cache.lock);
+    old_entries = hwcrhk_sign_cache.entries;
+    old_buckets = hwcrhk_sign_cache.buckets;
+    old_size = hwcrhk_sign_cache.size;
+    hwcrhk_sign_cache.entries = entries;
+    hwcrhk_sign_cache.buckets = buckets;
+    hwcrhk_sign_cache.mask = nbuckets - 1;
+    hwcrhk_sign_cache.free = entries;
+    hwcrhk_sign_cache.oldest = hwcrhk_sign_cache.newest = NULL;
+    __atomic_store_n(&hwcrhk_sign_cache.size, size, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&hwcrhk_sign_cache.lock);
+
+    if (old_entries != NULL)
+        OPENSSL_secure_clear_free(old_entries,
+                                  old_size * sizeof(*old_entries));
+    OPENSSL_free(old_buckets);
+    return 1;
+}
+#endif
+
+#ifndef OPENSSL_NO_RSA
+/*
+ * Public key index.  With "KEY_INDEX", the modulus and public exponent of
+ * every key loaded are recorded in a file that every process maps read
+ * only.  A key found there is loaded without going to the HSM at all, and
+ * its handles are only loaded when it is first used for a private key
+ * operation (see hwcrhk_key_acquire()), at which point its modulus is
+ * checked against the HSM's.
+ *
+ * The file is a magic number followed by records that are only ever
+ * appended, under an fcntl() lock: unlike a flock(), it isn't shared with
+ * a child process that inherits the descriptor.  Each record carries a
+ * checksum, so that readers take one that is being written, or was left
+ * half written by a crash, for the end of the file, and the next writer
+ * writes over it.  A later record for a key_id replaces an earlier one.
+ * Each process finds the records through a hash table of its own.
+ */
+# define HWCRHK_INDEX_MAGIC             "CHILKIX1"
+# define HWCRHK_INDEX_MAGIC_LEN         8
+# define HWCRHK_INDEX_MAX_BYTES         0xffff  /* of the id, n and e */
+
+typedef struct {
+    uint64_t check;             /* FNV-1a over the rest of the record */
+    uint32_t size;              /* of the record, a multiple of 8 */
+    uint16_t idlen, nlen, elen; /* followed by the key_id, n and e */
+    uint16_t reserved;
+} HWCRHK_INDEX_RECORD;
+
+typedef struct {
+    uint64_t hash;              /* of the key_id */
+    size_t offset;              /* of its latest record, 0 when free */
+} HWCRHK_INDEX_SLOT;
+
+static struct {
+    pthread_mutex_t lock;
+    char *path;                 /* "KEY_INDEX", NULL when off */
+    int refused;                /* the file isn't safe to trust */
+    int fd;                     /* -1 until opened */
+    int writable;
+    const unsigned char *map;
+    size_t mapped;
+    size_t end;                 /* of the records looked at so far */
+    HWCRHK_INDEX_SLOT *slots;   /* a power of 2 of them, at most half used */
+    size_t nslots, used;
+} hwcrhk_key_index = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, -1 };
+
+/* Called with the lock held */
+static void hwcrhk_key_index_close(void)
+{
+    if (hwcrhk_key_index.map != NULL)
+        munmap((void *)hwcrhk_key_index.map, hwcrhk_key_index.mapped);
+    if (hwcrhk_key_index.fd >= 0)
+        close(hwcrhk_key_index.fd);
+    OPENSSL_free(hwcrhk_key_index.slots);
+    hwcrhk_key_index.fd = -1;
+    hwcrhk_key_index.writable = 0;
+    hwcrhk_key_index.map = NULL;
+    hwcrhk_key_index.mapped = hwcrhk_key_index.end = 0;
+    hwcrhk_key_index.slots = NULL;
+    hwcrhk_key_index.nslots = hwcrhk_key_index.used = 0;
+}
+
+/*
+ * Called with the lock held.  A process that may not write only reads.
+ * Public keys are taken from the file as they are, so it is refused
+ * unless only this user or root could have written it.
+ */
+static int hwcrhk_key_index_open(void)
+{
+    struct stat st;
+
+    if (hwcrhk_key_index.fd >= 0)
+        return 1;
+    if (hwcrhk_key_index.path == NULL || hwcrhk_key_index.refused)
+        return 0;
+
+    hwcrhk_key_index.fd = open(hwcrhk_key_index.path,
+                               O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (hwcrhk_key_index.fd >= 0)
+        hwcrhk_key_index.writable = 1;
+    else
+        hwcrhk_key_index.fd = open(hwcrhk_key_index.path,
+                                   O_RDONLY | O_CLOEXEC);
+    if (hwcrhk_key_index.fd < 0)
+        return 0;
+
+    if (fstat(hwcrhk_key_index.fd, &st) != 0 || !S_ISREG(st.st_mode)
+        || (st.st_uid != geteuid() && st.st_uid != 0)
+        || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        hwcrhk_key_index_close();
+        hwcrhk_key_index.refused = 1;
+        hwcrhk_log_message(&logstream, "CHIL engine: key index not used, "
+                           "it is owned by another user or writable by others");
+        return 0;
+    }
+    return 1;
+}
+
+static const HWCRHK_INDEX_RECORD *hwcrhk_key_index_record(size_t offset)
+{
+    return (const HWCRHK_INDEX_RECORD *)(hwcrhk_key_index.map + offset);
+}
+
+/* Called with the lock held */
+static HWCRHK_INDEX_SLOT *hwcrhk_key_index_slot(uint64_t hash,
+                                                const char *id, size_t idlen)
+{
+    const HWCRHK_INDEX_RECORD *rec;
+    HWCRHK_INDEX_SLOT *slot;
+    size_t i;
+
+    for (i = hash & (hwcrhk_key_index.nslots - 1);;
+         i = (i + 1) & (hwcrhk_key_index.nslots - 1)) {
+        slot = &hwcrhk_key_index.slots[i];
+        if (slot->offset == 0)
+            return slot;
+        rec = hwcrhk_key_index_record(slot->offset);
+        if (slot->hash == hash && rec->idlen == idlen
+            && memcmp(rec + 1, id, idlen) == 0)
+            return slot;
+    }
+}
+
+/* Called with the lock held */
+static int hwcrhk_key_index_insert(size_t offset)
+{
+    const HWCRHK_INDEX_RECORD *rec = hwcrhk_key_index_record(offset);
+    HWCRHK_INDEX_SLOT *slots, *slot;
+    size_t i, j, nslots;
+    uint64_t hash;
+
+    if (2 * (hwcrhk_key_index.used + 1) > hwcrhk_key_index.nslots) {
+        nslots = hwcrhk_key_index.nslots == 0 ? 256
+            : 2 * hwcrhk_key_index.nslots;
+        if ((slots = OPENSSL_zalloc(nslots * sizeof(*slots))) == NULL)
+            return 0;
+        for (i = 0; i < hwcrhk_key_index.nslots; i++) {
+            slot = &hwcrhk_key_index.slots[i];
+            if (slot->offset == 0)
+                continue;
+            for (j = slot->hash & (nslots - 1); slots[j].offset != 0;
+                 j = (j + 1) & (nslots - 1))
+                continue;
+            slots[j] = *slot;
+        }
+        OPENSSL_free(hwcrhk_key_index.slots);
+        hwcrhk_key_index.slots = slots;
+        hwcrhk_key_index.nslots = nslots;
+    }
+
+    hash = hwcrhk_fnv1a(HWCRHK_FNV_BASIS, rec + 1, rec->idlen);
+    slot = hwcrhk_key_index_slot(hash, (const char *)(rec + 1), rec->idlen);
+    if (slot->offset == 0)
+        hwcrhk_key_index.used++;
+    slot->hash = hash;
+    slot->offset = offset;
+    return 1;
+}
+
+/*
+ * Called with the lock held.  Maps whatever was added to the file since it
+ * was last looked at, and takes in the records that are complete.  Returns
+ * 0 if the file isn't an index.
+ */
+static int hwcrhk_key_index_scan(void)
+{
+    const HWCRHK_INDEX_RECORD *rec;
+    struct stat st;
+    void *map;
+    size_t end;
+
+    if (fstat(hwcrhk_key_index.fd, &st) != 0)
+        return 1;
+    if ((size_t)st.st_size > hwcrhk_key_index.mapped) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                   hwcrhk_key_index.fd, 0);
+        if (map == MAP_FAILED)
+            return 1;
+        if (hwcrhk_key_index.map != NULL)
+            munmap((void *)hwcrhk_key_index.map, hwcrhk_key_index.mapped);
+        hwcrhk_key_index.map = map;
+        hwcrhk_key_index.mapped = st.st_size;
+    }
+    if (hwcrhk_key_index.end == 0) {
+        if (hwcrhk_key_index.mapped < HWCRHK_INDEX_MAGIC_LEN)
+            return 1;
+        if (memcmp(hwcrhk_key_index.map, HWCRHK_INDEX_MAGIC,
+                   HWCRHK_INDEX_MAGIC_LEN) != 0)
+            return 0;
+        hwcrhk_key_index.end = HWCRHK_INDEX_MAGIC_LEN;
+    }
+
+    for (end = hwcrhk_key_index.end;
+         hwcrhk_key_index.mapped - end >= sizeof(*rec); end += rec->size) {
+        rec = hwcrhk_key_index_record(end);
+        if (rec->size < sizeof(*rec) + rec->idlen + rec->nlen + rec->elen
+            || rec->size % 8 != 0 || rec->size > hwcrhk_key_index.mapped - end
+            || rec->check != hwcrhk_fnv1a(HWCRHK_FNV_BASIS, &rec->size,
+                                          rec->size - sizeof(rec->check))
+            || !hwcrhk_key_index_insert(end))
+            break;
+    }
+    hwcrhk_key_index.end = end;
+    return 1;
+}
+
+/* Sets |*n| and |*e| and returns 1 if |name| is in the index */
+static int hwcrhk_key_index_get(const char *name, BIGNUM **n, BIGNUM **e)
+{
+    const HWCRHK_INDEX_RECORD *rec = NULL;
+    const unsigned char *p;
+    HWCRHK_INDEX_SLOT *slot;
+    size_t idlen = strlen(name);
+    uint64_t hash = hwcrhk_fnv1a(HWCRHK_FNV_BASIS, name, idlen);
+    int pass;
+
+    *n = *e = NULL;
+    pthread_mutex_lock(&hwcrhk_key_index.lock);
+    if (!hwcrhk_key_index_open()) {
+        pthread_mutex_unlock(&hwcrhk_key_index.lock);
+        return 0;
+    }
+    /* Another process may have added it since the last look */
+    for (pass = 0; rec == NULL && pass < 2; pass++) {
+        if ((pass > 0 || hwcrhk_key_index.nslots == 0)
+            && !hwcrhk_key_index_scan())
+            break;
+        if (hwcrhk_key_index.nslots == 0)
+            continue;
+        slot = hwcrhk_key_index_slot(hash, name, idlen);
+        if (slot->offset != 0)
+            rec = hwcrhk_key_index_record(slot->offset);
+    }
+    if (rec != NULL) {
+        p = (const unsigned char *)(rec + 1) + rec->idlen;
+        *n = BN_bin2bn(p, rec->nlen, NULL);
+        *e = BN_bin2bn(p + rec->nlen, rec->elen, NULL);
+    }
+    pthread_mutex_unlock(&hwcrhk_key_index.lock);
+
+    if (*n != NULL && *e != NULL)
+        return 1;
+    BN_free(*n);
+    BN_free(*e);
+    *n = *e = NULL;
+    return 0;
+}
+
+/*
+ * Records |name|'s public key.  Failures are of no consequence, the key is
+ * just loaded from the HSM again next time.
+ */
+static void hwcrhk_key_index_add(const char *name, const BIGNUM *n,
+                                 const BIGNUM *e)
+{
+    HWCRHK_INDEX_RECORD *rec;
+    const HWCRHK_INDEX_RECORD *old;
+    HWCRHK_INDEX_SLOT *slot;
+    struct flock fl;
+    size_t idlen = strlen(name), nlen = BN_num_bytes(n), elen = BN_num_bytes(e);
+    size_t size = (sizeof(*rec) + idlen + nlen + elen + 7) & ~(size_t)7;
+    unsigned char *p;
+    off_t end;
+
+    if (idlen > HWCRHK_INDEX_MAX_BYTES || nlen > HWCRHK_INDEX_MAX_BYTES
+        || elen > HWCRHK_INDEX_MAX_BYTES
+        || (rec = OPENSSL_zalloc(size)) == NULL)
+        return;
+    rec->size = (uint32_t)size;
+    rec->idlen = (uint16_t)idlen;
+    rec->nlen = (uint16_t)nlen;
+    rec->elen = (uint16_t)elen;
+    p = (unsigned char *)(rec + 1);
+    memcpy(p, name, idlen);
+    BN_bn2bin(n, p + idlen);
+    BN_bn2bin(e, p + idlen + nlen);
+    rec->check = hwcrhk_fnv1a(HWCRHK_FNV_BASIS, &rec->size,
+                              size - sizeof(rec->check));
+
+    pthread_mutex_lock(&hwcrhk_key_index.lock);
+    if (!hwcrhk_key_index_open() || !hwcrhk_key_index.writable)
+        goto end;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if (fcntl(hwcrhk_key_index.fd, F_SETLKW, &fl) != 0)
+        goto end;
+
+    /*
+     * Another process may have got there first.  Otherwise, anything after
+     * the last complete record is written over; the file never shrinks, as
+     * readers may have it mapped.
+     */
+    if (!hwcrhk_key_index_scan())
+        goto unlock;
+    if (hwcrhk_key_index.nslots > 0) {
+        slot = hwcrhk_key_index_slot(hwcrhk_fnv1a(HWCRHK_FNV_BASIS, name,
+                                                  idlen), name, idlen);
+        if (slot->offset != 0) {
+            old = hwcrhk_key_index_record(slot->offset);
+            if (old->size == size
+                && memcmp(old + 1, rec + 1, size - sizeof(*rec)) == 0)
+                goto unlock;
+        }
+    }
+    if ((end = hwcrhk_key_index.end) == 0) {
+        if (pwrite(hwcrhk_key_index.fd, HWCRHK_INDEX_MAGIC,
+                   HWCRHK_INDEX_MAGIC_LEN, 0) != HWCRHK_INDEX_MAGIC_LEN)
+            goto unlock;
+        end = HWCRHK_INDEX_MAGIC_LEN;
+    }
+    if (pwrite(hwcrhk_key_index.fd, rec, size, end) == (ssize_t)size)
+        hwcrhk_key_index_scan();
+
+ unlock:
+    fl.l_type = F_UNLCK;
+    fcntl(hwcrhk_key_index.fd, F_SETLK, &fl);
+ end:
+    pthread_mutex_unlock(&hwcrhk_key_index.lock);
+    OPENSSL_free(rec);
+}
+
+static int hwcrhk_key_index_set_path(const char *path)
+{
+    char *copy = NULL;
+
+    if (*path != '\0' && (copy = OPENSSL_strdup(path)) == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_MALLOC_FAILURE);
+        return 0;
+    }
+    pthread_mutex_lock(&hwcrhk_key_index.lock);
+    hwcrhk_key_index_close();
+    OPENSSL_free(hwcrhk_key_index.path);
+    hwcrhk_key_index.path = copy;
+    hwcrhk_key_index.refused = 0;
+    pthread_mutex_unlock(&hwcrhk_key_index.lock);
+    return 1;
+}
+#endif
+
+#ifdef HWCRHK_MB
+static void hwcrhk_mb_atfork_child(void);
+#endif
+
+/*
+ * None of the engine's threads exist in a child process, and their locks
+ * may have been held when the parent forked, so all of that starts afresh.
+ */
+static void hwcrhk_atfork_child(void)
+{
+    HWCRHK_CONFIG config;
+
+    pthread_mutex_init(&hwcrhk_pool.lock, NULL);
+    pthread_cond_init(&hwcrhk_pool.cond, NULL);
+    hwcrhk_pool.head = hwcrhk_pool.tail = NULL;
+    hwcrhk_pool.queued = hwcrhk_pool.idle = 0;
+    hwcrhk_pool.stopping = hwcrhk_pool.nthreads = 0;
+
+    pthread_mutex_init(&hwcrhk_limiter.lock, NULL);
+    pthread_cond_init(&hwcrhk_limiter.cond, NULL);
+    hwcrhk_limiter.inflight = hwcrhk_limiter.waiters = 0;
+
+#ifdef HWCRHK_MB
+    hwcrhk_mb_atfork_child();
+#endif
+
+    pthread_mutex_init(&hwcrhk_breaker.lock, NULL);
+    pthread_cond_init(&hwcrhk_breaker.cond, NULL);
+    hwcrhk_breaker.state = HWCRHK_BREAKER_CLOSED;
+    hwcrhk_breaker.failures = 0;
+    hwcrhk_breaker.probing = hwcrhk_breaker.joinable = 0;
+    hwcrhk_breaker.stopping = 0;
+
+#ifndef OPENSSL_NO_RSA
+    /* The handles still queued are the parent's to unload */
+    pthread_mutex_init(&hwcrhk_reaper.lock, NULL);
+    pthread_cond_init(&hwcrhk_reaper.cond, NULL);
+    hwcrhk_reaper.head = hwcrhk_reaper.count = 0;
+    hwcrhk_reaper.running = hwcrhk_reaper.stopping = 0;
+
+    /*
+     * Keys that were loading, or in use, were so on the parent's threads.
+     * In a new generation, none is loaded any more.
+     */
+    pthread_mutex_init(&hwcrhk_keys.lock, NULL);
+    pthread_cond_init(&hwcrhk_keys.cond, NULL);
+    {
+        HWCRHK_KEY *key;
+        int stale;
+
+        hwcrhk_config_get(&config);
+        stale = !config.fork_check;
+
+        hwcrhk_keys.pending = 0;
+        for (key = hwcrhk_keys.head; key != NULL; key = key->next) {
+            key->loading = key->users = 0;
+            if (stale) {
+                key->older = key->newer = NULL;
+                key->resident = 0;
+            }
+        }
+        if (stale) {
+            hwcrhk_keys.oldest = hwcrhk_keys.newest = NULL;
+            hwcrhk_keys.resident = 0;
+        }
+    }
+
+    /* The signatures kept are as good here as in the parent */
+    pthread_mutex_init(&hwcrhk_sign_cache.lock, NULL);
+
+    /* So is the key index mapping; the parent's file lock isn't ours */
+    pthread_mutex_init(&hwcrhk_key_index.lock, NULL);
+#endif
+
+#ifndef OPENSSL_NO_DH
+    /* The parent may hand out the same pairs, so none are kept */
+    pthread_mutex_init(&hwcrhk_dh_pool.lock, NULL);
+    pthread_cond_init(&hwcrhk_dh_pool.cond, NULL);
+    hwcrhk_dh_pool.stopping = hwcrhk_dh_pool.nthreads = 0;
+    {
+        HWCRHK_DH_GROUP *group;
+
+        for (group = hwcrhk_dh_pool.groups; group != NULL;
+             group = group->next) {
+            hwcrhk_dh_pool_empty(group, 0);
+            group->filling = 0;
+        }
+    }
+#endif
+
+    /* Likewise for the trace, whose file the child appends to */
+    pthread_mutex_init(&hwcrhk_trace.lock, NULL);
+    pthread_cond_init(&hwcrhk_trace.cond, NULL);
+    hwcrhk_trace.running = hwcrhk_trace.sleeping = 0;
+    hwcrhk_trace.stopping = hwcrhk_trace.initialised = 0;
+    hwcrhk_trace.writers = 0;
+
+    /* Whatever is left in the ring is the parent's to write */
+    pthread_mutex_init(&hwcrhk_log.lock, NULL);
+    pthread_cond_init(&hwcrhk_log.cond, NULL);
+    pthread_mutex_init(&hwcrhk_log.swap_lock, NULL);
+    pthread_cond_init(&hwcrhk_log.gone, NULL);
+    hwcrhk_log.readers[0] = hwcrhk_log.readers[1] = 0;
+    hwcrhk_log.swapping = 0;
+    hwcrhk_log.running = hwcrhk_log.sleeping = hwcrhk_log.stopping = 0;
+    hwcrhk_log.initialised = 0;
+
+    /* A lazy initialisation that was under way won't complete here */
+    pthread_mutex_init(&hwcrhk_lazy.lock, NULL);
+    pthread_cond_init(&hwcrhk_lazy.cond, NULL);
+    hwcrhk_lazy.joinable = 0;
+    if (hwcrhk_lazy.state == HWCRHK_LAZY_LOADING) {
+        hwcrhk_lazy.ok = 0;
+        hwcrhk_lazy.error = 0;
+        hwcrhk_lazy.state = HWCRHK_LAZY_DONE;
+    }
+
+    pthread_mutex_init(&hwcrhk_fork.lock, NULL);
+    hwcrhk_fork.reloading = 0;
+    hwcrhk_config_get(&config);
+    if (!config.fork_check)
+        hwcrhk_fork.generation++;
+}
+
+/* Destructor (complements the "ENGINE_chil()" constructor) */
+static int hwcrhk_destroy(ENGINE *e)
+{
+    hwcrhk_log_stop();
+    hwcrhk_trace_stop();
+#ifndef OPENSSL_NO_RSA
+    hwcrhk_sign_cache_resize(0);
+    hwcrhk_key_index_set_path("");
+#endif
+#ifndef OPENSSL_NO_DH
+    hwcrhk_dh_pool_free();
+#endif
+    free_HWCRHK_LIBNAME();
+    ERR_unload_HWCRHK_strings();
+    CRYPTO_THREAD_cleanup_local(&hwcrhk_thread_key);
+    CRYPTO_THREAD_lock_free(chil_lock);
+    hwcrhk_config_reset();
+    return 1;
+}
+
+/*
+ * (de)initialisation functions.  Loads the library and creates the
+ * context, either from hwcrhk_init() or on the lazy initialisation thread.
+ */
+static int hwcrhk_init_library(void)
+{
+    HWCryptoHook_Init_t *p1;
+    HWCryptoHook_Finish_t *p2;
+    HWCryptoHook_ModExp_t *p3;
+#ifndef OPENSSL_NO_RSA
+    HWCryptoHook_RSA_t *p4;
+    HWCryptoHook_RSALoadKey_t *p5;
+    HWCryptoHook_RSAGetPublicKey_t *p6;
+    HWCryptoHook_RSAUnloadKey_t *p7;
+#endif
+    HWCryptoHook_RandomBytes_t *p8;
+    HWCryptoHook_ModExpCRT_t *p9;
+    const char *hwcrhk_name = get_HWCRHK_LIBNAME();
+    char *hwcrhk_libname = NULL;
+
+    if (hwcrhk_dso != NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_INIT, HWCRHK_R_ALREADY_LOADED);
+        goto err;
+    }
+
+    if (lt_dlinit() != 0) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_INIT, ERR_R_SYS_LIB);
+        ERR_add_error_data(2, "ltdl message: ", lt_dlerror());
+        goto err;
+    }
+
+    if (strncmp(hwcrhk_name, "lib", 3) != 0) {
+        /*
+        * hwcrhk_libname is the same as hwcrhk_name, but with "lib" prefixed.
+        * Make space for it
+        */
+        if ((hwcrhk_libname = malloc(strlen(hwcrhk_name) + 4)) == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_INIT, ERR_R_MALLOC_FAILURE);
+            goto err;
+        }
+        strcpy(hwcrhk_libname, "lib");
+        strcat(hwcrhk_libname, hwcrhk_name);
+    }
+
+    /* Attempt to load libnfhwcrhk.so/nfhwcrhk.dll/whatever. */
+    if (hwcrhk_libname != NULL) {
+        hwcrhk_dso = lt_dlopenext(hwcrhk_libname);
+    }
+    if (hwcrhk_dso == NULL && (hwcrhk_dso = lt_dlopenext(hwcrhk_name)) == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_INIT, HWCRHK_R_DSO_FAILURE);
+        goto err;
+    }
+    free(hwcrhk_libname);
+    hwcrhk_libname = NULL;
+
+#define BINDIT(t, name) (t *)lt_dlsym(hwcrhk_dso, name)
+    if ((p1 = BINDIT(HWCryptoHook_Init_t, n_hwcrhk_Init)) == NULL
+        || (p2 = BINDIT(HWCryptoHook_Finish_t, n_hwcrhk_Finish)) == NULL
+        || (p3 = BINDIT(HWCryptoHook_ModExp_t, n_hwcrhk_ModExp)) == NULL
+#ifndef OPENSSL_NO_RSA
+        || (p4 = BINDIT(HWCryptoHook_RSA_t, n_hwcrhk_RSA)) == NULL
+        || (p5 = BINDIT(HWCryptoHook_RSALoadKey_t, n_hwcrhk_RSALoadKey)) == NULL
+        || (p6 = BINDIT(HWCryptoHook_RSAGetPublicKey_t, n_hwcrhk_RSAGetPublicKey)) == NULL
+        || (p7 = BINDIT(HWCryptoHook_RSAUnloadKey_t, n_hwcrhk_RSAUnloadKey)) == NULL
+#endif
+        || (p8 = BINDIT(HWCryptoHook_RandomBytes_t, n_hwcrhk_RandomBytes)) == NULL
+        || (p9 = BINDIT(HWCryptoHook_ModExpCRT_t, n_hwcrhk_ModExpCRT)) == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_INIT, HWCRHK_R_DSO_FAILURE);
+        goto err;
     }
     /* Copy the pointers */
     p_hwcrhk_Init = p1;
     p_hwcrhk_Finish = p2;
     p_hwcrhk_ModExp = p3;
 #ifndef OPENSSL_NO_RSA
-    p_hwcrhk_RSA = p4;
-    p_hwcrhk_RSALoadKey = p5;
-    p_hwcrhk_RSAGetPublicKey = p6;
-    p_hwcrhk_RSAUnloadKey = p7;
+    p_hwcrhk_RSA = p4;
+    p_hwcrhk_RSALoadKey = p5;
+    p_hwcrhk_RSAGetPublicKey = p6;
+    p_hwcrhk_RSAUnloadKey = p7;
+#endif
+    p_hwcrhk_RandomBytes = p8;
+    p_hwcrhk_ModExpCRT = p9;
+
+    /*
+     * Try and get a context - if not, we may have a DSO but no accelerator!
+     */
+    if (!get_context(&hwcrhk_context)) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_INIT, HWCRHK_R_UNIT_FAILURE);
+        goto err;
+    }
+    hwcrhk_fork.context_generation = hwcrhk_fork.generation;
+#ifndef OPENSSL_NO_DH
+    hwcrhk_dh_pool_start();
+#endif
+    /* Everything's fine. */
+    return 1;
+ err:
+    free(hwcrhk_libname);
+    if (hwcrhk_dso != NULL) {
+        lt_dlclose(hwcrhk_dso);
+        hwcrhk_dso = NULL;
+    }
+    lt_dlexit();
+    p_hwcrhk_Init = NULL;
+    p_hwcrhk_Finish = NULL;
+    p_hwcrhk_ModExp = NULL;
+#ifndef OPENSSL_NO_RSA
+    p_hwcrhk_RSA = NULL;
+    p_hwcrhk_RSALoadKey = NULL;
+    p_hwcrhk_RSAGetPublicKey = NULL;
+    p_hwcrhk_RSAUnloadKey = NULL;
+#endif
+    p_hwcrhk_RandomBytes = NULL;
+    p_hwcrhk_ModExpCRT = NULL;
+    return 0;
+}
+
+static void *hwcrhk_lazy_main(void *arg)
+{
+    unsigned long error = 0;
+    int ok;
+
+    ERR_set_mark();
+    if (!(ok = hwcrhk_init_library()))
+        error = ERR_peek_last_error();
+    ERR_pop_to_mark();
+
+    pthread_mutex_lock(&hwcrhk_lazy.lock);
+    hwcrhk_lazy.ok = ok;
+    hwcrhk_lazy.error = error;
+    __atomic_store_n(&hwcrhk_lazy.state, HWCRHK_LAZY_DONE, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&hwcrhk_lazy.cond);
+    pthread_mutex_unlock(&hwcrhk_lazy.lock);
+
+    if (!ok)
+        hwcrhk_log_message(&logstream,
+                           "CHIL engine: lazy initialisation failed");
+    OPENSSL_thread_stop();
+    return NULL;
+}
+
+static int hwcrhk_init(ENGINE *e)
+{
+    if (!hwcrhk_fork.registered
+        && pthread_atfork(NULL, NULL, hwcrhk_atfork_child) == 0)
+        hwcrhk_fork.registered = 1;
+#ifndef OPENSSL_NO_RSA
+    /* Before any key can be looked up, hence not on the lazy thread */
+    if (hndidx_rsa == -1) {
+        hndidx_rsa = RSA_get_ex_new_index(0,
+                                          "nFast HWCryptoHook RSA key handle",
+                                          hwcrhk_rsa_ex_new, NULL, NULL);
+    }
+    if (hndidx_rsa_embed == -1) {
+        hndidx_rsa_embed = RSA_get_ex_new_index(0,
+                                                "nFast HWCryptoHook embed check",
+                                                hwcrhk_rsa_ex_new, NULL, NULL);
+    }
+    if (hndidx_rsa_mont == -1) {
+        hndidx_rsa_mont = RSA_get_ex_new_index(0,
+                                               "nFast HWCryptoHook CRT contexts",
+                                               hwcrhk_rsa_ex_new, NULL,
+                                               hwcrhk_rsa_mont_free);
+    }
+#endif
+
+    if (!hwcrhk_lazy.enabled)
+        return hwcrhk_init_library();
+
+    pthread_mutex_lock(&hwcrhk_lazy.lock);
+    if (hwcrhk_lazy.state != HWCRHK_LAZY_IDLE) {
+        pthread_mutex_unlock(&hwcrhk_lazy.lock);
+        HWCRHKerr(HWCRHK_F_HWCRHK_INIT, HWCRHK_R_ALREADY_LOADED);
+        return 0;
+    }
+    hwcrhk_lazy.ok = 0;
+    hwcrhk_lazy.error = 0;
+    __atomic_store_n(&hwcrhk_lazy.state, HWCRHK_LAZY_LOADING,
+                     __ATOMIC_RELEASE);
+    if (pthread_create(&hwcrhk_lazy.thread, NULL, hwcrhk_lazy_main,
+                       NULL) != 0) {
+        /* Do it here and now, then */
+        __atomic_store_n(&hwcrhk_lazy.state, HWCRHK_LAZY_IDLE,
+                         __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&hwcrhk_lazy.lock);
+        return hwcrhk_init_library();
+    }
+    hwcrhk_lazy.joinable = 1;
+    pthread_mutex_unlock(&hwcrhk_lazy.lock);
+    return 1;
+}
+
+/*
+ * Waits for a lazy initialisation to complete.  Returns 0 if there was one
+ * and it failed, in which case there is nothing left to finish.
+ */
+static int hwcrhk_lazy_stop(void)
+{
+    int ok = 1;
+
+    pthread_mutex_lock(&hwcrhk_lazy.lock);
+    if (hwcrhk_lazy.joinable) {
+        pthread_mutex_unlock(&hwcrhk_lazy.lock);
+        pthread_join(hwcrhk_lazy.thread, NULL);
+        pthread_mutex_lock(&hwcrhk_lazy.lock);
+        hwcrhk_lazy.joinable = 0;
+    }
+    if (hwcrhk_lazy.state == HWCRHK_LAZY_DONE)
+        ok = hwcrhk_lazy.ok;
+    __atomic_store_n(&hwcrhk_lazy.state, HWCRHK_LAZY_IDLE, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&hwcrhk_lazy.lock);
+    return ok;
+}
+
+static int hwcrhk_finish(ENGINE *e)
+{
+    int to_return = 0, loaded;
+
+    loaded = hwcrhk_lazy_stop();
+    free_HWCRHK_LIBNAME();
+
+    /* A failed lazy initialisation has cleaned up after itself */
+    if (!loaded)
+        return 1;
+
+    if (hwcrhk_dso == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_FINISH, HWCRHK_R_NOT_LOADED);
+        goto err;
+    }
+
+    hwcrhk_breaker_reset();
+#ifndef OPENSSL_NO_DH
+    hwcrhk_dh_pool_stop();
+#endif
+    hwcrhk_pool_stop();
+#ifndef OPENSSL_NO_RSA
+    hwcrhk_keys_reload_stop();
+    hwcrhk_reaper_stop();
+#endif
+    /* A context inherited across fork() may not be finished */
+    if (hwcrhk_fork.context_generation == hwcrhk_fork.generation)
+        release_context(hwcrhk_context);
+    if (lt_dlclose(hwcrhk_dso) != 0) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_FINISH, HWCRHK_R_DSO_FAILURE);
+        goto err;
+    }
+
+    to_return = 1;
+
+ err:
+    lt_dlexit();
+    hwcrhk_log_stop();
+    hwcrhk_log_swap(NULL);
+    hwcrhk_dso = NULL;
+    p_hwcrhk_Init = NULL;
+    p_hwcrhk_Finish = NULL;
+    p_hwcrhk_ModExp = NULL;
+#ifndef OPENSSL_NO_RSA
+    p_hwcrhk_RSA = NULL;
+    p_hwcrhk_RSALoadKey = NULL;
+    p_hwcrhk_RSAGetPublicKey = NULL;
+    p_hwcrhk_RSAUnloadKey = NULL;
+#endif
+    p_hwcrhk_RandomBytes = NULL;
+    p_hwcrhk_ModExpCRT = NULL;
+    return to_return;
+}
+
+static int hwcrhk_ctrl(ENGINE *e, int cmd, long i, void *p, void (*f) (void))
+{
+    HWCRHK_CONFIG config;
+    int to_return = 1;
+
+    switch (cmd) {
+    case HWCRHK_CMD_SO_PATH:
+        if (hwcrhk_dso
+            || __atomic_load_n(&hwcrhk_lazy.state, __ATOMIC_ACQUIRE)
+               != HWCRHK_LAZY_IDLE) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_ALREADY_LOADED);
+            return 0;
+        }
+        if (p == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+            return 0;
+        }
+        return set_HWCRHK_LIBNAME((const char *)p);
+    case ENGINE_CTRL_SET_LOGSTREAM:
+        {
+            BIO *bio = (BIO *)p;
+
+            /* Swaps are serialised by hwcrhk_log_swap(), not chil_lock */
+            if (bio != NULL && !BIO_up_ref(bio)) {
+                HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_BIO_WAS_FREED);
+                bio = NULL;
+            }
+            hwcrhk_log_swap(bio);
+        }
+        break;
+    case ENGINE_CTRL_SET_PASSWORD_CALLBACK:
+        CRYPTO_THREAD_write_lock(chil_lock);
+        hwcrhk_config_copy(&config);
+        config.password_context.password_callback = (pem_password_cb *)f;
+        hwcrhk_config_publish(&config);
+        CRYPTO_THREAD_unlock(chil_lock);
+        break;
+    case ENGINE_CTRL_SET_USER_INTERFACE:
+    case HWCRHK_CMD_SET_USER_INTERFACE:
+        CRYPTO_THREAD_write_lock(chil_lock);
+        hwcrhk_config_copy(&config);
+        config.password_context.ui_method = (UI_METHOD *)p;
+        hwcrhk_config_publish(&config);
+        CRYPTO_THREAD_unlock(chil_lock);
+        break;
+    case ENGINE_CTRL_SET_CALLBACK_DATA:
+    case HWCRHK_CMD_SET_CALLBACK_DATA:
+        CRYPTO_THREAD_write_lock(chil_lock);
+        hwcrhk_config_copy(&config);
+        config.password_context.callback_data = p;
+        hwcrhk_config_publish(&config);
+        CRYPTO_THREAD_unlock(chil_lock);
+        break;
+        /*
+         * this enables or disables the "SimpleForkCheck" flag used in the
+         * initialisation structure.
+         */
+    case ENGINE_CTRL_CHIL_SET_FORKCHECK:
+    case HWCRHK_CMD_FORK_CHECK:
+        CRYPTO_THREAD_write_lock(chil_lock);
+        hwcrhk_config_copy(&config);
+        config.fork_check = ((i == 0) ? 0 : 1);
+        hwcrhk_config_publish(&config);
+        CRYPTO_THREAD_unlock(chil_lock);
+        break;
+        /*
+         * This will prevent the initialisation function from "installing"
+         * the mutex-handling callbacks, even if they are available from
+         * within the library (or were provided to the library from the
+         * calling application). This is to remove any baggage for
+         * applications not using multithreading.
+         */
+    case ENGINE_CTRL_CHIL_NO_LOCKING:
+        CRYPTO_THREAD_write_lock(chil_lock);
+        hwcrhk_config_copy(&config);
+        config.disable_mutex_callbacks = 1;
+        hwcrhk_config_publish(&config);
+        CRYPTO_THREAD_unlock(chil_lock);
+        break;
+    case HWCRHK_CMD_THREAD_LOCKING:
+        CRYPTO_THREAD_write_lock(chil_lock);
+        hwcrhk_config_copy(&config);
+        config.disable_mutex_callbacks = ((i == 0) ? 0 : 1);
+        hwcrhk_config_publish(&config);
+        CRYPTO_THREAD_unlock(chil_lock);
+        break;
+        /*
+         * This is handed to the library as maxsimultaneous, so it only
+         * fully takes effect if given before the engine is initialised.
+         * It also bounds how many requests the engine itself keeps in
+         * flight on behalf of a single caller.
+         */
+    case HWCRHK_CMD_MAX_SIMULTANEOUS:
+        if (i < 0) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        CRYPTO_THREAD_write_lock(chil_lock);
+        hwcrhk_config_copy(&config);
+        config.maxsimultaneous = (int)i;
+        hwcrhk_config_publish(&config);
+        CRYPTO_THREAD_unlock(chil_lock);
+        break;
+#ifndef OPENSSL_NO_RSA
+    case HWCRHK_CMD_RSA_BATCH:
+        if (p == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+            return 0;
+        }
+        return hwcrhk_rsa_batch((HWCRHK_RSA_BATCH *)p);
+#endif
+    case HWCRHK_CMD_LIMITER:
+        if (i < HWCRHK_LIMIT_OFF || i > HWCRHK_LIMIT_DEFER) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        hwcrhk_limiter_reset();
+        hwcrhk_limiter.mode = (int)i;
+        break;
+    case HWCRHK_CMD_LIMITER_MAX:
+        if (i < 0 || i > INT_MAX) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        hwcrhk_limiter.max = (int)i;
+        hwcrhk_limiter_reset();
+        break;
+    case HWCRHK_CMD_LIMITER_WAIT:
+        if (i < 0 || i > INT_MAX) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        hwcrhk_limiter.wait_ms = (int)i;
+        break;
+    case HWCRHK_CMD_GET_ASYNC_API:
+        if (p == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+            return 0;
+        }
+        hwcrhk_get_async_api((HWCRHK_ASYNC_API *)p);
+        break;
+    case HWCRHK_CMD_GET_LOAD_API:
+        if (p == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+            return 0;
+        }
+        hwcrhk_get_load_api((HWCRHK_LOAD_API *)p);
+        break;
+        /*
+         * The deadline belongs to the calling thread, so this is meant to
+         * be called with ENGINE_ctrl_cmd() around the operations it
+         * concerns rather than from a configuration file.
+         */
+    case HWCRHK_CMD_DEADLINE:
+        if (i < 0) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        if (!hwcrhk_deadline_set(i == 0 ? 0
+                                 : hwcrhk_now_ns() + (uint64_t)i * 1000000)) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_MALLOC_FAILURE);
+            return 0;
+        }
+        break;
+    case HWCRHK_CMD_BREAKER:
+        if (i < 0 || i > INT_MAX) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        hwcrhk_breaker.threshold = (int)i;
+        if (i == 0)
+            hwcrhk_breaker_reset();
+        break;
+    case HWCRHK_CMD_BREAKER_WINDOW:
+    case HWCRHK_CMD_BREAKER_TIMEOUT:
+    case HWCRHK_CMD_BREAKER_PROBE:
+        if (i < 0 || i > INT_MAX
+            || (i == 0 && cmd != HWCRHK_CMD_BREAKER_TIMEOUT)) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        if (cmd == HWCRHK_CMD_BREAKER_WINDOW)
+            hwcrhk_breaker.window_ms = (int)i;
+        else if (cmd == HWCRHK_CMD_BREAKER_TIMEOUT)
+            hwcrhk_breaker.timeout_ms = (int)i;
+        else
+            hwcrhk_breaker.probe_ms = (int)i;
+        break;
+#ifndef OPENSSL_NO_RSA
+    case HWCRHK_CMD_KEY_REPLICAS:
+        if (i < 1 || i > HWCRHK_KEY_MAX_REPLICAS) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        hwcrhk_key_replicas = (int)i;
+        break;
+    case HWCRHK_CMD_KEY_RESIDENCY:
+        if (i < 0 || i > INT_MAX) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        return hwcrhk_keys_set_max_resident((int)i);
+    case HWCRHK_CMD_TOP_KEYS:
+        if (p == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+            return 0;
+        }
+        return hwcrhk_keys_top((HWCRHK_TOP_KEYS *)p);
+    case HWCRHK_CMD_SIGN_CACHE:
+        if (i < 0 || i > HWCRHK_SIGN_CACHE_MAX_SIZE) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        return hwcrhk_sign_cache_resize((int)i);
+    case HWCRHK_CMD_SIGN_CACHE_TTL:
+        if (i < 0 || i > INT_MAX) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        pthread_mutex_lock(&hwcrhk_sign_cache.lock);
+        hwcrhk_sign_cache.ttl_ns = (uint64_t)i * 1000000;
+        pthread_mutex_unlock(&hwcrhk_sign_cache.lock);
+        break;
+    case HWCRHK_CMD_KEY_INDEX:
+        if (p == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+            return 0;
+        }
+        return hwcrhk_key_index_set_path((const char *)p);
+#endif
+    case HWCRHK_CMD_TRACE:
+        if (p == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+            return 0;
+        }
+        return hwcrhk_trace_set_path((const char *)p);
+    case HWCRHK_CMD_SOFTWARE_FALLBACK:
+        hwcrhk_software_fallback = ((i == 0) ? 0 : 1);
+        break;
+    case HWCRHK_CMD_SOFTWARE_BATCH:
+        if (i < HWCRHK_SOFTWARE_BATCH_OFF || i > HWCRHK_SOFTWARE_BATCH_AVX2) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        __atomic_store_n(&hwcrhk_software_batch, (int)i, __ATOMIC_RELAXED);
+        break;
+#ifndef OPENSSL_NO_DSA
+    case HWCRHK_CMD_DSA_OFFLOAD:
+        if (i < HWCRHK_DSA_OFFLOAD_NONE || i > HWCRHK_DSA_OFFLOAD_ALL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        __atomic_store_n(&hwcrhk_dsa_offload, (int)i, __ATOMIC_RELAXED);
+        break;
+#endif
+    case HWCRHK_CMD_SPLIT_CRT:
+        if (i < 0 || i > INT_MAX) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        hwcrhk_split_crt_bits = (int)i;
+        break;
+        /* Like THREAD_LOCKING, only takes effect when the engine is initialised */
+    case HWCRHK_CMD_FAST_MUTEXES:
+        CRYPTO_THREAD_write_lock(chil_lock);
+        hwcrhk_config_copy(&config);
+        config.fast_mutexes = ((i == 0) ? 0 : 1);
+        hwcrhk_config_publish(&config);
+        CRYPTO_THREAD_unlock(chil_lock);
+        break;
+    case HWCRHK_CMD_LAZY_INIT:
+        hwcrhk_lazy.enabled = ((i == 0) ? 0 : 1);
+        break;
+#ifndef OPENSSL_NO_DH
+    case HWCRHK_CMD_DH_POOL_DEPTH:
+        if (i < 0 || i > HWCRHK_DH_POOL_MAX_DEPTH) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+            return 0;
+        }
+        hwcrhk_dh_pool_set_depth((int)i);
+        break;
+    case HWCRHK_CMD_DH_POOL_GROUP:
+        if (p == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+            return 0;
+        }
+        return hwcrhk_dh_pool_add_group((const char *)p);
+#endif
+    case HWCRHK_CMD_GET_STATS:
+        if (p == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+            return 0;
+        }
+        {
+            HWCRHK_STATS *stats = (HWCRHK_STATS *)p;
+
+            stats->overloaded =
+                __atomic_load_n(&hwcrhk_stats.overloaded, __ATOMIC_RELAXED);
+            stats->deadline_dropped =
+                __atomic_load_n(&hwcrhk_stats.deadline_dropped,
+                                __ATOMIC_RELAXED);
+            stats->deadline_late =
+                __atomic_load_n(&hwcrhk_stats.deadline_late,
+                                __ATOMIC_RELAXED);
+            stats->software_fallbacks =
+                __atomic_load_n(&hwcrhk_stats.software_fallbacks,
+                                __ATOMIC_RELAXED);
+            stats->breaker_trips =
+                __atomic_load_n(&hwcrhk_stats.breaker_trips,
+                                __ATOMIC_RELAXED);
+            stats->breaker_rejected =
+                __atomic_load_n(&hwcrhk_stats.breaker_rejected,
+                                __ATOMIC_RELAXED);
+            stats->log_dropped =
+                __atomic_load_n(&hwcrhk_log.dropped, __ATOMIC_RELAXED);
+            stats->dh_pool_hits =
+                __atomic_load_n(&hwcrhk_stats.dh_pool_hits, __ATOMIC_RELAXED);
+            stats->dh_pool_misses =
+                __atomic_load_n(&hwcrhk_stats.dh_pool_misses,
+                                __ATOMIC_RELAXED);
+            stats->software_batches =
+                __atomic_load_n(&hwcrhk_stats.software_batches,
+                                __ATOMIC_RELAXED);
+            stats->software_batched =
+                __atomic_load_n(&hwcrhk_stats.software_batched,
+                                __ATOMIC_RELAXED);
+            stats->sign_cache_hits =
+                __atomic_load_n(&hwcrhk_stats.sign_cache_hits,
+                                __ATOMIC_RELAXED);
+            stats->sign_cache_misses =
+                __atomic_load_n(&hwcrhk_stats.sign_cache_misses,
+                                __ATOMIC_RELAXED);
+            stats->residency_hits =
+                __atomic_load_n(&hwcrhk_stats.residency_hits,
+                                __ATOMIC_RELAXED);
+            stats->residency_misses =
+                __atomic_load_n(&hwcrhk_stats.residency_misses,
+                                __ATOMIC_RELAXED);
+            stats->residency_evictions =
+                __atomic_load_n(&hwcrhk_stats.residency_evictions,
+                                __ATOMIC_RELAXED);
+            stats->trace_dropped =
+                __atomic_load_n(&hwcrhk_trace.dropped, __ATOMIC_RELAXED);
+        }
+        break;
+
+        /* The command isn't understood by this engine */
+    default:
+        HWCRHKerr(HWCRHK_F_HWCRHK_CTRL,
+                  HWCRHK_R_CTRL_COMMAND_NOT_IMPLEMENTED);
+        to_return = 0;
+        break;
+    }
+
+    return to_return;
+}
+
+
+static HWCryptoHook_MPI *hwcrhk_mpi_new(void)
+{
+    return hwcrhk_mpi_alloc(HWCRHK_MPI_DEFAULT_ALLOC_SIZE);
+}
+
+static HWCryptoHook_MPI *hwcrhk_mpi_alloc(size_t size)
+{
+    HWCryptoHook_MPI *mpi;
+
+    mpi = OPENSSL_malloc(sizeof(HWCryptoHook_MPI) + size);
+    if (mpi == NULL) {
+        return NULL;
+    }
+
+    mpi->buf = ((unsigned char *)mpi) + sizeof(HWCryptoHook_MPI);
+    mpi->size = size;
+
+    return mpi;
+}
+
+static HWCryptoHook_MPI *hwcrhk_mpi_resize(HWCryptoHook_MPI *mpi, size_t size)
+{
+    if (mpi == NULL) {
+        return NULL;
+    }
+
+    if (size <= HWCRHK_MPI_DEFAULT_ALLOC_SIZE) {
+        mpi->size = size;
+        return mpi;
+    }
+
+    mpi = OPENSSL_realloc(mpi, sizeof(HWCryptoHook_MPI) + size);
+    if (mpi == NULL) {
+        return NULL;
+    }
+
+    mpi->buf = ((unsigned char *)mpi) + sizeof(HWCryptoHook_MPI);
+    mpi->size = size;
+
+    return mpi;
+}
+
+static void hwcrhk_mpi_free(HWCryptoHook_MPI *mpi)
+{
+    if (mpi != NULL) {
+        OPENSSL_free(mpi);
+    }
+}
+
+static HWCryptoHook_MPI *hwcrhk_mpi_bn2mpi(const BIGNUM *bn)
+{
+    HWCryptoHook_MPI *mpi = NULL;
+    size_t mpi_size;
+
+    if (bn == NULL) {
+        return NULL;
+    }
+
+    /* round up to the nearest BN_BYTES */
+    mpi_size = ((size_t)(BN_num_bytes(bn) + BN_BYTES - 1) / BN_BYTES) * BN_BYTES;
+    mpi = hwcrhk_mpi_alloc(mpi_size);
+
+    if (mpi == NULL) {
+        goto err;
+    }
+
+    if (!hwcrhk_mpi_set_bn(mpi, bn)) {
+        goto err;
+    }
+
+    return mpi;
+
+ err:
+    hwcrhk_mpi_free(mpi);
+
+    return NULL;
+}
+
+/*
+ * Store |bn| in an MPI whose buffer is already allocated, such as a slice
+ * of a larger arena.  On input mpi->size is the space available, on
+ * success it is the space used.
+ */
+static int hwcrhk_mpi_set_bn(HWCryptoHook_MPI *mpi, const BIGNUM *bn)
+{
+    size_t mpi_size;
+
+    /* round up to the nearest BN_BYTES */
+    mpi_size = ((size_t)(BN_num_bytes(bn) + BN_BYTES - 1) / BN_BYTES) * BN_BYTES;
+    if (mpi_size > mpi->size) {
+        return 0;
+    }
+
+#ifdef L_ENDIAN
+    if (BN_bn2lebinpad(bn, mpi->buf, mpi_size) != mpi_size) {
+#else
+    if (BN_bn2binpad(bn, mpi->buf, mpi_size) != mpi_size) {
+#endif
+        return 0;
+    }
+    mpi->size = mpi_size;
+
+    return 1;
+}
+
+static BIGNUM *hwcrhk_mpi_mpi2bn(const HWCryptoHook_MPI *mpi, BIGNUM *ret)
+{
+    if (mpi == NULL || mpi->buf == NULL) {
+        return NULL;
+    }
+
+#ifdef L_ENDIAN
+    return BN_lebin2bn(mpi->buf, mpi->size, ret);
+#else
+    return BN_bin2bn(mpi->buf, mpi->size, ret);
+#endif
+}
+
+
+#ifndef OPENSSL_NO_RSA
+/*
+ * A key_id may ask for its own number of replicas with a "#N" suffix,
+ * which is split off here.
+ */
+static char *hwcrhk_key_parse_id(const char *key_id, int *replicas)
+{
+    const char *p = strrchr(key_id, '#');
+    char *end;
+    long n;
+
+    *replicas = hwcrhk_key_replicas;
+    if (p == NULL || !isdigit((unsigned char)p[1]))
+        return OPENSSL_strdup(key_id);
+    n = strtol(p + 1, &end, 10);
+    if (*end != '\0' || n < 1 || n > HWCRHK_KEY_MAX_REPLICAS)
+        return OPENSSL_strdup(key_id);
+    *replicas = (int)n;
+    return OPENSSL_strndup(key_id, p - key_id);
+}
+
+/* Called with hwcrhk_keys.lock held */
+static void hwcrhk_key_link(HWCRHK_KEY *key)
+{
+    key->older = hwcrhk_keys.newest;
+    key->newer = NULL;
+    if (key->older != NULL)
+        key->older->newer = key;
+    else
+        hwcrhk_keys.oldest = key;
+    hwcrhk_keys.newest = key;
+    key->resident = 1;
+    hwcrhk_keys.resident += key->count;
+}
+
+/* Called with hwcrhk_keys.lock held */
+static void hwcrhk_key_unlink(HWCRHK_KEY *key)
+{
+    if (key->older != NULL)
+        key->older->newer = key->newer;
+    else
+        hwcrhk_keys.oldest = key->newer;
+    if (key->newer != NULL)
+        key->newer->older = key->older;
+    else
+        hwcrhk_keys.newest = key->older;
+    key->older = key->newer = NULL;
+    key->resident = 0;
+    hwcrhk_keys.resident -= key->count;
+}
+
+/*
+ * Called with hwcrhk_keys.lock held.  Evicts the least recently used keys
+ * that aren't in use until there is room for |room| more handles, or no
+ * other key can go, and returns the number of handles stored in |evicted|.
+ * They are unloaded with hwcrhk_keys_unload() once the lock is released;
+ * that isn't left to the reaper, as the module may need the room at once.
+ */
+# define HWCRHK_KEY_MAX_EVICTED (2 * HWCRHK_KEY_MAX_REPLICAS)
+
+static int hwcrhk_keys_evict(int room, HWCryptoHook_RSAKeyHandle *evicted)
+{
+    HWCRHK_KEY *key = hwcrhk_keys.oldest, *newer;
+    int n = 0;
+
+    if (hwcrhk_keys.max_resident == 0)
+        return 0;
+    for (; key != NULL
+         /* Those evicted here are counted as pending already */
+         && hwcrhk_keys.resident + hwcrhk_keys.pending - n + room
+            > hwcrhk_keys.max_resident;
+         key = newer) {
+        newer = key->newer;
+        if (key->users > 0)
+            continue;
+        if (n + key->count > HWCRHK_KEY_MAX_EVICTED)
+            break;
+        hwcrhk_key_unlink(key);
+        memcpy(evicted + n, key->handles, key->count * sizeof(*evicted));
+        n += key->count;
+        hwcrhk_keys.pending += key->count;
+        key->count = 0;
+        __atomic_store_n(&key->generation, hwcrhk_fork.generation - 1,
+                         __ATOMIC_RELAXED);
+        hwcrhk_stats_inc(residency_evictions);
+    }
+    return n;
+}
+
+/* Called without hwcrhk_keys.lock */
+static void hwcrhk_keys_unload(const HWCryptoHook_RSAKeyHandle *evicted,
+                               int n)
+{
+    int i;
+
+    if (n == 0)
+        return;
+    for (i = 0; i < n; i++)
+        p_hwcrhk_RSAUnloadKey(evicted[i], NULL);
+
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    hwcrhk_keys.pending -= n;
+    pthread_cond_broadcast(&hwcrhk_keys.cond);
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+}
+
+/*
+ * Called with hwcrhk_keys.lock held, and a limit.  Sets aside room for
+ * |room| handles about to be loaded, waiting for keys in use to be
+ * released if need be, until hwcrhk_keys_unreserve().  A key with more
+ * replicas than the limit is let through once nothing else is loaded.
+ */
+static void hwcrhk_keys_reserve(int room)
+{
+    HWCryptoHook_RSAKeyHandle evicted[HWCRHK_KEY_MAX_EVICTED];
+    int n;
+
+    for (;;) {
+        if ((n = hwcrhk_keys_evict(room, evicted)) > 0) {
+            pthread_mutex_unlock(&hwcrhk_keys.lock);
+            hwcrhk_keys_unload(evicted, n);
+            pthread_mutex_lock(&hwcrhk_keys.lock);
+            continue;
+        }
+        if (hwcrhk_keys.resident + hwcrhk_keys.pending + room
+            <= hwcrhk_keys.max_resident
+            || hwcrhk_keys.resident + hwcrhk_keys.pending == 0)
+            break;
+        pthread_cond_wait(&hwcrhk_keys.cond, &hwcrhk_keys.lock);
+    }
+    hwcrhk_keys.pending += room;
+}
+
+/* Called with hwcrhk_keys.lock held */
+static void hwcrhk_keys_unreserve(int room)
+{
+    hwcrhk_keys.pending -= room;
+    pthread_cond_broadcast(&hwcrhk_keys.cond);
+}
+
+/* Returns the number of handles unloaded */
+static int hwcrhk_keys_make_room(int room)
+{
+    HWCryptoHook_RSAKeyHandle evicted[HWCRHK_KEY_MAX_EVICTED];
+    int n;
+
+    if (__atomic_load_n(&hwcrhk_keys.max_resident, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    n = hwcrhk_keys_evict(room, evicted);
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+
+    hwcrhk_keys_unload(evicted, n);
+    return n;
+}
+
+static HWCRHK_KEY *hwcrhk_key_new(const char *key_id)
+{
+    HWCRHK_KEY *key;
+    char *name;
+    int replicas;
+
+    if ((name = hwcrhk_key_parse_id(key_id, &replicas)) == NULL)
+        return NULL;
+    key = OPENSSL_zalloc(offsetof(HWCRHK_KEY, handles)
+                         + replicas * sizeof(key->handles[0]));
+    if (key == NULL) {
+        OPENSSL_free(name);
+        return NULL;
+    }
+    key->name = name;
+    key->serial = __atomic_add_fetch(&hwcrhk_key_serial, 1, __ATOMIC_RELAXED);
+    key->trace_hash = (uint32_t)hwcrhk_fnv1a(HWCRHK_FNV_BASIS, name,
+                                             strlen(name));
+    key->replicas = replicas;
+    return key;
+}
+
+static void hwcrhk_key_free(HWCRHK_KEY *key)
+{
+    int count = 0;
+
+    if (key == NULL)
+        return;
+
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    while (key->loading)
+        pthread_cond_wait(&hwcrhk_keys.cond, &hwcrhk_keys.lock);
+    if (key->resident)
+        hwcrhk_key_unlink(key);
+    if (key->prev != NULL)
+        key->prev->next = key->next;
+    else if (hwcrhk_keys.head == key)
+        hwcrhk_keys.head = key->next;
+    if (key->next != NULL)
+        key->next->prev = key->prev;
+    /* Handles loaded before a fork aren't ours to unload */
+    if (key->generation == hwcrhk_fork.generation)
+        count = key->count;
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+
+    /*
+     * Unlinked, |key| is ours alone.  The reaper may unload the handles
+     * here, which mustn't hold up everyone else's keys.
+     */
+    if (count > 0)
+        hwcrhk_reaper_add(key->handles, count);
+    hwcrhk_sign_cache_forget(key);
+    OPENSSL_free(key->name);
+    OPENSSL_free(key);
+}
+
+/* Asks the HSM for the public half of a key whose handles are loaded */
+static int hwcrhk_key_get_public(HWCRHK_KEY *key, BIGNUM **bn_n,
+                                 BIGNUM **bn_e)
+{
+    char tempbuf[1024];
+    HWCryptoHook_ErrMsgBuf rmsg;
+    HWCryptoHook_MPI *e = NULL, *n = NULL;
+    int ret = 0, attempt, ok = 0;
+
+    rmsg.buf = tempbuf;
+    rmsg.size = sizeof(tempbuf);
+    *bn_n = *bn_e = NULL;
+
+    /* guess the starting size of n */
+    n = hwcrhk_mpi_alloc(HWCRHK_MPI_RSA_ALLOC_SIZE);
+    e = hwcrhk_mpi_new();
+
+    if (!n || !e) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY,
+                  ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+
+    for (attempt = 0; attempt < 2; ++attempt) {
+        ret = p_hwcrhk_RSAGetPublicKey(key->handles[0], n, e, &rmsg);
+
+        if (ret != HWCRYPTOHOOK_ERROR_MPISIZE)
+            break;
+
+        /* the guess was wrong, so resize and re-attempt */
+        n = hwcrhk_mpi_resize(n, n->size);
+        e = hwcrhk_mpi_resize(e, e->size);
+
+        if (n == NULL || e == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, ERR_R_MALLOC_FAILURE);
+            goto err;
+        }
+    };
+
+    if (ret < 0) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, HWCRHK_R_CHIL_ERROR);
+        ERR_add_error_data(1, rmsg.buf);
+        goto err;
+    }
+
+    *bn_e = hwcrhk_mpi_mpi2bn(e, NULL);
+    *bn_n = hwcrhk_mpi_mpi2bn(n, NULL);
+
+    if (*bn_e == NULL || *bn_n == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, ERR_R_MALLOC_FAILURE);
+        BN_free(*bn_e);
+        BN_free(*bn_n);
+        *bn_n = *bn_e = NULL;
+        goto err;
+    }
+    ok = 1;
+
+ err:
+    hwcrhk_mpi_free(e);
+    hwcrhk_mpi_free(n);
+    return ok;
+}
+
+/*
+ * Load the key's replicas.  If only some of them could be loaded, make do
+ * with those.
+ */
+static int hwcrhk_key_load(HWCRHK_KEY *key,
+                           HWCryptoHook_PassphraseContext *ppctx)
+{
+    char tempbuf[1024];
+    HWCryptoHook_ErrMsgBuf rmsg;
+    uint64_t start_ns;
+    int i, ret;
+
+    rmsg.buf = tempbuf;
+    rmsg.size = sizeof(tempbuf);
+
+    key->count = 0;
+    for (i = 0; i < key->replicas; i++) {
+        start_ns = hwcrhk_now_ns();
+        ret = p_hwcrhk_RSALoadKey(hwcrhk_context, key->name,
+                                  &key->handles[i], &rmsg, ppctx);
+        hwcrhk_trace_add(HWCRHK_TRACE_KEY_LOAD, start_ns, 0, 0,
+                         key->trace_hash, ret);
+        if (ret) {
+            if (i > 0)
+                break;
+            HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, HWCRHK_R_CHIL_ERROR);
+            ERR_add_error_data(1, rmsg.buf);
+            return 0;
+        }
+
+        if (!key->handles[i]) {
+            if (i > 0)
+                break;
+            HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, HWCRHK_R_NO_KEY);
+            return 0;
+        }
+        key->count++;
+    }
+    __atomic_store_n(&key->generation, hwcrhk_fork.generation,
+                     __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Called by the thread that marked |key| as loading */
+static int hwcrhk_key_reload(HWCRHK_KEY *key)
+{
+    if (!hwcrhk_context_current()) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, HWCRHK_R_UNIT_FAILURE);
+        return 0;
+    }
+    return hwcrhk_key_load(key, &key->ppctx);
+}
+
+/*
+ * Make sure the key's handles belong to this process, and, with a
+ * residency limit, keep them loaded until hwcrhk_key_release().  Only one
+ * thread loads a key at a time; the others wait for it.
+ */
+static int hwcrhk_key_acquire(HWCRHK_KEY *key)
+{
+    int limited, ok, missed = 0;
+
+    limited = __atomic_load_n(&hwcrhk_keys.max_resident, __ATOMIC_RELAXED) > 0;
+    if (!limited && __atomic_load_n(&key->generation, __ATOMIC_ACQUIRE)
+                    == hwcrhk_fork.generation)
+        return 1;
+
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    for (;;) {
+        while (key->loading)
+            pthread_cond_wait(&hwcrhk_keys.cond, &hwcrhk_keys.lock);
+        if (key->generation == hwcrhk_fork.generation) {
+            if (limited) {
+                key->users++;
+                hwcrhk_key_unlink(key);
+                hwcrhk_key_link(key);
+                if (!missed)
+                    hwcrhk_stats_inc(residency_hits);
+            }
+            pthread_mutex_unlock(&hwcrhk_keys.lock);
+            return 1;
+        }
+        if (!limited || missed)
+            break;
+        /* Waiting for room may let another thread load the key first */
+        hwcrhk_stats_inc(residency_misses);
+        missed = 1;
+        hwcrhk_keys_reserve(key->replicas);
+        if (key->loading || key->generation == hwcrhk_fork.generation)
+            hwcrhk_keys_unreserve(key->replicas);
+        else
+            break;
+    }
+    key->loading = 1;
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+
+    ok = hwcrhk_key_reload(key);
+
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    key->loading = 0;
+    if (limited) {
+        if (ok) {
+            key->users++;
+            hwcrhk_key_link(key);
+        }
+        hwcrhk_keys_unreserve(key->replicas);
+    }
+    pthread_cond_broadcast(&hwcrhk_keys.cond);
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+    return ok;
+}
+
+static void hwcrhk_key_release(HWCRHK_KEY *key)
+{
+    if (__atomic_load_n(&hwcrhk_keys.max_resident, __ATOMIC_RELAXED) == 0)
+        return;
+
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    if (--key->users == 0)
+        pthread_cond_broadcast(&hwcrhk_keys.cond);
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+    hwcrhk_keys_make_room(0);
+}
+
+/*
+ * Sets aside room for a new key's handles, with a limit; returns the
+ * number of handles to hand to hwcrhk_key_publish().
+ */
+static int hwcrhk_key_prepare(HWCRHK_KEY *key)
+{
+    int room = 0;
+
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    if (hwcrhk_keys.max_resident > 0) {
+        room = key->replicas;
+        hwcrhk_keys_reserve(room);
+    }
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+    return room;
+}
+
+/* Gives back the room set aside for a key that couldn't be loaded */
+static void hwcrhk_key_abandon(int room)
+{
+    if (room == 0)
+        return;
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    hwcrhk_keys_unreserve(room);
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+}
+
+/*
+ * Adds a key that was just loaded to the list, with the room set aside
+ * for it by hwcrhk_key_prepare().
+ */
+static void hwcrhk_key_publish(HWCRHK_KEY *key, int room)
+{
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    if ((key->next = hwcrhk_keys.head) != NULL)
+        key->next->prev = key;
+    hwcrhk_keys.head = key;
+    if (hwcrhk_keys.max_resident > 0
+        && key->generation == hwcrhk_fork.generation)
+        hwcrhk_key_link(key);
+    if (room > 0)
+        hwcrhk_keys_unreserve(room);
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+}
+
+/*
+ * Switching the limit on or off is only possible before any key is loaded,
+ * since keys are only kept loaded for their users with a limit.
+ */
+static int hwcrhk_keys_set_max_resident(int max)
+{
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    if ((max == 0) != (hwcrhk_keys.max_resident == 0)
+        && hwcrhk_keys.head != NULL) {
+        pthread_mutex_unlock(&hwcrhk_keys.lock);
+        HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_ALREADY_LOADED);
+        return 0;
+    }
+    __atomic_store_n(&hwcrhk_keys.max_resident, max, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+
+    while (hwcrhk_keys_make_room(0) > 0)
+        continue;
+    return 1;
+}
+
+static HWCryptoHook_RSAKeyHandle hwcrhk_key_handle(HWCRHK_KEY *key)
+{
+    if (key->count == 1)
+        return key->handles[0];
+    return key->handles[__atomic_fetch_add(&key->cursor, 1, __ATOMIC_RELAXED)
+                        % key->count];
+}
+
+static int hwcrhk_latency_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int msb, bucket;
+
+    if (us < 16)
+        return 0;
+    msb = 63 - __builtin_clzll(us);
+    bucket = (msb - 4) * 4 + (int)((us >> (msb - 2)) & 3);
+    return bucket < HWCRHK_LATENCY_BUCKETS ? bucket
+                                           : HWCRHK_LATENCY_BUCKETS - 1;
+}
+
+/* The upper bound of |bucket|, in microseconds */
+static uint64_t hwcrhk_latency_bucket_us(int bucket)
+{
+    return (uint64_t)(4 + bucket % 4 + 1) << (bucket / 4 + 2);
+}
+
+/* Called with the library's return code once a request on |key| is done */
+static void hwcrhk_key_account(HWCRHK_KEY *key, const HWCRHK_OP *op, int ret)
+{
+    HWCRHK_KEY_STATS *stats = &key->stats;
+    uint32_t count;
+    int i;
+
+    __atomic_add_fetch(&stats->ops, 1, __ATOMIC_RELAXED);
+    if (ret < 0)
+        __atomic_add_fetch(&stats->errors, 1, __ATOMIC_RELAXED);
+    i = hwcrhk_latency_bucket(hwcrhk_now_ns() - op->start_ns);
+    if (__atomic_add_fetch(&stats->latency[i], 1, __ATOMIC_RELAXED)
+        != HWCRHK_LATENCY_HALVE)
+        return;
+
+    for (i = 0; i < HWCRHK_LATENCY_BUCKETS; i++) {
+        count = __atomic_load_n(&stats->latency[i], __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&stats->latency[i], &count,
+                                            count / 2, 0, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            continue;
+    }
+}
+
+static void hwcrhk_key_usage(HWCRHK_KEY *key, HWCRHK_KEY_USAGE *usage)
+{
+    uint32_t latency[HWCRHK_LATENCY_BUCKETS];
+    uint64_t total = 0, seen = 0;
+    int i;
+
+    OPENSSL_strlcpy(usage->key_id, key->name, sizeof(usage->key_id));
+    usage->replicas = key->replicas;
+    usage->ops = __atomic_load_n(&key->stats.ops, __ATOMIC_RELAXED);
+    usage->errors = __atomic_load_n(&key->stats.errors, __ATOMIC_RELAXED);
+    usage->p50_us = usage->p99_us = 0;
+
+    for (i = 0; i < HWCRHK_LATENCY_BUCKETS; i++) {
+        latency[i] = __atomic_load_n(&key->stats.latency[i],
+                                     __ATOMIC_RELAXED);
+        total += latency[i];
+    }
+    for (i = 0; i < HWCRHK_LATENCY_BUCKETS && total > 0; i++) {
+        seen += latency[i];
+        if (usage->p50_us == 0 && seen * 2 >= total)
+            usage->p50_us = hwcrhk_latency_bucket_us(i);
+        if (seen * 100 >= total * 99) {
+            usage->p99_us = hwcrhk_latency_bucket_us(i);
+            break;
+        }
+    }
+}
+
+static int hwcrhk_key_usage_before(const HWCRHK_KEY_USAGE *a,
+                                   const HWCRHK_KEY_USAGE *b, int by)
+{
+    if (by == HWCRHK_TOP_BY_P99 && a->p99_us != b->p99_us)
+        return a->p99_us > b->p99_us;
+    return a->ops > b->ops;
+}
+
+/*
+ * Keeps the |top->max| first keys in order, by insertion, which is cheap
+ * for the handful usually asked for.
+ */
+static int hwcrhk_keys_top(HWCRHK_TOP_KEYS *top)
+{
+    HWCRHK_KEY_USAGE usage;
+    HWCRHK_KEY *key;
+    size_t pos, moved;
+
+    if ((top->by != HWCRHK_TOP_BY_OPS && top->by != HWCRHK_TOP_BY_P99)
+        || (top->keys == NULL && top->max > 0)) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_INVALID_ARGUMENT);
+        return 0;
+    }
+    top->count = 0;
+    if (top->max == 0)
+        return 1;
+
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    for (key = hwcrhk_keys.head; key != NULL; key = key->next) {
+        hwcrhk_key_usage(key, &usage);
+        for (pos = top->count; pos > 0
+             && hwcrhk_key_usage_before(&usage, &top->keys[pos - 1], top->by);
+             pos--)
+            continue;
+        if (pos == top->max)
+            continue;
+        moved = (top->count < top->max ? top->count : top->max - 1) - pos;
+        memmove(&top->keys[pos + 1], &top->keys[pos],
+                moved * sizeof(*top->keys));
+        top->keys[pos] = usage;
+        if (top->count < top->max)
+            top->count++;
+    }
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+    return 1;
+}
+
+static void *hwcrhk_keys_reload_main(void *arg)
+{
+    HWCRHK_KEY *key;
+
+    pthread_mutex_lock(&hwcrhk_keys.lock);
+    /* Everything is left alone when there is a residency limit */
+    for (key = hwcrhk_keys.head;
+         key != NULL && hwcrhk_keys.max_resident == 0; key = key->next) {
+        if (key->loading || key->generation == hwcrhk_fork.generation)
+            continue;
+        key->loading = 1;
+        pthread_mutex_unlock(&hwcrhk_keys.lock);
+
+        /* Failures are reported when the key is next used */
+        ERR_set_mark();
+        hwcrhk_key_reload(key);
+        ERR_pop_to_mark();
+
+        /* |key| can't have been freed while it was loading */
+        pthread_mutex_lock(&hwcrhk_keys.lock);
+        key->loading = 0;
+        pthread_cond_broadcast(&hwcrhk_keys.cond);
+    }
+    pthread_mutex_unlock(&hwcrhk_keys.lock);
+
+    OPENSSL_thread_stop();
+    return NULL;
+}
+
+/* Called with hwcrhk_fork.lock held, once the new context is there */
+static void hwcrhk_keys_reload_start(void)
+{
+    if (hwcrhk_keys.head != NULL
+        && pthread_create(&hwcrhk_fork.reloader, NULL,
+                          hwcrhk_keys_reload_main, NULL) == 0)
+        hwcrhk_fork.reloading = 1;
+}
+
+static void hwcrhk_keys_reload_stop(void)
+{
+    pthread_mutex_lock(&hwcrhk_fork.lock);
+    if (hwcrhk_fork.reloading) {
+        pthread_join(hwcrhk_fork.reloader, NULL);
+        hwcrhk_fork.reloading = 0;
+    }
+    pthread_mutex_unlock(&hwcrhk_fork.lock);
+}
+
+/*
+ * Give every new RSA key its ex_data slots up front.  hndidx_rsa and
+ * hndidx_rsa_embed can then be set while other threads are using the
+ * key, which storing into a slot that is already there allows.
+ */
+static void hwcrhk_rsa_ex_new(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                              int idx, long argl, void *argp)
+{
+    CRYPTO_set_ex_data(ad, idx, NULL);
+}
+
+/*
+ * "Embed" keys, made with the nCipher KM tools, carry the identity of an
+ * HSM key in their private exponent (see the comment above
+ * hwcrhk_config).  The library recognises them in ModExpCRT, loading the
+ * key again on every call.  Instead, the first time an RSA key is used it
+ * is looked at once, and an embedded key is loaded like any other and
+ * used through hndidx_rsa from then on.  If that fails, the key is left to
+ * the library as before.
+ */
+# define HWCRHK_EMBED_MARKER "nCipher KM tool key id"
+
+static int hwcrhk_embed_checked;    /* what hndidx_rsa_embed points at */
+static pthread_mutex_t hwcrhk_embed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the key identity that follows the marker in |d|, if any */
+static char *hwcrhk_embed_key_id(const BIGNUM *d)
+{
+    size_t mlen = sizeof(HWCRHK_EMBED_MARKER) - 1, len, n;
+    unsigned char *buf, *p, *end;
+    char *key_id = NULL;
+
+    if (d == NULL || (len = BN_num_bytes(d)) <= mlen
+        || (buf = OPENSSL_malloc(len)) == NULL)
+        return NULL;
+    BN_bn2bin(d, buf);
+    end = buf + len;
+
+    for (p = buf; p + mlen <= end; p++) {
+        if (memcmp(p, HWCRHK_EMBED_MARKER, mlen) != 0)
+            continue;
+        /* Some bytes, then the identity string */
+        for (p += mlen; p < end && !isalnum(*p); p++)
+            continue;
+        for (n = 0; p + n < end && (isalnum(p[n]) || p[n] == '-'
+                                    || p[n] == '_' || p[n] == '.'); n++)
+            continue;
+        if (n > 0)
+            key_id = OPENSSL_strndup((const char *)p, n);
+        break;
+    }
+
+    OPENSSL_clear_free(buf, len);
+    return key_id;
+}
+
+static HWCRHK_KEY *hwcrhk_key_embedded(RSA *rsa)
+{
+    const BIGNUM *d = NULL;
+    HWCRHK_KEY *key = NULL;
+    char *key_id;
+    int room = 0;
+
+    if (RSA_get_ex_data(rsa, hndidx_rsa_embed) != NULL)
+        return NULL;
+    /* Until the library is there, the key goes the usual way */
+    if (__atomic_load_n(&hwcrhk_lazy.state, __ATOMIC_ACQUIRE)
+        == HWCRHK_LAZY_LOADING || !hwcrhk_context)
+        return NULL;
+
+    pthread_mutex_lock(&hwcrhk_embed_lock);
+    if (RSA_get_ex_data(rsa, hndidx_rsa_embed) != NULL) {
+        key = RSA_get_ex_data(rsa, hndidx_rsa);
+        goto end;
+    }
+
+    RSA_get0_key(rsa, NULL, NULL, &d);
+    if ((key_id = hwcrhk_embed_key_id(d)) != NULL) {
+        ERR_set_mark();
+        key = hwcrhk_key_new(key_id);
+        OPENSSL_free(key_id);
+        if (key != NULL)
+            room = hwcrhk_key_prepare(key);
+        /* Its ppctx is empty, so SET_USER_INTERFACE's is used */
+        if (key != NULL
+            && (!hwcrhk_context_current()
+                || !hwcrhk_key_load(key, &key->ppctx))) {
+            hwcrhk_key_free(key);
+            hwcrhk_key_abandon(room);
+            key = NULL;
+        }
+        ERR_pop_to_mark();
+    }
+    if (key != NULL) {
+        hwcrhk_key_publish(key, room);
+
+        /* Readers of hndidx_rsa don't lock */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        RSA_set_ex_data(rsa, hndidx_rsa, key);
+    }
+    RSA_set_ex_data(rsa, hndidx_rsa_embed, &hwcrhk_embed_checked);
+
+ end:
+    pthread_mutex_unlock(&hwcrhk_embed_lock);
+    return key;
+}
+#endif
+
+static EVP_PKEY *hwcrhk_load_privkey(ENGINE *eng, const char *key_id,
+                                     UI_METHOD *ui_method,
+                                     void *callback_data)
+{
+    EVP_PKEY *res = NULL;
+
+#ifndef OPENSSL_NO_RSA
+    RSA *rtmp = NULL;
+    BIGNUM *bn_e = NULL, *bn_n = NULL;
+    HWCRHK_KEY *key = NULL;
+    int room = 0;
+#endif
+
+    if (!hwcrhk_ready(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, 0))
+        goto err;
+
+#ifndef OPENSSL_NO_RSA
+    key = hwcrhk_key_new(key_id);
+    if (key == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+
+    if (!hwcrhk_context_current()) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, HWCRHK_R_UNIT_FAILURE);
+        goto err;
+    }
+
+    /* Kept for loading the key again after a fork or an eviction */
+    key->ppctx.ui_method = ui_method;
+    key->ppctx.callback_data = callback_data;
+    room = hwcrhk_key_prepare(key);
+    if (!hwcrhk_key_load(key, &key->ppctx)
+        || !hwcrhk_key_get_public(key, &bn_n, &bn_e))
+        goto err;
+    hwcrhk_key_index_add(key->name, bn_n, bn_e);
+
+    rtmp = RSA_new_method(eng);
+    res = EVP_PKEY_new();
+
+    if (rtmp == NULL || res == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+
+    RSA_set_ex_data(rtmp, hndidx_rsa, (char *)key);
+    RSA_set0_key(rtmp, bn_n, bn_e, NULL);
+    RSA_set_flags(rtmp, RSA_FLAG_EXT_PKEY);
+
+    EVP_PKEY_assign_RSA(res, rtmp);
+
+    hwcrhk_key_publish(key, room);
+#endif
+
+    if (res == NULL)
+        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY,
+                  HWCRHK_R_PRIVATE_KEY_ALGORITHMS_DISABLED);
+
+    return res;
+
+ err:
+#ifndef OPENSSL_NO_RSA
+    BN_free(bn_e);
+    BN_free(bn_n);
+    EVP_PKEY_free(res);
+    RSA_free(rtmp);
+    hwcrhk_key_free(key);
+    hwcrhk_key_abandon(room);
+#endif
+    return NULL;
+}
+
+#ifndef OPENSSL_NO_RSA
+/*
+ * The public key recorded in the key index for |key_id|, if there is one.
+ * Only public keys are taken from there: a private key is always loaded
+ * from the HSM, with the caller's passphrase context, so that a key that
+ * was deleted or replaced there isn't taken for the one in the index.
+ */
+static EVP_PKEY *hwcrhk_load_indexed_pubkey(const char *key_id)
+{
+    EVP_PKEY *res = NULL;
+    RSA *rsa = NULL;
+    BIGNUM *bn_n = NULL, *bn_e = NULL;
+    char *name;
+    int replicas;
+
+    if ((name = hwcrhk_key_parse_id(key_id, &replicas)) == NULL)
+        return NULL;
+    if (hwcrhk_key_index_get(name, &bn_n, &bn_e)) {
+        if ((rsa = RSA_new()) == NULL || (res = EVP_PKEY_new()) == NULL
+            || !RSA_set0_key(rsa, bn_n, bn_e, NULL)) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PUBKEY, ERR_R_MALLOC_FAILURE);
+            BN_free(bn_n);
+            BN_free(bn_e);
+            RSA_free(rsa);
+            EVP_PKEY_free(res);
+            res = NULL;
+        } else {
+            EVP_PKEY_assign_RSA(res, rsa);
+        }
+    }
+    OPENSSL_free(name);
+    return res;
+}
 #endif
-    p_hwcrhk_RandomBytes = p8;
-    p_hwcrhk_ModExpCRT = p9;
 
-    /*
-     * Check if the application decided to support dynamic locks, and if it
-     * does, use them.
-     */
-    if (disable_mutex_callbacks == 0) {
-        hwcrhk_globals.mutex_init = hwcrhk_mutex_init;
-        hwcrhk_globals.mutex_acquire = hwcrhk_mutex_lock;
-        hwcrhk_globals.mutex_release = hwcrhk_mutex_unlock;
-        hwcrhk_globals.mutex_destroy = hwcrhk_mutex_destroy;
-    }
+static EVP_PKEY *hwcrhk_load_pubkey(ENGINE *eng, const char *key_id,
+                                    UI_METHOD *ui_method, void *callback_data)
+{
+    EVP_PKEY *res = NULL;
 
-    /*
-     * Try and get a context - if not, we may have a DSO but no accelerator!
-     */
-    if (!get_context(&hwcrhk_context, &password_context)) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_INIT, HWCRHK_R_UNIT_FAILURE);
-        goto err;
-    }
-    /* Everything's fine. */
 #ifndef OPENSSL_NO_RSA
-    if (hndidx_rsa == -1) {
-        hndidx_rsa = RSA_get_ex_new_index(0,
-                                          "nFast HWCryptoHook RSA key handle",
-                                          NULL, NULL, NULL);
-    }
+    if (!hwcrhk_ready(HWCRHK_F_HWCRHK_LOAD_PUBKEY, 0))
+        return NULL;
+    if ((res = hwcrhk_load_indexed_pubkey(key_id)) != NULL)
+        return res;
+    res = hwcrhk_load_privkey(eng, key_id, ui_method, callback_data);
 #endif
 
-    return 1;
- err:
-    free(hwcrhk_libname);
-    if (hwcrhk_dso != NULL) {
-        lt_dlclose(hwcrhk_dso);
-        hwcrhk_dso = NULL;
-    }
-    lt_dlexit();
-    p_hwcrhk_Init = NULL;
-    p_hwcrhk_Finish = NULL;
-    p_hwcrhk_ModExp = NULL;
+    if (res)
+        switch (EVP_PKEY_id(res)) {
 #ifndef OPENSSL_NO_RSA
-    p_hwcrhk_RSA = NULL;
-    p_hwcrhk_RSALoadKey = NULL;
-    p_hwcrhk_RSAGetPublicKey = NULL;
-    p_hwcrhk_RSAUnloadKey = NULL;
+        case EVP_PKEY_RSA:
+            {
+                RSA *rsa = NULL, *rtmp = NULL;
+                const BIGNUM *bn_n = NULL, *bn_e = NULL;
+
+                /* |res| is ours alone, nothing to lock */
+                rtmp = EVP_PKEY_get0_RSA(res);
+                RSA_get0_key(rtmp, &bn_n, &bn_e, NULL);
+
+                rsa = RSA_new();
+                RSA_set0_key(rsa, BN_dup(bn_n), BN_dup(bn_e), NULL);
+                EVP_PKEY_assign_RSA(res, rsa);
+            }
+            break;
 #endif
-    p_hwcrhk_RandomBytes = NULL;
-    p_hwcrhk_ModExpCRT = NULL;
-    return 0;
+        default:
+            HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PUBKEY,
+                      HWCRHK_R_CTRL_COMMAND_NOT_IMPLEMENTED);
+            goto err;
+        }
+
+    return res;
+
+ err:
+    EVP_PKEY_free(res);
+    return NULL;
 }
 
-static int hwcrhk_finish(ENGINE *e)
+/*
+ * Numbers as arrays of limbs of |bits| bits, least significant first, held
+ * in uint64_t.  Limb i of lane l is at [i * lanes + l]; the multi-buffer
+ * kernels have several lanes, the CRT recombination one.
+ */
+static void hwcrhk_mb_to_limbs(uint64_t *x, int lanes, int l, int n,
+                               int bits, const unsigned char *in, int len)
 {
-    int to_return = 0;
-
-    free_HWCRHK_LIBNAME();
+    uint64_t acc = 0, mask = ((uint64_t)1 << bits) - 1;
+    int i, j = 0, have = 0;
 
-    if (hwcrhk_dso == NULL) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_FINISH, HWCRHK_R_NOT_LOADED);
-        goto err;
+    for (i = 0; i < n; i++) {
+        while (have < bits && j < len) {
+            acc |= (uint64_t)in[j++] << have;
+            have += 8;
+        }
+        x[i * lanes + l] = acc & mask;
+        acc >>= bits;
+        have = have > bits ? have - bits : 0;
     }
+}
 
-    release_context(hwcrhk_context);
-    if (lt_dlclose(hwcrhk_dso) != 0) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_FINISH, HWCRHK_R_DSO_FAILURE);
-        goto err;
+static void hwcrhk_mb_from_limbs(unsigned char *out, int len,
+                                 const uint64_t *x, int lanes, int l, int n,
+                                 int bits)
+{
+    uint64_t acc = 0;
+    int i, j = 0, have = 0;
+
+    for (i = 0; i < n; i++) {
+        acc |= x[i * lanes + l] << have;
+        for (have += bits; have >= 8 && j < len; have -= 8) {
+            out[j++] = (unsigned char)acc;
+            acc >>= 8;
+        }
     }
+    for (; j < len; j++) {
+        out[j] = (unsigned char)acc;
+        acc >>= 8;
+    }
+}
 
-    to_return = 1;
+/* x -= m in lane |l| if x >= m, without branching on which */
+static void hwcrhk_mb_reduce(uint64_t *x, const uint64_t *m, uint64_t *t,
+                             int lanes, int l, int n, int bits)
+{
+    uint64_t mask = ((uint64_t)1 << bits) - 1, borrow = 0, d, keep;
+    int i;
 
- err:
-    lt_dlexit();
-    BIO_free(logstream);
-    hwcrhk_dso = NULL;
-    p_hwcrhk_Init = NULL;
-    p_hwcrhk_Finish = NULL;
-    p_hwcrhk_ModExp = NULL;
-#ifndef OPENSSL_NO_RSA
-    p_hwcrhk_RSA = NULL;
-    p_hwcrhk_RSALoadKey = NULL;
-    p_hwcrhk_RSAGetPublicKey = NULL;
-    p_hwcrhk_RSAUnloadKey = NULL;
-#endif
-    p_hwcrhk_RandomBytes = NULL;
-    p_hwcrhk_ModExpCRT = NULL;
-    return to_return;
+    for (i = 0; i < n; i++) {
+        d = x[i * lanes + l] - m[i * lanes + l] - borrow;
+        borrow = d >> 63;
+        t[i] = d & mask;
+    }
+    keep = 0 - borrow;
+    for (i = 0; i < n; i++)
+        x[i * lanes + l] = (x[i * lanes + l] & keep) | (t[i] & ~keep);
 }
 
-static int hwcrhk_ctrl(ENGINE *e, int cmd, long i, void *p, void (*f) (void))
+/*
+ * Multi-buffer software exponentiation.  The exponentiations made in
+ * software by concurrent requests are gathered by the size of their
+ * modulus and exponent and made several at a time by a vector kernel,
+ * each lane of which has its own modulus, base and exponent: eight lanes
+ * of 52-bit limbs with AVX-512 IFMA, or four lanes of 26-bit limbs with
+ * AVX2.  The kernel is picked from what CPUID and the OS say the CPU can
+ * do; without either, or on other CPUs, BN makes them one at a time as
+ * before.
+ *
+ * Limb i of lane l is at [i * lanes + l], so that one vector holds the
+ * same limb of every lane.  Multiplications are "almost" Montgomery ones,
+ * leaving a result below 2m rather than m, which R > 4m makes safe to
+ * chain without a subtraction.  The exponent is taken in fixed windows,
+ * and table entries are picked by masking, so neither the operations nor
+ * the memory touched depend on it.
+ *
+ * Batches form on their own: a thread whose request finds others of the
+ * same size in flight, but not yet queued, waits for them for up to as
+ * long as BN takes to make one of that size, and then one of the waiting
+ * threads makes the batch for all of them.  A batch too small to be worth
+ * the kernel, which includes a request that finds no others, is left to
+ * BN, and the time BN takes is what the next requests wait for.
+ */
+#ifdef HWCRHK_MB
+# define HWCRHK_MB_MAX_LANES    8
+# define HWCRHK_MB_WINDOW       5
+# define HWCRHK_MB_TABLE        (1 << HWCRHK_MB_WINDOW)
+/* Moduli are rounded up to 512 bits, exponents to 256 */
+# define HWCRHK_MB_MIN_BITS     1024
+# define HWCRHK_MB_MAX_BITS     4096
+# define HWCRHK_MB_MOD_CLASSES  (HWCRHK_MB_MAX_BITS / 512)
+# define HWCRHK_MB_EXP_CLASSES  (HWCRHK_MB_MAX_BITS / 256)
+
+/* How long to wait for others until BN's time is known */
+# ifndef HWCRHK_MB_GATHER_US
+#  define HWCRHK_MB_GATHER_US   50
+# endif
+/*
+ * The smallest batches worth making with each kernel.  A batch takes the
+ * same time however many lanes are in use; with IFMA, that of about three
+ * BN exponentiations, or four halves made by BN_mod_exp_mont_consttime_x2().
+ * See chil-bench -test software.
+ */
+# ifndef HWCRHK_MB_IFMA_MIN_LANES
+#  define HWCRHK_MB_IFMA_MIN_LANES      4
+# endif
+# ifndef HWCRHK_MB_AVX2_MIN_LANES
+#  define HWCRHK_MB_AVX2_MIN_LANES      4
+# endif
+
+typedef struct {
+    int lanes;
+    int limb_bits;
+    int min_lanes;              /* smaller batches are left to BN */
+    /*
+     * r = a * b / R mod m, almost, in |n| limbs; |t| is scratch for |n|
+     * vectors.  |r| may be |a| or |b|.
+     */
+    void (*amm) (uint64_t *r, const uint64_t *a, const uint64_t *b,
+                 const uint64_t *m, const uint64_t *k0, int n, uint64_t *t);
+    /* r = table[idx[l]] in every lane l, reading every entry */
+    void (*select) (uint64_t *r, const uint64_t *table, int n,
+                    const unsigned int *idx);
+} HWCRHK_MB_KERNEL;
+
+__attribute__ ((target("avx512f,avx512ifma")))
+static void hwcrhk_mb_amm_ifma(uint64_t *r, const uint64_t *a,
+                               const uint64_t *b, const uint64_t *m,
+                               const uint64_t *k0, int n, uint64_t *t)
 {
-    int to_return = 1;
-
-    switch (cmd) {
-    case HWCRHK_CMD_SO_PATH:
-        if (hwcrhk_dso) {
-            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_ALREADY_LOADED);
-            return 0;
+    const __m512i mask = _mm512_set1_epi64((1ULL << 52) - 1);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i k = _mm512_load_si512(k0);
+    __m512i *acc = (__m512i *)t;
+    __m512i bi, q, x, carry, aj, mj, aj1, mj1;
+    int i, j;
+
+    for (j = 0; j < n; j++)
+        acc[j] = zero;
+    for (i = 0; i < n; i++) {
+        bi = _mm512_load_si512(b + 8 * i);
+        /* The low limb decides q, and is then shifted out */
+        aj1 = _mm512_load_si512(a);
+        mj1 = _mm512_load_si512(m);
+        x = _mm512_madd52lo_epu64(acc[0], aj1, bi);
+        q = _mm512_madd52lo_epu64(zero, x, k);
+        x = _mm512_madd52lo_epu64(x, mj1, q);
+        carry = _mm512_srli_epi64(x, 52);
+        for (j = 1; j < n; j++) {
+            aj = _mm512_load_si512(a + 8 * j);
+            mj = _mm512_load_si512(m + 8 * j);
+            x = _mm512_madd52lo_epu64(acc[j], aj, bi);
+            x = _mm512_madd52lo_epu64(x, mj, q);
+            x = _mm512_madd52hi_epu64(x, aj1, bi);
+            acc[j - 1] = _mm512_madd52hi_epu64(x, mj1, q);
+            aj1 = aj;
+            mj1 = mj;
         }
-        if (p == NULL) {
-            HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, ERR_R_PASSED_NULL_PARAMETER);
-            return 0;
+        acc[0] = _mm512_add_epi64(acc[0], carry);
+        x = _mm512_madd52hi_epu64(zero, aj1, bi);
+        acc[n - 1] = _mm512_madd52hi_epu64(x, mj1, q);
+    }
+    /* Carries were left to pile up in the 12 spare bits of every limb */
+    carry = zero;
+    for (j = 0; j < n; j++) {
+        x = _mm512_add_epi64(acc[j], carry);
+        _mm512_store_si512(r + 8 * j, _mm512_and_si512(x, mask));
+        carry = _mm512_srli_epi64(x, 52);
+    }
+}
+
+__attribute__ ((target("avx512f")))
+static void hwcrhk_mb_select_ifma(uint64_t *r, const uint64_t *table, int n,
+                                  const unsigned int *idx)
+{
+    const __m512i want =
+        _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i *)idx));
+    const __m512i *in = (const __m512i *)table;
+    __m512i *out = (__m512i *)r;
+    __mmask8 k;
+    int e, j;
+
+    for (j = 0; j < n; j++)
+        out[j] = _mm512_setzero_si512();
+    for (e = 0; e < HWCRHK_MB_TABLE; e++, in += n) {
+        k = _mm512_cmpeq_epi64_mask(want, _mm512_set1_epi64(e));
+        for (j = 0; j < n; j++)
+            out[j] = _mm512_mask_mov_epi64(out[j], k, in[j]);
+    }
+}
+
+__attribute__ ((target("avx2")))
+static void hwcrhk_mb_amm_avx2(uint64_t *r, const uint64_t *a,
+                               const uint64_t *b, const uint64_t *m,
+                               const uint64_t *k0, int n, uint64_t *t)
+{
+    const __m256i mask = _mm256_set1_epi64x((1LL << 26) - 1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i k = _mm256_load_si256((const __m256i *)k0);
+    __m256i *acc = (__m256i *)t;
+    __m256i bi, q, x, carry;
+    int i, j;
+
+    for (j = 0; j < n; j++)
+        acc[j] = zero;
+    for (i = 0; i < n; i++) {
+        bi = _mm256_load_si256((const __m256i *)(b + 4 * i));
+        x = _mm256_add_epi64(acc[0],
+                             _mm256_mul_epu32(_mm256_load_si256((const __m256i *)a),
+                                              bi));
+        q = _mm256_and_si256(_mm256_mul_epu32(x, k), mask);
+        x = _mm256_add_epi64(x,
+                             _mm256_mul_epu32(_mm256_load_si256((const __m256i *)m),
+                                              q));
+        carry = _mm256_srli_epi64(x, 26);
+        for (j = 1; j < n; j++) {
+            x = _mm256_add_epi64(acc[j],
+                                 _mm256_mul_epu32(_mm256_load_si256((const __m256i *)(a + 4 * j)),
+                                                  bi));
+            acc[j - 1] = _mm256_add_epi64(x,
+                                          _mm256_mul_epu32(_mm256_load_si256((const __m256i *)(m + 4 * j)),
+                                                           q));
         }
-        return set_HWCRHK_LIBNAME((const char *)p);
-    case ENGINE_CTRL_SET_LOGSTREAM:
-        {
-            BIO *bio = (BIO *)p;
+        acc[0] = _mm256_add_epi64(acc[0], carry);
+        acc[n - 1] = zero;
+    }
+    carry = zero;
+    for (j = 0; j < n; j++) {
+        x = _mm256_add_epi64(acc[j], carry);
+        _mm256_store_si256((__m256i *)(r + 4 * j), _mm256_and_si256(x, mask));
+        carry = _mm256_srli_epi64(x, 26);
+    }
+}
 
-            CRYPTO_THREAD_write_lock(chil_lock);
-            BIO_free(logstream);
-            logstream = NULL;
-            if (BIO_up_ref(bio))
-                logstream = bio;
-            else
-                HWCRHKerr(HWCRHK_F_HWCRHK_CTRL, HWCRHK_R_BIO_WAS_FREED);
+__attribute__ ((target("avx2")))
+static void hwcrhk_mb_select_avx2(uint64_t *r, const uint64_t *table, int n,
+                                  const unsigned int *idx)
+{
+    const __m256i want =
+        _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)idx));
+    const __m256i *in = (const __m256i *)table;
+    __m256i *out = (__m256i *)r, mask;
+    int e, j;
+
+    for (j = 0; j < n; j++)
+        out[j] = _mm256_setzero_si256();
+    for (e = 0; e < HWCRHK_MB_TABLE; e++, in += n) {
+        mask = _mm256_cmpeq_epi64(want, _mm256_set1_epi64x(e));
+        for (j = 0; j < n; j++)
+            out[j] = _mm256_or_si256(out[j], _mm256_and_si256(in[j], mask));
+    }
+}
+
+static const HWCRHK_MB_KERNEL hwcrhk_mb_ifma = {
+    8, 52, HWCRHK_MB_IFMA_MIN_LANES, hwcrhk_mb_amm_ifma, hwcrhk_mb_select_ifma
+};
+
+static const HWCRHK_MB_KERNEL hwcrhk_mb_avx2 = {
+    4, 26, HWCRHK_MB_AVX2_MIN_LANES, hwcrhk_mb_amm_avx2, hwcrhk_mb_select_avx2
+};
+
+# define HWCRHK_MB_CPU_AVX2     0x1
+# define HWCRHK_MB_CPU_IFMA     0x2
+# define HWCRHK_MB_CPU_ADX      0x4     /* and BMI2, which BN uses */
+
+/* What the CPU, and the OS's saving of the registers, allow */
+static int hwcrhk_mb_cpu(void)
+{
+    static int cpu = -1;
+    unsigned int a, b, c, d, xcr0 = 0, xcr0_hi;
+    int found = 0;
+
+    if ((found = __atomic_load_n(&cpu, __ATOMIC_RELAXED)) != -1)
+        return found;
+    found = 0;
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_OSXSAVE) != 0) {
+        __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+        if (__get_cpuid_max(0, NULL) >= 7) {
+            __cpuid_count(7, 0, a, b, c, d);
+            /* XMM and YMM state, and then the three AVX-512 ones */
+            if ((xcr0 & 0x06) == 0x06 && (b & bit_AVX2) != 0)
+                found |= HWCRHK_MB_CPU_AVX2;
+            if ((xcr0 & 0xe6) == 0xe6 && (b & bit_AVX512F) != 0
+                && (b & bit_AVX512IFMA) != 0)
+                found |= HWCRHK_MB_CPU_IFMA;
+            if ((b & bit_ADX) != 0 && (b & bit_BMI2) != 0)
+                found |= HWCRHK_MB_CPU_ADX;
         }
-        CRYPTO_THREAD_unlock(chil_lock);
-        break;
-    case ENGINE_CTRL_SET_PASSWORD_CALLBACK:
-        CRYPTO_THREAD_write_lock(chil_lock);
-        password_context.password_callback = (pem_password_cb *)f;
-        CRYPTO_THREAD_unlock(chil_lock);
-        break;
-    case ENGINE_CTRL_SET_USER_INTERFACE:
-    case HWCRHK_CMD_SET_USER_INTERFACE:
-        CRYPTO_THREAD_write_lock(chil_lock);
-        password_context.ui_method = (UI_METHOD *)p;
-        CRYPTO_THREAD_unlock(chil_lock);
-        break;
-    case ENGINE_CTRL_SET_CALLBACK_DATA:
-    case HWCRHK_CMD_SET_CALLBACK_DATA:
-        CRYPTO_THREAD_write_lock(chil_lock);
-        password_context.callback_data = p;
-        CRYPTO_THREAD_unlock(chil_lock);
-        break;
-        /*
-         * this enables or disables the "SimpleForkCheck" flag used in the
-         * initialisation structure.
-         */
-    case ENGINE_CTRL_CHIL_SET_FORKCHECK:
-    case HWCRHK_CMD_FORK_CHECK:
-        CRYPTO_THREAD_write_lock(chil_lock);
-        if (i)
-            hwcrhk_globals.flags |= HWCryptoHook_InitFlags_SimpleForkCheck;
-        else
-            hwcrhk_globals.flags &= ~HWCryptoHook_InitFlags_SimpleForkCheck;
-        CRYPTO_THREAD_unlock(chil_lock);
-        break;
+    }
+    __atomic_store_n(&cpu, found, __ATOMIC_RELAXED);
+    return found;
+}
+
+static const HWCRHK_MB_KERNEL *hwcrhk_mb_kernel(void)
+{
+    int cpu;
+
+    switch (__atomic_load_n(&hwcrhk_software_batch, __ATOMIC_RELAXED)) {
+    case HWCRHK_SOFTWARE_BATCH_BEST:
+        cpu = hwcrhk_mb_cpu();
+        if ((cpu & HWCRHK_MB_CPU_IFMA) != 0)
+            return &hwcrhk_mb_ifma;
         /*
-         * This will prevent the initialisation function from "installing"
-         * the mutex-handling callbacks, even if they are available from
-         * within the library (or were provided to the library from the
-         * calling application). This is to remove any baggage for
-         * applications not using multithreading.
+         * Where BN has MULX and ADCX, it is faster than the AVX2 kernel,
+         * as libcrypto finds for its own (see rsaz_avx2_eligible()).
          */
-    case ENGINE_CTRL_CHIL_NO_LOCKING:
-        CRYPTO_THREAD_write_lock(chil_lock);
-        disable_mutex_callbacks = 1;
-        CRYPTO_THREAD_unlock(chil_lock);
-        break;
-    case HWCRHK_CMD_THREAD_LOCKING:
-        CRYPTO_THREAD_write_lock(chil_lock);
-        disable_mutex_callbacks = ((i == 0) ? 0 : 1);
-        CRYPTO_THREAD_unlock(chil_lock);
+        if ((cpu & (HWCRHK_MB_CPU_AVX2 | HWCRHK_MB_CPU_ADX))
+            == HWCRHK_MB_CPU_AVX2)
+            return &hwcrhk_mb_avx2;
         break;
-
-        /* The command isn't understood by this engine */
-    default:
-        HWCRHKerr(HWCRHK_F_HWCRHK_CTRL,
-                  HWCRHK_R_CTRL_COMMAND_NOT_IMPLEMENTED);
-        to_return = 0;
+    case HWCRHK_SOFTWARE_BATCH_AVX2:
+        if ((hwcrhk_mb_cpu() & HWCRHK_MB_CPU_AVX2) != 0)
+            return &hwcrhk_mb_avx2;
         break;
     }
+    return NULL;
+}
 
-    return to_return;
+/* Spreads the |len| little-endian bytes of |in| over lane |l| of |x| */
+/* Bits |pos| to |pos| + HWCRHK_MB_WINDOW - 1 of the exponent |e| */
+static unsigned int hwcrhk_mb_window(const unsigned char *e, int len, int pos)
+{
+    unsigned int v = 0;
+    int i, b;
+
+    for (i = 0; i < HWCRHK_MB_WINDOW; i++) {
+        b = pos + i;
+        if ((b >> 3) < len)
+            v |= (unsigned int)((e[b >> 3] >> (b & 7)) & 1) << i;
+    }
+    return v;
 }
 
+typedef struct hwcrhk_mb_job_st HWCRHK_MB_JOB;
+struct hwcrhk_mb_job_st {
+    HWCRHK_MB_JOB *next;        /* in its queue */
+    BIGNUM *r;
+    const BIGNUM *a, *p, *m;
+    int mod_bits, exp_bits;     /* rounded up as above */
+    int queue;                  /* -1 if never queued */
+    int state;
+    int status;
+    uint64_t scalar_ns;         /* when it was left to BN */
+};
+
+# define HWCRHK_MB_QUEUED       0
+# define HWCRHK_MB_RUNNING      1
+# define HWCRHK_MB_DONE         2   /* in a batch, see |status| */
+# define HWCRHK_MB_SCALAR       3   /* left to BN */
 
-static HWCryptoHook_MPI *hwcrhk_mpi_new(void)
+/* 64-byte aligned for the kernels' loads */
+static uint64_t *hwcrhk_mb_align(void *p)
 {
-    return hwcrhk_mpi_alloc(HWCRHK_MPI_DEFAULT_ALLOC_SIZE);
+    return (uint64_t *)(((uintptr_t)p + 63) & ~(uintptr_t)63);
 }
 
-static HWCryptoHook_MPI *hwcrhk_mpi_alloc(size_t size)
+/*
+ * Makes the |count| exponentiations of |jobs|, which share their size
+ * classes, in the lanes of |kernel|.  Lanes beyond |count| repeat the
+ * first job.  Returns 1 on success.
+ */
+static int hwcrhk_mb_run(const HWCRHK_MB_KERNEL *kernel,
+                         HWCRHK_MB_JOB **jobs, int count)
 {
-    HWCryptoHook_MPI *mpi;
+    int lanes = kernel->lanes, bits = kernel->limb_bits;
+    int mod_bits = jobs[0]->mod_bits, exp_bits = jobs[0]->exp_bits;
+    int n = (mod_bits + 2 + bits - 1) / bits;
+    int mod_bytes = mod_bits / 8, exp_bytes = exp_bits / 8;
+    size_t size = (size_t)n * lanes, alloc;
+    uint64_t *table, *m, *one, *acc, *sel, *t, *k0, m0, inv;
+    unsigned int idx[HWCRHK_MB_MAX_LANES];
+    unsigned char *buf = NULL, *exps;
+    void *mem = NULL;
+    BN_CTX *ctx = NULL;
+    BIGNUM *v, *rr, *mc = NULL;
+    int i, j, l, w, pos, ok = 0;
+
+    /* table, m, 1, acc, sel and t (of n limbs), and k0 */
+    alloc = ((HWCRHK_MB_TABLE + 5) * size + lanes) * sizeof(uint64_t) + 64;
+    if ((mem = OPENSSL_zalloc(alloc)) == NULL
+        || (buf = OPENSSL_malloc(mod_bytes + lanes * exp_bytes)) == NULL
+        || (ctx = BN_CTX_new()) == NULL
+        || (mc = BN_new()) == NULL)
+        goto err;
+    table = hwcrhk_mb_align(mem);
+    m = table + HWCRHK_MB_TABLE * size;
+    one = m + size;
+    acc = one + size;
+    sel = acc + size;
+    t = sel + size;
+    k0 = t + size;
+    exps = buf + mod_bytes;
+
+    BN_CTX_start(ctx);
+    rr = BN_CTX_get(ctx);
+    if ((v = BN_CTX_get(ctx)) == NULL)
+        goto err;
+    BN_set_flags(v, BN_FLG_CONSTTIME);
+    for (l = 0; l < lanes; l++) {
+        HWCRHK_MB_JOB *job = jobs[l < count ? l : 0];
 
-    mpi = OPENSSL_malloc(sizeof(HWCryptoHook_MPI) + size);
-    if (mpi == NULL) {
-        return NULL;
+        BN_with_flags(mc, job->m, BN_FLG_CONSTTIME);
+        if (BN_bn2lebinpad(job->m, buf, mod_bytes) < 0)
+            goto err;
+        hwcrhk_mb_to_limbs(m, lanes, l, n, bits, buf, mod_bytes);
+        /* k0 = -m^-1 mod 2^bits, each step doubling the bits that are right */
+        for (m0 = 0, i = 7; i >= 0; i--)
+            m0 = (m0 << 8) | buf[i];
+        for (inv = m0, i = 0; i < 5; i++)
+            inv *= 2 - m0 * inv;
+        k0[l] = (0 - inv) & (((uint64_t)1 << bits) - 1);
+        /* R^2 mod m goes in sel for now, and the base in acc */
+        BN_zero(rr);
+        if (!BN_set_bit(rr, 2 * n * bits)
+            || !BN_mod(v, rr, mc, ctx)
+            || BN_bn2lebinpad(v, buf, mod_bytes) < 0)
+            goto err;
+        hwcrhk_mb_to_limbs(sel, lanes, l, n, bits, buf, mod_bytes);
+        if (!BN_nnmod(v, job->a, mc, ctx)
+            || BN_bn2lebinpad(v, buf, mod_bytes) < 0
+            || BN_bn2lebinpad(job->p, exps + l * exp_bytes, exp_bytes) < 0)
+            goto err;
+        hwcrhk_mb_to_limbs(acc, lanes, l, n, bits, buf, mod_bytes);
+        one[l] = 1;
     }
 
-    mpi->buf = ((unsigned char *)mpi) + sizeof(HWCryptoHook_MPI);
-    mpi->size = size;
+    /* table[i] = a^i R */
+    kernel->amm(table, sel, one, m, k0, n, t);
+    kernel->amm(table + size, acc, sel, m, k0, n, t);
+    for (i = 2; i < HWCRHK_MB_TABLE; i++)
+        kernel->amm(table + i * size, table + (i - 1) * size, table + size,
+                    m, k0, n, t);
+
+    pos = (exp_bits - 1) / HWCRHK_MB_WINDOW * HWCRHK_MB_WINDOW;
+    for (l = 0; l < lanes; l++)
+        idx[l] = hwcrhk_mb_window(exps + l * exp_bytes, exp_bytes, pos);
+    kernel->select(acc, table, n, idx);
+    for (pos -= HWCRHK_MB_WINDOW; pos >= 0; pos -= HWCRHK_MB_WINDOW) {
+        for (w = 0; w < HWCRHK_MB_WINDOW; w++)
+            kernel->amm(acc, acc, acc, m, k0, n, t);
+        for (l = 0; l < lanes; l++)
+            idx[l] = hwcrhk_mb_window(exps + l * exp_bytes, exp_bytes, pos);
+        kernel->select(sel, table, n, idx);
+        kernel->amm(acc, acc, sel, m, k0, n, t);
+    }
+    /* Out of Montgomery form, which leaves it at most m */
+    kernel->amm(acc, acc, one, m, k0, n, t);
 
-    return mpi;
+    for (l = 0; l < count; l++) {
+        hwcrhk_mb_reduce(acc, m, t, lanes, l, n, bits);
+        hwcrhk_mb_from_limbs(buf, mod_bytes, acc, lanes, l, n, bits);
+        if (BN_lebin2bn(buf, mod_bytes, jobs[l]->r) == NULL)
+            goto err;
+    }
+    for (j = 0; j < count; j++)
+        jobs[j]->status = 1;
+    ok = 1;
+
+ err:
+    if (ctx != NULL)
+        BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
+    BN_free(mc);
+    if (buf != NULL)
+        OPENSSL_clear_free(buf, mod_bytes + lanes * exp_bytes);
+    if (mem != NULL)
+        OPENSSL_clear_free(mem, alloc);
+    return ok;
 }
 
-static HWCryptoHook_MPI *hwcrhk_mpi_resize(HWCryptoHook_MPI *mpi, size_t size)
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct {
+        HWCRHK_MB_JOB *head, *tail;
+        int queued;
+        int inflight;           /* not yet made, in a batch or by BN */
+        uint64_t bn_ns;         /* moving average of BN's time for one */
+    } queues[HWCRHK_MB_MOD_CLASSES * HWCRHK_MB_EXP_CLASSES];
+} hwcrhk_mb = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* The other threads' requests are gone */
+static void hwcrhk_mb_atfork_child(void)
 {
-    if (mpi == NULL) {
-        return NULL;
+    pthread_mutex_init(&hwcrhk_mb.lock, NULL);
+    pthread_cond_init(&hwcrhk_mb.cond, NULL);
+    memset(hwcrhk_mb.queues, 0, sizeof(hwcrhk_mb.queues));
+}
+
+/*
+ * Makes those of the |count| exponentiations in |jobs| that suit it in
+ * batches with other threads'.  Those left in state HWCRHK_MB_SCALAR are
+ * for the caller to make, and then hand to hwcrhk_mb_release().  Returns
+ * 0 if a batch failed.
+ */
+static int hwcrhk_mb_mod_exp(HWCRHK_MB_JOB *jobs, int count)
+{
+    const HWCRHK_MB_KERNEL *kernel;
+    HWCRHK_MB_JOB *job, *batch[HWCRHK_MB_MAX_LANES], **pp;
+    struct timespec until;
+    uint64_t gather_ns;
+    int i, j, n, mod_bits, exp_bits, waiting, ok = 1;
+
+    for (i = 0; i < count; i++) {
+        jobs[i].state = HWCRHK_MB_SCALAR;
+        jobs[i].queue = -1;
+    }
+    if ((kernel = hwcrhk_mb_kernel()) == NULL)
+        return 1;
+    /*
+     * Short exponents, public ones in particular, are left to BN, which
+     * takes no more steps than they have bits.  The exponent is rounded
+     * up as BN_mod_exp_mont_consttime() rounds it to words.
+     */
+    for (i = 0; i < count; i++) {
+        mod_bits = BN_num_bits(jobs[i].m);
+        exp_bits = BN_num_bits(jobs[i].p);
+        if (!BN_is_odd(jobs[i].m) || BN_is_negative(jobs[i].p)
+            || mod_bits < HWCRHK_MB_MIN_BITS || mod_bits > HWCRHK_MB_MAX_BITS
+            || exp_bits <= 64 || exp_bits > HWCRHK_MB_MAX_BITS)
+            return 1;
+        jobs[i].mod_bits = (mod_bits + 511) / 512 * 512;
+        jobs[i].exp_bits = (exp_bits + 255) / 256 * 256;
     }
 
-    if (size <= HWCRHK_MPI_DEFAULT_ALLOC_SIZE) {
-        mpi->size = size;
-        return mpi;
+    pthread_mutex_lock(&hwcrhk_mb.lock);
+    gather_ns = hwcrhk_mb.queues[(jobs[0].mod_bits / 512 - 1)
+                                 * HWCRHK_MB_EXP_CLASSES
+                                 + jobs[0].exp_bits / 256 - 1].bn_ns;
+    if (gather_ns == 0)
+        gather_ns = (uint64_t)HWCRHK_MB_GATHER_US * 1000;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += gather_ns / 1000000000;
+    until.tv_nsec += (long)(gather_ns % 1000000000);
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    for (i = 0; i < count; i++) {
+        job = &jobs[i];
+        job->queue = (job->mod_bits / 512 - 1) * HWCRHK_MB_EXP_CLASSES
+            + job->exp_bits / 256 - 1;
+        job->state = HWCRHK_MB_QUEUED;
+        job->next = NULL;
+        if (hwcrhk_mb.queues[job->queue].tail != NULL)
+            hwcrhk_mb.queues[job->queue].tail->next = job;
+        else
+            hwcrhk_mb.queues[job->queue].head = job;
+        hwcrhk_mb.queues[job->queue].tail = job;
+        hwcrhk_mb.queues[job->queue].queued++;
+        hwcrhk_mb.queues[job->queue].inflight++;
     }
+    pthread_cond_broadcast(&hwcrhk_mb.cond);
+
+    for (;;) {
+        for (i = 0, job = NULL, waiting = 0; i < count; i++) {
+            if (jobs[i].state == HWCRHK_MB_QUEUED && job == NULL)
+                job = &jobs[i];
+            if (jobs[i].state == HWCRHK_MB_RUNNING)
+                waiting = 1;
+        }
+        if (job == NULL) {
+            if (!waiting)
+                break;
+            /* In a batch another thread is making */
+            pthread_cond_wait(&hwcrhk_mb.cond, &hwcrhk_mb.lock);
+            continue;
+        }
+        j = job->queue;
+        if (hwcrhk_mb.queues[j].queued < kernel->lanes
+            && hwcrhk_mb.queues[j].queued < hwcrhk_mb.queues[j].inflight
+            && pthread_cond_timedwait(&hwcrhk_mb.cond, &hwcrhk_mb.lock,
+                                      &until) == 0)
+            continue;
+        if (job->state != HWCRHK_MB_QUEUED)
+            continue;
+
+        /* This thread makes the batch, its own request first */
+        batch[0] = job;
+        for (n = 1, pp = &hwcrhk_mb.queues[j].head; *pp != NULL;) {
+            if (*pp == job) {
+                *pp = job->next;
+                continue;
+            }
+            if (n < kernel->lanes) {
+                batch[n++] = *pp;
+                *pp = (*pp)->next;
+                continue;
+            }
+            pp = &(*pp)->next;
+        }
+        for (hwcrhk_mb.queues[j].tail = NULL, pp = &hwcrhk_mb.queues[j].head;
+             *pp != NULL; pp = &(*pp)->next)
+            hwcrhk_mb.queues[j].tail = *pp;
+        hwcrhk_mb.queues[j].queued -= n;
+        if (n < kernel->min_lanes) {
+            for (i = 0; i < n; i++)
+                batch[i]->state = HWCRHK_MB_SCALAR;
+            pthread_cond_broadcast(&hwcrhk_mb.cond);
+            continue;
+        }
+        for (i = 0; i < n; i++)
+            batch[i]->state = HWCRHK_MB_RUNNING;
+        pthread_mutex_unlock(&hwcrhk_mb.lock);
 
-    mpi = OPENSSL_realloc(mpi, sizeof(HWCryptoHook_MPI) + size);
-    if (mpi == NULL) {
-        return NULL;
+        if (!hwcrhk_mb_run(kernel, batch, n)) {
+            for (i = 0; i < n; i++)
+                batch[i]->status = 0;
+        }
+        __atomic_add_fetch(&hwcrhk_stats.software_batches, 1,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&hwcrhk_stats.software_batched, n,
+                           __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&hwcrhk_mb.lock);
+        for (i = 0; i < n; i++)
+            batch[i]->state = HWCRHK_MB_DONE;
+        pthread_cond_broadcast(&hwcrhk_mb.cond);
     }
-
-    mpi->buf = ((unsigned char *)mpi) + sizeof(HWCryptoHook_MPI);
-    mpi->size = size;
-
-    return mpi;
+    for (i = 0; i < count; i++) {
+        if (jobs[i].state == HWCRHK_MB_SCALAR) {
+            jobs[i].scalar_ns = hwcrhk_now_ns();
+            continue;
+        }
+        hwcrhk_mb.queues[jobs[i].queue].inflight--;
+        if (!jobs[i].status)
+            ok = 0;
+    }
+    pthread_mutex_unlock(&hwcrhk_mb.lock);
+    if (!ok)
+        HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP, ERR_R_BN_LIB);
+    return ok;
 }
 
-static void hwcrhk_mpi_free(HWCryptoHook_MPI *mpi)
+/* The caller has made those of |jobs| that were left to BN */
+static void hwcrhk_mb_release(HWCRHK_MB_JOB *jobs, int count)
 {
-    if (mpi != NULL) {
-        OPENSSL_free(mpi);
+    uint64_t now = hwcrhk_now_ns(), *bn_ns;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (jobs[i].queue < 0 || jobs[i].state != HWCRHK_MB_SCALAR)
+            continue;
+        pthread_mutex_lock(&hwcrhk_mb.lock);
+        hwcrhk_mb.queues[jobs[i].queue].inflight--;
+        bn_ns = &hwcrhk_mb.queues[jobs[i].queue].bn_ns;
+        if (*bn_ns == 0)
+            *bn_ns = now - jobs[i].scalar_ns;
+        else
+            *bn_ns = *bn_ns - *bn_ns / 8 + (now - jobs[i].scalar_ns) / 8;
+        /* Others may have been waiting for this one to join them */
+        pthread_cond_broadcast(&hwcrhk_mb.cond);
+        pthread_mutex_unlock(&hwcrhk_mb.lock);
     }
 }
+#endif                          /* HWCRHK_MB */
 
-static HWCryptoHook_MPI *hwcrhk_mpi_bn2mpi(const BIGNUM *bn)
+/*
+ * Software versions of the above, for when the HSM can't take a request in
+ * time (see hwcrhk_op_begin()).  The exponents may well be private, so the
+ * constant time exponentiation is used wherever the modulus allows it.
+ */
+static int hwcrhk_sw_mod_exp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
+                             const BIGNUM *m, BN_CTX *ctx)
 {
-    HWCryptoHook_MPI *mpi = NULL;
-    size_t mpi_size;
-
-    if (bn == NULL) {
-        return NULL;
-    }
-
-    /* round up to the nearest BN_BYTES */
-    mpi_size = ((size_t)(BN_num_bytes(bn) + BN_BYTES - 1) / BN_BYTES) * BN_BYTES;
-    mpi = hwcrhk_mpi_alloc(mpi_size);
-
-    if (mpi == NULL) {
-        goto err;
-    }
+    BN_CTX *tmp = NULL;
+    int ret;
+
+#ifdef HWCRHK_MB
+    HWCRHK_MB_JOB job;
+
+    memset(&job, 0, sizeof(job));
+    job.r = r;
+    job.a = a;
+    job.p = p;
+    job.m = m;
+    if (!hwcrhk_mb_mod_exp(&job, 1))
+        return 0;
+    if (job.state != HWCRHK_MB_SCALAR)
+        return 1;
+#endif
+    if (ctx == NULL && (ctx = tmp = BN_CTX_new()) == NULL)
+        ret = 0;
+    else if (BN_is_odd(m))
+        ret = BN_mod_exp_mont_consttime(r, a, p, m, ctx, NULL);
+    else
+        ret = BN_mod_exp(r, a, p, m, ctx);
+    BN_CTX_free(tmp);
+#ifdef HWCRHK_MB
+    hwcrhk_mb_release(&job, 1);
+#endif
+    return ret;
+}
 
-#ifdef L_ENDIAN
-    if (BN_bn2lebinpad(bn, mpi->buf, mpi_size) != mpi_size) {
+/* m1 = m1^dmp1 mod p and m2 = m2^dmq1 mod q, by BN */
+static int hwcrhk_sw_mod_exp_pair(BIGNUM *m1, const BIGNUM *dmp1,
+                                  const BIGNUM *p, BIGNUM *m2,
+                                  const BIGNUM *dmq1, const BIGNUM *q,
+                                  BN_CTX *ctx)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    /*
+     * Both halves at once: libcrypto runs them side by side in one AVX-512
+     * IFMA kernel where the CPU has it and the primes suit, and one after
+     * the other otherwise.
+     */
+    return BN_mod_exp_mont_consttime_x2(m1, m1, dmp1, p, NULL,
+                                        m2, m2, dmq1, q, NULL, ctx);
 #else
-    if (BN_bn2binpad(bn, mpi->buf, mpi_size) != mpi_size) {
+    return BN_mod_exp_mont_consttime(m1, m1, dmp1, p, ctx, NULL)
+        && BN_mod_exp_mont_consttime(m2, m2, dmq1, q, ctx, NULL);
 #endif
-        goto err;
-    }
-
-    return mpi;
-
- err:
-    hwcrhk_mpi_free(mpi);
-
-    return NULL;
 }
 
-static BIGNUM *hwcrhk_mpi_mpi2bn(const HWCryptoHook_MPI *mpi, BIGNUM *ret)
+/* The same, in batches with other threads' where they can be */
+static int hwcrhk_sw_mod_exp_halves(BIGNUM *m1, const BIGNUM *dmp1,
+                                    const BIGNUM *p, BIGNUM *m2,
+                                    const BIGNUM *dmq1, const BIGNUM *q,
+                                    BN_CTX *ctx)
 {
-    if (mpi == NULL || mpi->buf == NULL) {
-        return NULL;
-    }
-
-#ifdef L_ENDIAN
-    return BN_lebin2bn(mpi->buf, mpi->size, ret);
+#ifdef HWCRHK_MB
+    HWCRHK_MB_JOB jobs[2];
+    int ok;
+
+    memset(jobs, 0, sizeof(jobs));
+    jobs[0].r = m1;
+    jobs[0].a = m1;
+    jobs[0].p = dmp1;
+    jobs[0].m = p;
+    jobs[1].r = m2;
+    jobs[1].a = m2;
+    jobs[1].p = dmq1;
+    jobs[1].m = q;
+    ok = hwcrhk_mb_mod_exp(jobs, 2);
+    if (ok && jobs[0].state == HWCRHK_MB_SCALAR
+        && jobs[1].state == HWCRHK_MB_SCALAR)
+        ok = hwcrhk_sw_mod_exp_pair(m1, dmp1, p, m2, dmq1, q, ctx);
+    else if (ok)
+        ok = (jobs[0].state != HWCRHK_MB_SCALAR
+              || BN_mod_exp_mont_consttime(m1, m1, dmp1, p, ctx, NULL))
+            && (jobs[1].state != HWCRHK_MB_SCALAR
+                || BN_mod_exp_mont_consttime(m2, m2, dmq1, q, ctx, NULL));
+    hwcrhk_mb_release(jobs, 2);
+    return ok;
 #else
-    return BN_bin2bn(mpi->buf, mpi->size, ret);
+    return hwcrhk_sw_mod_exp_pair(m1, dmp1, p, m2, dmq1, q, ctx);
 #endif
 }
 
-
-static EVP_PKEY *hwcrhk_load_privkey(ENGINE *eng, const char *key_id,
-                                     UI_METHOD *ui_method,
-                                     void *callback_data)
+static int hwcrhk_sw_mod_exp_crt(BIGNUM *r, const BIGNUM *I,
+                                 const BIGNUM *p, const BIGNUM *q,
+                                 const BIGNUM *dmp1, const BIGNUM *dmq1,
+                                 const BIGNUM *iqmp)
 {
-    EVP_PKEY *res = NULL;
+    BN_CTX *ctx;
+    BIGNUM *m1, *m2;
+    int ret = 0;
 
-#ifndef OPENSSL_NO_RSA
-    RSA *rtmp = NULL;
-    BIGNUM *bn_e = NULL, *bn_n = NULL;
-    HWCryptoHook_MPI *e = NULL, *n = NULL;
-    HWCryptoHook_RSAKeyHandle *hptr;
+    if ((ctx = BN_CTX_new()) == NULL)
+        return 0;
+    BN_CTX_start(ctx);
+    m1 = BN_CTX_get(ctx);
+    m2 = BN_CTX_get(ctx);
+    if (m2 == NULL
+        || !BN_nnmod(m1, I, p, ctx)
+        || !BN_nnmod(m2, I, q, ctx)
+        || !hwcrhk_sw_mod_exp_halves(m1, dmp1, p, m2, dmq1, q, ctx))
+        goto err;
+    /* r = m2 + q * ((m1 - m2) * iqmp mod p) */
+    if (!BN_mod_sub(m1, m1, m2, p, ctx)
+        || !BN_mod_mul(m1, m1, iqmp, p, ctx)
+        || !BN_mul(r, m1, q, ctx)
+        || !BN_add(r, r, m2))
+        goto err;
+    ret = 1;
 
+ err:
+    BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
+    return ret;
+}
+
+/* A little mod_exp */
+static int hwcrhk_bn_mod_exp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
+                          const BIGNUM *m, BN_CTX *ctx)
+{
     char tempbuf[1024];
     HWCryptoHook_ErrMsgBuf rmsg;
-    int ret = 0, attempt;
-    HWCryptoHook_PassphraseContext ppctx;
+    /*
+     * Since HWCryptoHook_MPI is pretty compatible with BIGNUM's, we use them
+     * directly, plus a little macro magic.  We only thing we need to make
+     * sure of is that enough space is allocated.
+     */
+    HWCryptoHook_MPI *m_a = NULL, *m_p = NULL, *m_m = NULL, *m_r = NULL;
+    int to_return = 0, ret = 0, attempt;
+    HWCRHK_OP op;
 
     rmsg.buf = tempbuf;
     rmsg.size = sizeof(tempbuf);
-#endif
 
-    if (!hwcrhk_context) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, HWCRHK_R_NOT_INITIALISED);
+    switch (hwcrhk_ready(HWCRHK_F_HWCRHK_BN_MOD_EXP, 1)) {
+    case HWCRHK_OP_FAIL:
         goto err;
-    }
-
-#ifndef OPENSSL_NO_RSA
-    hptr = OPENSSL_malloc(sizeof(*hptr));
-    if (hptr == NULL) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, ERR_R_MALLOC_FAILURE);
+    case HWCRHK_OP_SOFTWARE:
+        to_return = hwcrhk_sw_mod_exp(r, a, p, m, ctx);
         goto err;
     }
+    /* Prepare the params */
+    m_a = hwcrhk_mpi_bn2mpi(a);
+    m_p = hwcrhk_mpi_bn2mpi(p);
+    m_m = hwcrhk_mpi_bn2mpi(m);
 
-    ppctx.ui_method = ui_method;
-    ppctx.callback_data = callback_data;
-    if (p_hwcrhk_RSALoadKey(hwcrhk_context, key_id, hptr, &rmsg, &ppctx)) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, HWCRHK_R_CHIL_ERROR);
-        ERR_add_error_data(1, rmsg.buf);
-        goto err;
-    }
+    /* guess that the result size will be the same size as a */
+    m_r = hwcrhk_mpi_alloc(m_a->size);
 
-    if (!*hptr) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, HWCRHK_R_NO_KEY);
+    if (!m_a || !m_p || !m_m || !m_r) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP,
+           ERR_R_MALLOC_FAILURE);
         goto err;
     }
 
-    /* guess the starting size of n */
-    n = hwcrhk_mpi_alloc(HWCRHK_MPI_RSA_ALLOC_SIZE);
-    e = hwcrhk_mpi_new();
-
-    if (!n || !e) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY,
-                  ERR_R_MALLOC_FAILURE);
+    switch (hwcrhk_op_begin(&op, HWCRHK_F_HWCRHK_BN_MOD_EXP, 1)) {
+    case HWCRHK_OP_FAIL:
+        goto err;
+    case HWCRHK_OP_SOFTWARE:
+        to_return = hwcrhk_sw_mod_exp(r, a, p, m, ctx);
         goto err;
     }
-
     for (attempt = 0; attempt < 2; ++attempt) {
-        ret = p_hwcrhk_RSAGetPublicKey(*hptr, n, e, &rmsg);
+        ret = p_hwcrhk_ModExp(hwcrhk_context, *m_a, *m_p, *m_m, m_r, &rmsg);
 
         if (ret != HWCRYPTOHOOK_ERROR_MPISIZE)
             break;
 
-        /* the guess was wrong, so resize and re-attempt */
-        n = hwcrhk_mpi_resize(n, n->size);
-        e = hwcrhk_mpi_resize(e, e->size);
-
-        if (n == NULL || e == NULL) {
-            HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, ERR_R_MALLOC_FAILURE);
+        /* the guess was wrong, and m_r->size is the new size */
+        m_r = hwcrhk_mpi_resize(m_r, m_r->size);
+        if (m_r == NULL) {
+            hwcrhk_op_end(&op, ret);
+            HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP, ERR_R_MALLOC_FAILURE);
             goto err;
         }
-    };
+    }
+    hwcrhk_op_end(&op, ret);
+    hwcrhk_trace_add(HWCRHK_TRACE_MOD_EXP, op.start_ns, BN_num_bits(m),
+                     BN_num_bits(p), 0, ret);
+
+    /* Convert the response */
+    hwcrhk_mpi_mpi2bn(m_r, r);
 
     if (ret < 0) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, HWCRHK_R_CHIL_ERROR);
+        /*
+         * FIXME: When this error is returned, HWCryptoHook is telling us
+         * that falling back to software computation might be a good thing.
+         */
+        if (ret == HWCRYPTOHOOK_ERROR_FALLBACK) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP, HWCRHK_R_REQUEST_FALLBACK);
+        } else {
+            HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP, HWCRHK_R_REQUEST_FAILED);
+        }
         ERR_add_error_data(1, rmsg.buf);
         goto err;
     }
 
-    bn_e = hwcrhk_mpi_mpi2bn(e, NULL);
-    bn_n = hwcrhk_mpi_mpi2bn(n, NULL);
+    to_return = 1;
 
-    hwcrhk_mpi_free(e);
-    hwcrhk_mpi_free(n);
+ err:
+    hwcrhk_mpi_free(m_a);
+    hwcrhk_mpi_free(m_p);
+    hwcrhk_mpi_free(m_m);
+    hwcrhk_mpi_free(m_r);
 
-    e = NULL;
-    n = NULL;
+    return to_return;
+}
 
-    if (bn_e == NULL || bn_n == NULL) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, ERR_R_MALLOC_FAILURE);
-        goto err;
+/*
+ * With "SPLIT_CRT", the halves of a CRT mod_exp are made as separate
+ * ModExp requests, one of them from a pool worker, so that they run side
+ * by side and the latency is about that of a half size exponentiation.
+ * Multi-prime keys (RFC 8017) are always dealt with that way, one request
+ * per prime, since ModExpCRT only takes two.  The library spreads
+ * simultaneous requests over the modules it has.
+ *
+ * The calling thread makes the last prime's request and then, in turn,
+ * any that no worker has picked up yet, so a caller that is itself a pool
+ * worker never waits on a job queued behind it.  A job can outlive the
+ * caller that way, so it is reference counted.
+ */
+/* OpenSSL has multi-prime keys, of up to 5 primes, from 1.1.1 on */
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+# define HWCRHK_CRT_MAX_PRIMES  5
+#else
+# define HWCRHK_CRT_MAX_PRIMES  2
+#endif
+
+/*
+ * The halves are recombined at a fixed width, in 32-bit limbs as the
+ * multi-buffer code holds them, so that neither the operations nor the
+ * memory touched depend on the values, only on the sizes of the primes.
+ * Each prime has a Montgomery context of its own making, with B = 2^32:
+ * products are a * b / B^n mod m, reduced by a masked subtraction.
+ */
+#define HWCRHK_CRT_LIMB_BITS    32
+#define HWCRHK_CRT_LIMB_MASK    (((uint64_t)1 << HWCRHK_CRT_LIMB_BITS) - 1)
+
+typedef struct {
+    int n;                      /* limbs of m */
+    uint64_t k0;                /* -1 / m mod B */
+    uint64_t *m;                /* n + 1 limbs, the top one 0 */
+    uint64_t *rr;               /* B^2n mod m */
+} HWCRHK_CRT_MOD;
+
+/* The scratch space the functions below want for |n| limbs */
+#define HWCRHK_CRT_SCRATCH(n)   (4 * (n) + 3)
+
+/* r = a * b / B^n mod m, for a below B^n and b below m; r may be a or b */
+static void hwcrhk_crt_mont_mul(uint64_t *r, const uint64_t *a,
+                                const uint64_t *b, const HWCRHK_CRT_MOD *mod,
+                                uint64_t *t)
+{
+    const uint64_t *m = mod->m;
+    uint64_t s, c, u;
+    int i, j, n = mod->n;
+
+    memset(t, 0, (n + 2) * sizeof(*t));
+    for (i = 0; i < n; i++) {
+        for (c = 0, j = 0; j < n; j++) {
+            s = t[j] + a[j] * b[i] + c;
+            t[j] = s & HWCRHK_CRT_LIMB_MASK;
+            c = s >> HWCRHK_CRT_LIMB_BITS;
+        }
+        s = t[n] + c;
+        t[n] = s & HWCRHK_CRT_LIMB_MASK;
+        t[n + 1] = s >> HWCRHK_CRT_LIMB_BITS;
+
+        u = (t[0] * mod->k0) & HWCRHK_CRT_LIMB_MASK;
+        c = (t[0] + u * m[0]) >> HWCRHK_CRT_LIMB_BITS;
+        for (j = 1; j < n; j++) {
+            s = t[j] + u * m[j] + c;
+            t[j - 1] = s & HWCRHK_CRT_LIMB_MASK;
+            c = s >> HWCRHK_CRT_LIMB_BITS;
+        }
+        s = t[n] + c;
+        t[n - 1] = s & HWCRHK_CRT_LIMB_MASK;
+        t[n] = t[n + 1] + (s >> HWCRHK_CRT_LIMB_BITS);
     }
+    /* t is below 2m */
+    hwcrhk_mb_reduce(t, m, t + n + 1, 1, 0, n + 1, HWCRHK_CRT_LIMB_BITS);
+    memcpy(r, t, n * sizeof(*r));
+}
 
-    rtmp = RSA_new_method(eng);
-    res = EVP_PKEY_new();
+/* r = a + b mod m, or a - b mod m if |sub|, for a and b below m */
+static void hwcrhk_crt_mod_add(uint64_t *r, const uint64_t *a,
+                               const uint64_t *b, int sub,
+                               const HWCRHK_CRT_MOD *mod, uint64_t *t)
+{
+    uint64_t s, c = 0, borrow = 0;
+    int j, n = mod->n;
+
+    if (sub) {
+        /* a + m - b, which is positive, carrying and borrowing as we go */
+        for (j = 0; j < n; j++) {
+            s = a[j] + mod->m[j] + c;
+            c = s >> HWCRHK_CRT_LIMB_BITS;
+            s = (s & HWCRHK_CRT_LIMB_MASK) - b[j] - borrow;
+            borrow = s >> 63;
+            t[j] = s & HWCRHK_CRT_LIMB_MASK;
+        }
+        t[n] = c - borrow;
+    } else {
+        for (j = 0; j < n; j++) {
+            s = a[j] + b[j] + c;
+            t[j] = s & HWCRHK_CRT_LIMB_MASK;
+            c = s >> HWCRHK_CRT_LIMB_BITS;
+        }
+        t[n] = c;
+    }
+    hwcrhk_mb_reduce(t, mod->m, t + n + 1, 1, 0, n + 1, HWCRHK_CRT_LIMB_BITS);
+    memcpy(r, t, n * sizeof(*r));
+}
 
-    if (rtmp == NULL || res == NULL) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY, ERR_R_MALLOC_FAILURE);
-        goto err;
+/* x += a * b, where x has |na| + |nb| limbs and the sum fits in them */
+static void hwcrhk_crt_mul_add(uint64_t *x, const uint64_t *a, int na,
+                               const uint64_t *b, int nb)
+{
+    uint64_t s, c;
+    int i, j;
+
+    for (i = 0; i < nb; i++) {
+        for (c = 0, j = 0; j < na; j++) {
+            s = x[i + j] + a[j] * b[i] + c;
+            x[i + j] = s & HWCRHK_CRT_LIMB_MASK;
+            c = s >> HWCRHK_CRT_LIMB_BITS;
+        }
+        for (j = i + na; j < na + nb; j++) {
+            s = x[j] + c;
+            x[j] = s & HWCRHK_CRT_LIMB_MASK;
+            c = s >> HWCRHK_CRT_LIMB_BITS;
+        }
     }
+}
 
-    RSA_set_ex_data(rtmp, hndidx_rsa, (char *)hptr);
-    RSA_set0_key(rtmp, bn_n, bn_e, NULL);
-    RSA_set_flags(rtmp, RSA_FLAG_EXT_PKEY);
+/* |a| in |n| limbs, through |buf| of 4n bytes; 0 if it doesn't fit */
+static int hwcrhk_crt_bn2limbs(uint64_t *x, int n, const BIGNUM *a,
+                               unsigned char *buf)
+{
+    if (BN_bn2lebinpad(a, buf, 4 * n) < 0) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP, HWCRHK_R_INVALID_ARGUMENT);
+        return 0;
+    }
+    hwcrhk_mb_to_limbs(x, 1, 0, n, HWCRHK_CRT_LIMB_BITS, buf, 4 * n);
+    return 1;
+}
 
-    EVP_PKEY_assign_RSA(res, rtmp);
-#endif
+static void hwcrhk_crt_mod_free(HWCRHK_CRT_MOD *mod)
+{
+    if (mod != NULL)
+        OPENSSL_clear_free(mod, sizeof(*mod)
+                           + (2 * mod->n + 1) * sizeof(*mod->m));
+}
 
-    if (res == NULL)
-        HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PRIVKEY,
-                  HWCRHK_R_PRIVATE_KEY_ALGORITHMS_DISABLED);
+static HWCRHK_CRT_MOD *hwcrhk_crt_mod_new(const BIGNUM *prime)
+{
+    HWCRHK_CRT_MOD *mod;
+    unsigned char *buf = NULL;
+    uint64_t *t = NULL, inv;
+    int i, n = (BN_num_bits(prime) + HWCRHK_CRT_LIMB_BITS - 1)
+        / HWCRHK_CRT_LIMB_BITS;
+
+    if (n == 0 || !BN_is_odd(prime)) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP, HWCRHK_R_INVALID_ARGUMENT);
+        return NULL;
+    }
+    if ((mod = OPENSSL_zalloc(sizeof(*mod)
+                              + (2 * n + 1) * sizeof(*mod->m))) == NULL
+        || (t = OPENSSL_malloc(HWCRHK_CRT_SCRATCH(n) * sizeof(*t))) == NULL
+        || (buf = OPENSSL_malloc(4 * n)) == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP, ERR_R_MALLOC_FAILURE);
+        OPENSSL_free(t);
+        OPENSSL_free(mod);
+        return NULL;
+    }
+    mod->n = n;
+    mod->m = (uint64_t *)(mod + 1);
+    mod->rr = mod->m + n + 1;
+    hwcrhk_crt_bn2limbs(mod->m, n, prime, buf);
+
+    /* m is its own inverse mod 8, and each step doubles the bits right */
+    for (inv = mod->m[0], i = 0; i < 4; i++)
+        inv = (inv * (2 - mod->m[0] * inv)) & HWCRHK_CRT_LIMB_MASK;
+    mod->k0 = (0 - inv) & HWCRHK_CRT_LIMB_MASK;
+
+    /* B^2n mod m, by doubling 1 */
+    mod->rr[0] = 1;
+    for (i = 0; i < 2 * HWCRHK_CRT_LIMB_BITS * n; i++)
+        hwcrhk_crt_mod_add(mod->rr, mod->rr, mod->rr, 0, mod, t);
+
+    OPENSSL_clear_free(t, HWCRHK_CRT_SCRATCH(n) * sizeof(*t));
+    OPENSSL_clear_free(buf, 4 * n);
+    return mod;
+}
 
-    return res;
+/*
+ * The contexts of a key's primes, made the first time the key is used
+ * and kept with it, as OpenSSL keeps its own Montgomery contexts.  Keys
+ * that come without an RSA, from the asynchronous API, make them as they
+ * go.
+ */
+typedef struct {
+    CRYPTO_RWLOCK *lock;
+    HWCRHK_CRT_MOD *mod[HWCRHK_CRT_MAX_PRIMES];
+} HWCRHK_CRT_MONT;
+
+static void hwcrhk_crt_mont_free(HWCRHK_CRT_MONT *cm)
+{
+    int i;
+
+    if (cm == NULL)
+        return;
+    for (i = 0; i < HWCRHK_CRT_MAX_PRIMES; i++)
+        hwcrhk_crt_mod_free(cm->mod[i]);
+    CRYPTO_THREAD_lock_free(cm->lock);
+    OPENSSL_free(cm);
+}
+
+/*
+ * Returns the context for |prime|, the |i|th of the key's, from |cm|, or
+ * if there is none, a new one in |*tmp| for the caller to free.
+ */
+static const HWCRHK_CRT_MOD *hwcrhk_crt_mont_get(HWCRHK_CRT_MONT *cm, int i,
+                                                 const BIGNUM *prime,
+                                                 HWCRHK_CRT_MOD **tmp)
+{
+    HWCRHK_CRT_MOD *mod;
+
+    if (cm == NULL)
+        return *tmp = hwcrhk_crt_mod_new(prime);
+    if (!CRYPTO_THREAD_read_lock(cm->lock))
+        return NULL;
+    mod = cm->mod[i];
+    CRYPTO_THREAD_unlock(cm->lock);
+    if (mod != NULL || (mod = hwcrhk_crt_mod_new(prime)) == NULL)
+        return mod;
+
+    if (!CRYPTO_THREAD_write_lock(cm->lock)) {
+        hwcrhk_crt_mod_free(mod);
+        return NULL;
+    }
+    if (cm->mod[i] == NULL) {
+        cm->mod[i] = mod;
+    } else {
+        hwcrhk_crt_mod_free(mod);
+        mod = cm->mod[i];
+    }
+    CRYPTO_THREAD_unlock(cm->lock);
+    return mod;
+}
+
+/* r = x * B^n mod m, for x of |w| limbs, taken |n| at a time */
+static void hwcrhk_crt_to_mont(uint64_t *r, const uint64_t *x, int w,
+                               const HWCRHK_CRT_MOD *mod, uint64_t *t)
+{
+    uint64_t *c = t + 2 * mod->n + 3;
+    int i, j, n = mod->n;
+
+    memset(r, 0, n * sizeof(*r));
+    for (j = (w + n - 1) / n - 1; j >= 0; j--) {
+        for (i = 0; i < n; i++)
+            c[i] = j * n + i < w ? x[j * n + i] : 0;
+        hwcrhk_crt_mont_mul(r, r, mod->rr, mod, t);
+        hwcrhk_crt_mont_mul(c, c, mod->rr, mod, t);
+        hwcrhk_crt_mod_add(r, r, c, 0, mod, t);
+    }
+}
+
+/*
+ * r = I mod m, at the width of I and of m, where BN_nnmod() would work
+ * at that of the remainders as it goes.  r has BN_FLG_CONSTTIME set.
+ */
+static int hwcrhk_crt_reduce(BIGNUM *r, const BIGNUM *I,
+                             const HWCRHK_CRT_MOD *mod)
+{
+    unsigned char *bytes = NULL;
+    uint64_t *limbs = NULL, *x, *xm, *one, *t;
+    size_t size = 0;
+    int w, n = mod->n, to_return = 0;
+
+    if (BN_is_negative(I)) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP, HWCRHK_R_INVALID_ARGUMENT);
+        return 0;
+    }
+    w = (BN_num_bits(I) + HWCRHK_CRT_LIMB_BITS - 1) / HWCRHK_CRT_LIMB_BITS;
+    w = w > n ? w : n;
+    size = (w + 2 * n + HWCRHK_CRT_SCRATCH(n)) * sizeof(*limbs);
+    if ((limbs = OPENSSL_zalloc(size)) == NULL
+        || (bytes = OPENSSL_malloc(4 * w)) == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    x = limbs;
+    xm = x + w;
+    one = xm + n;
+    t = one + n;
+    if (!hwcrhk_crt_bn2limbs(x, w, I, bytes))
+        goto err;
+
+    /* I B^n mod m, and then out of Montgomery form again */
+    one[0] = 1;
+    hwcrhk_crt_to_mont(xm, x, w, mod, t);
+    hwcrhk_crt_mont_mul(xm, xm, one, mod, t);
+    hwcrhk_mb_from_limbs(bytes, 4 * n, xm, 1, 0, n, HWCRHK_CRT_LIMB_BITS);
+    if (BN_lebin2bn(bytes, 4 * n, r) == NULL)
+        goto err;
+    BN_set_flags(r, BN_FLG_CONSTTIME);
+    to_return = 1;
 
  err:
-#ifndef OPENSSL_NO_RSA
-    BN_free(bn_e);
-    BN_free(bn_n);
-    hwcrhk_mpi_free(e);
-    hwcrhk_mpi_free(n);
-    EVP_PKEY_free(res);
-    RSA_free(rtmp);
-#endif
-    return NULL;
+    OPENSSL_clear_free(limbs, size);
+    OPENSSL_clear_free(bytes, 4 * w);
+    return to_return;
+}
+
+typedef struct {
+    HWCRHK_JOB job;
+    int refs;
+    int claimed;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t deadline_ns;
+    BIGNUM *a;                  /* the input, reduced mod |m| */
+    const BIGNUM *p, *m;
+    BIGNUM *r;
+    int status;
+    unsigned long error;
+} HWCRHK_SPLIT_CTX;
+
+static void hwcrhk_split_ctx_free(HWCRHK_SPLIT_CTX *sctx)
+{
+    if (__atomic_sub_fetch(&sctx->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    pthread_mutex_destroy(&sctx->lock);
+    pthread_cond_destroy(&sctx->cond);
+    BN_clear_free(sctx->a);
+    BN_clear_free(sctx->r);
+    OPENSSL_free(sctx);
+}
+
+/* Returns 1 if the caller is the one to make the request */
+static int hwcrhk_split_claim(HWCRHK_SPLIT_CTX *sctx)
+{
+    int claimed = 0;
+
+    return __atomic_compare_exchange_n(&sctx->claimed, &claimed, 1, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
 }
 
-static EVP_PKEY *hwcrhk_load_pubkey(ENGINE *eng, const char *key_id,
-                                    UI_METHOD *ui_method, void *callback_data)
+static void hwcrhk_split_run(HWCRHK_SPLIT_CTX *sctx)
 {
-    EVP_PKEY *res = NULL;
+    ERR_set_mark();
+    sctx->status = hwcrhk_bn_mod_exp(sctx->r, sctx->a, sctx->p, sctx->m,
+                                     NULL);
+    if (!sctx->status)
+        sctx->error = ERR_peek_last_error();
+    ERR_pop_to_mark();
+
+    pthread_mutex_lock(&sctx->lock);
+    sctx->done = 1;
+    pthread_cond_signal(&sctx->cond);
+    pthread_mutex_unlock(&sctx->lock);
+}
 
-#ifndef OPENSSL_NO_RSA
-    res = hwcrhk_load_privkey(eng, key_id, ui_method, callback_data);
-#endif
+static void hwcrhk_split_job(void *arg)
+{
+    HWCRHK_SPLIT_CTX *sctx = arg;
+    uint64_t deadline_ns = hwcrhk_deadline_get();
 
-    if (res)
-        switch (EVP_PKEY_id(res)) {
-#ifndef OPENSSL_NO_RSA
-        case EVP_PKEY_RSA:
-            {
-                RSA *rsa = NULL, *rtmp = NULL;
-                const BIGNUM *bn_n = NULL, *bn_e = NULL;
+    if (hwcrhk_split_claim(sctx)) {
+        hwcrhk_deadline_set(sctx->deadline_ns);
+        hwcrhk_split_run(sctx);
+        hwcrhk_deadline_set(deadline_ns);
+    }
+    hwcrhk_split_ctx_free(sctx);
+}
 
-                CRYPTO_THREAD_write_lock(chil_lock);
+/* Prepares I^exp mod prime and hands it to the pool */
+static HWCRHK_SPLIT_CTX *hwcrhk_split_submit(const BIGNUM *I,
+                                             const BIGNUM *prime,
+                                             const HWCRHK_CRT_MOD *mod,
+                                             const BIGNUM *exp)
+{
+    HWCRHK_SPLIT_CTX *sctx;
+
+    if ((sctx = OPENSSL_zalloc(sizeof(*sctx))) == NULL
+        || (sctx->a = BN_new()) == NULL
+        || (sctx->r = BN_new()) == NULL) {
+        if (sctx != NULL)
+            BN_free(sctx->a);
+        OPENSSL_free(sctx);
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP, ERR_R_MALLOC_FAILURE);
+        return NULL;
+    }
+    pthread_mutex_init(&sctx->lock, NULL);
+    pthread_cond_init(&sctx->cond, NULL);
+    sctx->refs = 1;
+    if (!hwcrhk_crt_reduce(sctx->a, I, mod)) {
+        hwcrhk_split_ctx_free(sctx);
+        return NULL;
+    }
+    sctx->deadline_ns = hwcrhk_deadline_get();
+    sctx->p = exp;
+    sctx->m = prime;
+    sctx->job.fn = hwcrhk_split_job;
+    sctx->job.arg = sctx;
+    sctx->refs++;
+    if (!hwcrhk_pool_submit(&sctx->job))
+        sctx->refs--;
+    return sctx;
+}
 
-                rtmp = EVP_PKEY_get0_RSA(res);
-                RSA_get0_key(rtmp, &bn_n, &bn_e, NULL);
+/*
+ * Waits for the worker that has the request, if one has.  Returns 1 if
+ * none had, and the caller has it now.
+ */
+static int hwcrhk_split_collect(HWCRHK_SPLIT_CTX *sctx)
+{
+    if (hwcrhk_split_claim(sctx))
+        return 1;
+    pthread_mutex_lock(&sctx->lock);
+    while (!sctx->done)
+        pthread_cond_wait(&sctx->cond, &sctx->lock);
+    pthread_mutex_unlock(&sctx->lock);
+    return 0;
+}
 
-                rsa = RSA_new();
-                RSA_set0_key(rsa, BN_dup(bn_n), BN_dup(bn_e), NULL);
-                EVP_PKEY_assign_RSA(res, rsa);
+/*
+ * One step of Garner's recombination, x += R * ((mi - x) * ti mod ri),
+ * with x below R, both in |wr| limbs, and mi and ti in those of ri.  x
+ * has room for the |wr| + n limbs of the result.  Working in Montgomery
+ * form, (mi - x) B^n times ti comes out as the h wanted.
+ */
+static void hwcrhk_crt_step(uint64_t *x, const uint64_t *R, int wr,
+                            const uint64_t *mi, const uint64_t *ti,
+                            const HWCRHK_CRT_MOD *mod, uint64_t *t)
+{
+    uint64_t *xm = t, *h = t + mod->n, *s = t + 2 * mod->n;
 
-                CRYPTO_THREAD_unlock(chil_lock);
-            }
-            break;
-#endif
-        default:
-            HWCRHKerr(HWCRHK_F_HWCRHK_LOAD_PUBKEY,
-                      HWCRHK_R_CTRL_COMMAND_NOT_IMPLEMENTED);
+    hwcrhk_crt_to_mont(xm, x, wr, mod, h);
+    hwcrhk_crt_mont_mul(h, mi, mod->rr, mod, s);
+    hwcrhk_crt_mod_add(h, h, xm, 1, mod, s);
+    hwcrhk_crt_mont_mul(h, h, ti, mod, s);
+    hwcrhk_crt_mul_add(x, R, wr, h, mod->n);
+}
+
+/*
+ * |primes| and |exps| start with p and q, and |coeffs|, which has one
+ * entry fewer, with iqmp.  Further entries are as RFC 8017 has them.
+ * |cm|, if not NULL, holds the key's Montgomery contexts.
+ */
+static int hwcrhk_mod_exp_crt_split(BIGNUM *r, const BIGNUM *I, int nprimes,
+                                    const BIGNUM **primes,
+                                    const BIGNUM **exps,
+                                    const BIGNUM **coeffs,
+                                    HWCRHK_CRT_MONT *cm)
+{
+    HWCRHK_SPLIT_CTX *sctx[HWCRHK_CRT_MAX_PRIMES];
+    const HWCRHK_CRT_MOD *mod[HWCRHK_CRT_MAX_PRIMES];
+    HWCRHK_CRT_MOD *tmp[HWCRHK_CRT_MAX_PRIMES] = { NULL };
+    const BIGNUM *mi;
+    BN_CTX *ctx = NULL;
+    BIGNUM *in, *m;
+    unsigned char *bytes = NULL;
+    uint64_t *limbs = NULL, *x, *R, *R2, *xi, *ti, *t;
+    size_t size = 0;
+    char buf[256];
+    int i, next, n = 0, w = 0, wr, width[HWCRHK_CRT_MAX_PRIMES], maxw = 0;
+    int last = nprimes - 1, ok = 0, to_return = 0;
+
+    /* The inputs are reduced at a fixed width too, so these come first */
+    for (i = 0; i < nprimes; i++)
+        if ((mod[i] = hwcrhk_crt_mont_get(cm, i, primes[i], &tmp[i])) == NULL)
             goto err;
+
+    if ((ctx = BN_CTX_new()) == NULL)
+        goto err;
+    BN_CTX_start(ctx);
+    in = BN_CTX_get(ctx);
+    if ((m = BN_CTX_get(ctx)) == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+
+    /* Every prime but the last goes to the pool... */
+    for (; n < last; n++) {
+        sctx[n] = hwcrhk_split_submit(I, primes[n], mod[n], exps[n]);
+        if (sctx[n] == NULL)
+            break;
+    }
+    /* ...and the last is made here */
+    ok = n == last
+        && hwcrhk_crt_reduce(in, I, mod[last])
+        && hwcrhk_bn_mod_exp(m, in, exps[last], primes[last], ctx);
+
+    /* Those no worker has picked up are made here too, or called off */
+    for (i = 0; i < n; i++) {
+        if (hwcrhk_split_collect(sctx[i])) {
+            if (!ok)
+                continue;
+            hwcrhk_split_run(sctx[i]);
+        }
+        if (ok && !sctx[i]->status) {
+            ok = 0;
+            HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP, HWCRHK_R_REQUEST_FAILED);
+            if (sctx[i]->error != 0) {
+                ERR_error_string_n(sctx[i]->error, buf, sizeof(buf));
+                ERR_add_error_data(2, "prime request: ", buf);
+            }
         }
+    }
+    if (!ok)
+        goto err;
 
-    return res;
+    /* The widths of the primes are all that the sizes below depend on */
+    for (i = 0; i < nprimes; i++) {
+        width[i] = (BN_num_bits(primes[i]) + HWCRHK_CRT_LIMB_BITS - 1)
+            / HWCRHK_CRT_LIMB_BITS;
+        w += width[i];
+        maxw = width[i] > maxw ? width[i] : maxw;
+    }
+    size = (3 * w + 2 * maxw + HWCRHK_CRT_SCRATCH(maxw)) * sizeof(*limbs);
+    if ((limbs = OPENSSL_zalloc(size)) == NULL
+        || (bytes = OPENSSL_malloc(4 * w)) == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+    x = limbs;
+    R = x + w;
+    R2 = R + w;
+    xi = R2 + w;
+    ti = xi + maxw;
+    t = ti + maxw;
+
+    /* x = m_q below R = q, recombined with m_p, then each further prime's */
+    wr = width[1];
+    if (!hwcrhk_crt_bn2limbs(x, wr, last > 1 ? sctx[1]->r : m, bytes)
+        || !hwcrhk_crt_bn2limbs(R, wr, primes[1], bytes))
+        goto err;
+    for (i = 0; i < nprimes; i = next) {
+        next = i == 0 ? 2 : i + 1;
+        mi = i < last ? sctx[i]->r : m;
+        if (!hwcrhk_crt_bn2limbs(xi, width[i], mi, bytes)
+            || !hwcrhk_crt_bn2limbs(ti, width[i], coeffs[i == 0 ? 0 : i - 1],
+                                    bytes))
+            goto err;
+        hwcrhk_crt_step(x, R, wr, xi, ti, mod[i], t);
+        if (next < nprimes) {
+            /* R *= ri for the primes still to come */
+            memset(R2, 0, w * sizeof(*R2));
+            hwcrhk_crt_mul_add(R2, R, wr, mod[i]->m, width[i]);
+            memcpy(R, R2, w * sizeof(*R));
+        }
+        wr += width[i];
+    }
+    hwcrhk_mb_from_limbs(bytes, 4 * w, x, 1, 0, w, HWCRHK_CRT_LIMB_BITS);
+    if (BN_lebin2bn(bytes, 4 * w, r) == NULL)
+        goto err;
+    to_return = 1;
 
  err:
-    EVP_PKEY_free(res);
-    return NULL;
+    OPENSSL_clear_free(limbs, size);
+    OPENSSL_clear_free(bytes, 4 * w);
+    for (i = 0; i < nprimes; i++)
+        hwcrhk_crt_mod_free(tmp[i]);
+    for (i = 0; i < n; i++)
+        hwcrhk_split_ctx_free(sctx[i]);
+    if (ctx != NULL)
+        BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
+    return to_return;
 }
 
-/* A little mod_exp */
-static int hwcrhk_bn_mod_exp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
-                          const BIGNUM *m, BN_CTX *ctx)
+/*
+ * A CRT mod_exp, for private keys held in software.  |cm| is as for
+ * hwcrhk_mod_exp_crt_split().
+ */
+static int hwcrhk_mod_exp_crt(BIGNUM *r, const BIGNUM *I,
+                              const BIGNUM *p, const BIGNUM *q,
+                              const BIGNUM *dmp1, const BIGNUM *dmq1,
+                              const BIGNUM *iqmp, HWCRHK_CRT_MONT *cm)
 {
     char tempbuf[1024];
     HWCryptoHook_ErrMsgBuf rmsg;
-    /*
-     * Since HWCryptoHook_MPI is pretty compatible with BIGNUM's, we use them
-     * directly, plus a little macro magic.  We only thing we need to make
-     * sure of is that enough space is allocated.
-     */
-    HWCryptoHook_MPI *m_a = NULL, *m_p = NULL, *m_m = NULL, *m_r = NULL;
     int to_return = 0, ret = 0, attempt;
 
+    HWCryptoHook_MPI *m_a = NULL, *m_p = NULL, *m_q = NULL;
+    HWCryptoHook_MPI *m_dmp1 = NULL, *m_dmq1 = NULL, *m_iqmp = NULL, *m_r = NULL;
+    HWCRHK_OP op;
+
     rmsg.buf = tempbuf;
     rmsg.size = sizeof(tempbuf);
 
-    if (!hwcrhk_context) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP, HWCRHK_R_NOT_INITIALISED);
+    if (!p || !q || !dmp1 || !dmq1 || !iqmp) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP,
+                  HWCRHK_R_MISSING_KEY_COMPONENTS);
+        goto err;
+    }
+    if (hwcrhk_split_crt_bits != 0
+        && BN_num_bits(p) + BN_num_bits(q) >= hwcrhk_split_crt_bits) {
+        const BIGNUM *primes[2], *exps[2];
+
+        primes[0] = p;
+        primes[1] = q;
+        exps[0] = dmp1;
+        exps[1] = dmq1;
+        return hwcrhk_mod_exp_crt_split(r, I, 2, primes, exps, &iqmp, cm);
+    }
+    switch (hwcrhk_ready(HWCRHK_F_HWCRHK_RSA_MOD_EXP, 1)) {
+    case HWCRHK_OP_FAIL:
+        goto err;
+    case HWCRHK_OP_SOFTWARE:
+        to_return = hwcrhk_sw_mod_exp_crt(r, I, p, q, dmp1, dmq1, iqmp);
         goto err;
     }
+
     /* Prepare the params */
-    m_a = hwcrhk_mpi_bn2mpi(a);
+    m_a = hwcrhk_mpi_bn2mpi(I);
     m_p = hwcrhk_mpi_bn2mpi(p);
-    m_m = hwcrhk_mpi_bn2mpi(m);
+    m_q = hwcrhk_mpi_bn2mpi(q);
+    m_dmp1 = hwcrhk_mpi_bn2mpi(dmp1);
+    m_dmq1 = hwcrhk_mpi_bn2mpi(dmq1);
+    m_iqmp = hwcrhk_mpi_bn2mpi(iqmp);
 
     /* guess that the result size will be the same size as a */
     m_r = hwcrhk_mpi_alloc(m_a->size);
 
-    if (!m_a || !m_p || !m_m || !m_r) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP,
-           ERR_R_MALLOC_FAILURE);
+    if (!m_a || !m_p || !m_q || !m_dmp1 || !m_dmq1 || !m_iqmp || !m_r) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP,
+                  ERR_R_MALLOC_FAILURE);
         goto err;
     }
 
+    switch (hwcrhk_op_begin(&op, HWCRHK_F_HWCRHK_RSA_MOD_EXP, 1)) {
+    case HWCRHK_OP_FAIL:
+        goto err;
+    case HWCRHK_OP_SOFTWARE:
+        to_return = hwcrhk_sw_mod_exp_crt(r, I, p, q, dmp1, dmq1, iqmp);
+        goto err;
+    }
     for (attempt = 0; attempt < 2; ++attempt) {
-        ret = p_hwcrhk_ModExp(hwcrhk_context, *m_a, *m_p, *m_m, m_r, &rmsg);
+        ret = p_hwcrhk_ModExpCRT(hwcrhk_context, *m_a, *m_p, *m_q,
+            *m_dmp1, *m_dmq1, *m_iqmp, m_r, &rmsg);
 
         if (ret != HWCRYPTOHOOK_ERROR_MPISIZE)
             break;
@@ -1085,10 +6659,14 @@ static int hwcrhk_bn_mod_exp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
         /* the guess was wrong, and m_r->size is the new size */
         m_r = hwcrhk_mpi_resize(m_r, m_r->size);
         if (m_r == NULL) {
+            hwcrhk_op_end(&op, ret);
             HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP, ERR_R_MALLOC_FAILURE);
             goto err;
         }
     }
+    hwcrhk_op_end(&op, ret);
+    hwcrhk_trace_add(HWCRHK_TRACE_MOD_EXP_CRT, op.start_ns,
+                     BN_num_bits(p) + BN_num_bits(q), 0, 0, ret);
 
     /* Convert the response */
     hwcrhk_mpi_mpi2bn(m_r, r);
@@ -1096,12 +6674,15 @@ static int hwcrhk_bn_mod_exp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
     if (ret < 0) {
         /*
          * FIXME: When this error is returned, HWCryptoHook is telling us
-         * that falling back to software computation might be a good thing.
+         * that falling back to software computation might be a good
+         * thing.
          */
         if (ret == HWCRYPTOHOOK_ERROR_FALLBACK) {
-            HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP, HWCRHK_R_REQUEST_FALLBACK);
+            HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP,
+                      HWCRHK_R_REQUEST_FALLBACK);
         } else {
-            HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP, HWCRHK_R_REQUEST_FAILED);
+            HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP,
+                      HWCRHK_R_REQUEST_FAILED);
         }
         ERR_add_error_data(1, rmsg.buf);
         goto err;
@@ -1112,15 +6693,19 @@ static int hwcrhk_bn_mod_exp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
  err:
     hwcrhk_mpi_free(m_a);
     hwcrhk_mpi_free(m_p);
-    hwcrhk_mpi_free(m_m);
+    hwcrhk_mpi_free(m_q);
+    hwcrhk_mpi_free(m_dmp1);
+    hwcrhk_mpi_free(m_dmq1);
+    hwcrhk_mpi_free(m_iqmp);
     hwcrhk_mpi_free(m_r);
 
     return to_return;
 }
 
+
 #ifndef OPENSSL_NO_RSA
 static int hwcrhk_rsa_mod_exp_remote(BIGNUM *r, const BIGNUM *I, RSA *rsa,
-                              BN_CTX *ctx, HWCryptoHook_RSAKeyHandle *hptr)
+                              BN_CTX *ctx, HWCRHK_KEY *key)
 {
     char tempbuf[1024];
     HWCryptoHook_ErrMsgBuf rmsg;
@@ -1128,6 +6713,7 @@ static int hwcrhk_rsa_mod_exp_remote(BIGNUM *r, const BIGNUM *I, RSA *rsa,
 
     HWCryptoHook_MPI *m_a = NULL, *m_r = NULL;
     const BIGNUM *n = NULL;
+    HWCRHK_OP op;
 
     rmsg.buf = tempbuf;
     rmsg.size = sizeof(tempbuf);
@@ -1153,8 +6739,10 @@ static int hwcrhk_rsa_mod_exp_remote(BIGNUM *r, const BIGNUM *I, RSA *rsa,
         goto err;
     }
 
+    if (!hwcrhk_op_begin(&op, HWCRHK_F_HWCRHK_RSA_MOD_EXP, 0))
+        goto err;
     for (attempt = 0; attempt < 2; ++attempt) {
-        ret = p_hwcrhk_RSA(*m_a, *hptr, m_r, &rmsg);
+        ret = p_hwcrhk_RSA(*m_a, hwcrhk_key_handle(key), m_r, &rmsg);
 
         if (ret != HWCRYPTOHOOK_ERROR_MPISIZE)
             break;
@@ -1162,10 +6750,16 @@ static int hwcrhk_rsa_mod_exp_remote(BIGNUM *r, const BIGNUM *I, RSA *rsa,
         /* the guess was wrong, and m_r->size is the new size */
         m_r = hwcrhk_mpi_resize(m_r, m_r->size);
         if (m_r == NULL) {
+            hwcrhk_key_account(key, &op, ret);
+            hwcrhk_op_end(&op, ret);
             HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP, ERR_R_MALLOC_FAILURE);
             goto err;
         }
     }
+    hwcrhk_key_account(key, &op, ret);
+    hwcrhk_op_end(&op, ret);
+    hwcrhk_trace_add(HWCRHK_TRACE_RSA, op.start_ns, BN_num_bits(n), 0,
+                     key->trace_hash, ret);
 
     /* Convert the response */
     hwcrhk_mpi_mpi2bn(m_r, r);
@@ -1196,145 +6790,472 @@ static int hwcrhk_rsa_mod_exp_remote(BIGNUM *r, const BIGNUM *I, RSA *rsa,
     return to_return;
 }
 
+static pthread_mutex_t hwcrhk_mont_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void hwcrhk_rsa_mont_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                                 int idx, long argl, void *argp)
+{
+    hwcrhk_crt_mont_free(ptr);
+}
+
+/*
+ * The HWCRHK_CRT_MONT kept with |rsa|, made the first time it is asked
+ * for.  NULL if that fails, which only costs the contexts being made
+ * for every request.
+ */
+static HWCRHK_CRT_MONT *hwcrhk_rsa_crt_mont(RSA *rsa)
+{
+    HWCRHK_CRT_MONT *cm;
+
+    if ((cm = RSA_get_ex_data(rsa, hndidx_rsa_mont)) != NULL) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return cm;
+    }
+    pthread_mutex_lock(&hwcrhk_mont_lock);
+    if ((cm = RSA_get_ex_data(rsa, hndidx_rsa_mont)) == NULL
+        && (cm = OPENSSL_zalloc(sizeof(*cm))) != NULL) {
+        if ((cm->lock = CRYPTO_THREAD_lock_new()) == NULL) {
+            OPENSSL_free(cm);
+            cm = NULL;
+        } else {
+            /* Readers of hndidx_rsa_mont don't lock */
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            if (!RSA_set_ex_data(rsa, hndidx_rsa_mont, cm)) {
+                hwcrhk_crt_mont_free(cm);
+                cm = NULL;
+            }
+        }
+    }
+    pthread_mutex_unlock(&hwcrhk_mont_lock);
+    return cm;
+}
+
 static int hwcrhk_rsa_mod_exp_local(BIGNUM *r, const BIGNUM *I, RSA *rsa,
                               BN_CTX *ctx)
 {
-    char tempbuf[1024];
-    HWCryptoHook_ErrMsgBuf rmsg;
-    int to_return = 0, ret = 0, attempt;
-
-    HWCryptoHook_MPI *m_a = NULL, *m_p = NULL, *m_q = NULL;
-    HWCryptoHook_MPI *m_dmp1 = NULL, *m_dmq1 = NULL, *m_iqmp = NULL, *m_r = NULL;
     const BIGNUM *p = NULL, *q = NULL;
     const BIGNUM *dmp1 = NULL, *dmq1 = NULL, *iqmp = NULL;
 
-    rmsg.buf = tempbuf;
-    rmsg.size = sizeof(tempbuf);
+#if HWCRHK_CRT_MAX_PRIMES > 2
+    const BIGNUM *primes[HWCRHK_CRT_MAX_PRIMES], *exps[HWCRHK_CRT_MAX_PRIMES];
+    const BIGNUM *coeffs[HWCRHK_CRT_MAX_PRIMES - 1];
+    int i, nprimes;
+
+    if ((nprimes = RSA_get_multi_prime_extra_count(rsa)) > 0) {
+        nprimes += 2;
+        /* Those two only give the primes after p and q */
+        RSA_get0_factors(rsa, &primes[0], &primes[1]);
+        RSA_get0_crt_params(rsa, &exps[0], &exps[1], &coeffs[0]);
+        if (nprimes > HWCRHK_CRT_MAX_PRIMES
+            || !RSA_get0_multi_prime_factors(rsa, primes + 2)
+            || !RSA_get0_multi_prime_crt_params(rsa, exps + 2, coeffs + 1)) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP,
+                      HWCRHK_R_MISSING_KEY_COMPONENTS);
+            return 0;
+        }
+        for (i = 0; i < nprimes; i++) {
+            if (primes[i] == NULL || exps[i] == NULL
+                || (i > 0 && coeffs[i - 1] == NULL)) {
+                HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP,
+                          HWCRHK_R_MISSING_KEY_COMPONENTS);
+                return 0;
+            }
+        }
+        return hwcrhk_mod_exp_crt_split(r, I, nprimes, primes, exps, coeffs,
+                                        hwcrhk_rsa_crt_mont(rsa));
+    }
+#endif
 
     RSA_get0_factors(rsa, &p, &q);
     RSA_get0_crt_params(rsa, &dmp1, &dmq1, &iqmp);
 
-    if (!p || !q || !dmp1 || !dmq1 || !iqmp) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP,
-                  HWCRHK_R_MISSING_KEY_COMPONENTS);
-        goto err;
+    return hwcrhk_mod_exp_crt(r, I, p, q, dmp1, dmq1, iqmp,
+                              hwcrhk_rsa_crt_mont(rsa));
+}
+
+/*
+ * Private key encryption, which is OpenSSL's, with the signature cache in
+ * front of it for keys held in the HSM.
+ */
+static int hwcrhk_rsa_priv_enc(int flen, const unsigned char *from,
+                               unsigned char *to, RSA *rsa, int padding)
+{
+    HWCRHK_KEY *key = NULL;
+    int ret;
+
+    if (__atomic_load_n(&hwcrhk_sign_cache.size, __ATOMIC_RELAXED) > 0
+        && flen <= HWCRHK_SIGN_CACHE_MAX_BYTES
+        && RSA_size(rsa) <= HWCRHK_SIGN_CACHE_MAX_BYTES) {
+        if ((key = (HWCRHK_KEY *)RSA_get_ex_data(rsa, hndidx_rsa)) == NULL)
+            key = hwcrhk_key_embedded(rsa);
+        if (key != NULL
+            && (ret = hwcrhk_sign_cache_get(key, padding, from, flen,
+                                            to)) > 0)
+            return ret;
     }
 
-    /* Prepare the params */
-    m_a = hwcrhk_mpi_bn2mpi(I);
-    m_p = hwcrhk_mpi_bn2mpi(p);
-    m_q = hwcrhk_mpi_bn2mpi(q);
-    m_dmp1 = hwcrhk_mpi_bn2mpi(dmp1);
-    m_dmq1 = hwcrhk_mpi_bn2mpi(dmq1);
-    m_iqmp = hwcrhk_mpi_bn2mpi(iqmp);
+    ret = RSA_meth_get_priv_enc(RSA_PKCS1_OpenSSL())(flen, from, to, rsa,
+                                                     padding);
+    if (key != NULL && ret > 0)
+        hwcrhk_sign_cache_put(key, padding, from, flen, to, ret);
+    return ret;
+}
 
-    /* guess that the result size will be the same size as a */
-    m_r = hwcrhk_mpi_alloc(m_a->size);
+static int hwcrhk_rsa_mod_exp(BIGNUM *r, const BIGNUM *I, RSA *rsa,
+                              BN_CTX *ctx)
+{
+    int to_return = 0;
+    HWCRHK_KEY *key;
 
-    if (!m_a || !m_p || !m_q || !m_dmp1 || !m_dmq1 || !m_iqmp || !m_r) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP,
-                  ERR_R_MALLOC_FAILURE);
-        goto err;
+    /*
+     * This provides support for nForce keys.  Since that's opaque data all
+     * we do is provide a handle to the proper key and let HWCryptoHook take
+     * care of the rest.  Keys held in software may be dealt with before
+     * the library is loaded, see hwcrhk_mod_exp_crt().
+     */
+    if ((key = (HWCRHK_KEY *)RSA_get_ex_data(rsa, hndidx_rsa)) == NULL)
+        key = hwcrhk_key_embedded(rsa);
+    if (key != NULL) {
+        if (hwcrhk_ready(HWCRHK_F_HWCRHK_RSA_MOD_EXP, 0)
+            && hwcrhk_key_acquire(key)) {
+            to_return = hwcrhk_rsa_mod_exp_remote(r, I, rsa, ctx, key);
+            hwcrhk_key_release(key);
+        }
+    } else {
+        to_return = hwcrhk_rsa_mod_exp_local(r, I, rsa, ctx);
     }
 
-    for (attempt = 0; attempt < 2; ++attempt) {
-        ret = p_hwcrhk_ModExpCRT(hwcrhk_context, *m_a, *m_p, *m_q,
-            *m_dmp1, *m_dmq1, *m_iqmp, m_r, &rmsg);
+    return to_return;
+}
 
-        if (ret != HWCRYPTOHOOK_ERROR_MPISIZE)
-            break;
+/* This function is aliased to mod_exp (with the mont stuff dropped). */
+static int hwcrhk_rsa_bn_mod_exp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
+                               const BIGNUM *m, BN_CTX *ctx,
+                               BN_MONT_CTX *m_ctx)
+{
+    return hwcrhk_bn_mod_exp(r, a, p, m, ctx);
+}
 
-        /* the guess was wrong, and m_r->size is the new size */
-        m_r = hwcrhk_mpi_resize(m_r, m_r->size);
-        if (m_r == NULL) {
-            HWCRHKerr(HWCRHK_F_HWCRHK_BN_MOD_EXP, ERR_R_MALLOC_FAILURE);
-            goto err;
-        }
+static int hwcrhk_rsa_finish(RSA *rsa)
+{
+    HWCRHK_KEY *key;
+
+    key = RSA_get_ex_data(rsa, hndidx_rsa);
+    if (key) {
+        hwcrhk_key_free(key);
+        RSA_set_ex_data(rsa, hndidx_rsa, NULL);
     }
+    return 1;
+}
 
-    /* Convert the response */
-    hwcrhk_mpi_mpi2bn(m_r, r);
+/*
+ * Batched RSA private key operations, see HWCRHK_RSA_BATCH in e_chil.h.
+ * All inputs are padded and marshalled up front into a single arena, two
+ * MPIs per item (input and output).  The calling thread and up to
+ * maxsimultaneous - 1 pool workers then take items off the batch until
+ * it is exhausted, so a single caller keeps the module busy without
+ * paying for an allocation or a lock round trip per operation.
+ */
+typedef struct {
+    HWCRHK_RSA_BATCH_ITEM *items;
+    HWCryptoHook_MPI *mpis;     /* input at 2 * i, output at 2 * i + 1 */
+    size_t count;
+    size_t next;
+    int helpers;
+    uint64_t deadline_ns;       /* the caller's */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} HWCRHK_BATCH_CTX;
+
+static size_t hwcrhk_rsa_batch_mpi_size(const RSA *rsa)
+{
+    return (((size_t)RSA_size(rsa) + BN_BYTES - 1) / BN_BYTES) * BN_BYTES;
+}
+
+static void hwcrhk_rsa_batch_item(HWCRHK_RSA_BATCH_ITEM *item,
+                                  HWCryptoHook_MPI *in, HWCryptoHook_MPI *out)
+{
+    char tempbuf[1024];
+    HWCryptoHook_ErrMsgBuf rmsg;
+    HWCRHK_KEY *key;
+    BIGNUM *r = NULL;
+    int ret;
+    HWCRHK_OP op;
+
+    rmsg.buf = tempbuf;
+    rmsg.size = sizeof(tempbuf);
+
+    ERR_set_mark();
 
+    key = (HWCRHK_KEY *)RSA_get_ex_data(item->rsa, hndidx_rsa);
+    if (!hwcrhk_key_acquire(key))
+        goto err;
+    if (!hwcrhk_op_begin(&op, HWCRHK_F_HWCRHK_RSA_BATCH, 0)) {
+        hwcrhk_key_release(key);
+        goto err;
+    }
+    ret = p_hwcrhk_RSA(*in, hwcrhk_key_handle(key), out, &rmsg);
+    hwcrhk_key_account(key, &op, ret);
+    hwcrhk_op_end(&op, ret);
+    hwcrhk_trace_add(HWCRHK_TRACE_RSA, op.start_ns, RSA_bits(item->rsa), 0,
+                     key->trace_hash, ret);
+    hwcrhk_key_release(key);
     if (ret < 0) {
-        /*
-         * FIXME: When this error is returned, HWCryptoHook is telling us
-         * that falling back to software computation might be a good
-         * thing.
-         */
         if (ret == HWCRYPTOHOOK_ERROR_FALLBACK) {
-            HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP,
-                      HWCRHK_R_REQUEST_FALLBACK);
+            HWCRHKerr(HWCRHK_F_HWCRHK_RSA_BATCH, HWCRHK_R_REQUEST_FALLBACK);
         } else {
-            HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP,
-                      HWCRHK_R_REQUEST_FAILED);
+            HWCRHKerr(HWCRHK_F_HWCRHK_RSA_BATCH, HWCRHK_R_REQUEST_FAILED);
         }
         ERR_add_error_data(1, rmsg.buf);
         goto err;
     }
 
-    to_return = 1;
+    if ((r = hwcrhk_mpi_mpi2bn(out, NULL)) == NULL
+        || BN_bn2binpad(r, item->out, RSA_size(item->rsa)) < 0) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_BATCH, ERR_R_BN_LIB);
+        goto err;
+    }
+    item->outlen = RSA_size(item->rsa);
+    item->status = 1;
+
+ err:
+    BN_free(r);
+    if (!item->status)
+        item->error = ERR_peek_last_error();
+    ERR_pop_to_mark();
+}
+
+static void hwcrhk_rsa_batch_drain(HWCRHK_BATCH_CTX *ctx)
+{
+    size_t i;
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        i = ctx->next;
+        if (i < ctx->count)
+            ctx->next++;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (i >= ctx->count)
+            break;
+        /* Items that failed to marshal have no input */
+        if (ctx->mpis[2 * i].buf != NULL)
+            hwcrhk_rsa_batch_item(&ctx->items[i], &ctx->mpis[2 * i],
+                                  &ctx->mpis[2 * i + 1]);
+    }
+}
+
+static void hwcrhk_rsa_batch_helper(void *arg)
+{
+    HWCRHK_BATCH_CTX *ctx = arg;
 
- err:
-    hwcrhk_mpi_free(m_a);
-    hwcrhk_mpi_free(m_p);
-    hwcrhk_mpi_free(m_q);
-    hwcrhk_mpi_free(m_dmp1);
-    hwcrhk_mpi_free(m_dmq1);
-    hwcrhk_mpi_free(m_iqmp);
-    hwcrhk_mpi_free(m_r);
+    hwcrhk_deadline_set(ctx->deadline_ns);
+    hwcrhk_rsa_batch_drain(ctx);
+    hwcrhk_deadline_set(0);
 
-    return to_return;
+    pthread_mutex_lock(&ctx->lock);
+    if (--ctx->helpers == 0)
+        pthread_cond_signal(&ctx->done);
+    pthread_mutex_unlock(&ctx->lock);
 }
 
-
-static int hwcrhk_rsa_mod_exp(BIGNUM *r, const BIGNUM *I, RSA *rsa,
-                              BN_CTX *ctx)
+static int hwcrhk_rsa_batch(HWCRHK_RSA_BATCH *batch)
 {
-    int to_return = 0;
-    HWCryptoHook_RSAKeyHandle *hptr;
+    HWCRHK_BATCH_CTX ctx;
+    HWCRHK_JOB *jobs;
+    unsigned char *mem = NULL, *arena;
+    BIGNUM *bn = NULL;
+    size_t i, arena_size = 0, failed = 0;
+    int j, nhelpers;
+
+    if (!hwcrhk_ready(HWCRHK_F_HWCRHK_RSA_BATCH, 0))
+        return 0;
+    if (batch->count == 0)
+        return 1;
+    if (batch->items == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_BATCH, ERR_R_PASSED_NULL_PARAMETER);
+        return 0;
+    }
 
-    if (!hwcrhk_context) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_MOD_EXP, HWCRHK_R_NOT_INITIALISED);
-        goto err;
+    for (i = 0; i < batch->count; i++) {
+        HWCRHK_RSA_BATCH_ITEM *item = &batch->items[i];
+
+        item->status = 0;
+        item->error = 0;
+        item->outlen = 0;
+        if (item->rsa != NULL
+            && (RSA_get_ex_data(item->rsa, hndidx_rsa) != NULL
+                || hwcrhk_key_embedded(item->rsa) != NULL))
+            arena_size += 2 * hwcrhk_rsa_batch_mpi_size(item->rsa);
     }
 
     /*
-     * This provides support for nForce keys.  Since that's opaque data all
-     * we do is provide a handle to the proper key and let HWCryptoHook take
-     * care of the rest.
+     * One allocation holds the MPI descriptors, the pool jobs and the
+     * MPI buffers themselves.
      */
-    if ((hptr = (HWCryptoHook_RSAKeyHandle *) RSA_get_ex_data(rsa, hndidx_rsa))
-        != NULL) {
-        to_return = hwcrhk_rsa_mod_exp_remote(r, I, rsa, ctx, hptr);
-    } else {
-        to_return = hwcrhk_rsa_mod_exp_local(r, I, rsa, ctx);
+    nhelpers = hwcrhk_simultaneous() - 1;
+    if ((size_t)nhelpers > batch->count - 1)
+        nhelpers = (int)(batch->count - 1);
+    mem = OPENSSL_malloc(2 * batch->count * sizeof(HWCryptoHook_MPI)
+                         + nhelpers * sizeof(HWCRHK_JOB) + arena_size);
+    bn = BN_new();
+    if (mem == NULL || bn == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_BATCH, ERR_R_MALLOC_FAILURE);
+        OPENSSL_free(mem);
+        BN_free(bn);
+        return 0;
+    }
+    ctx.items = batch->items;
+    ctx.count = batch->count;
+    ctx.next = 0;
+    ctx.helpers = 0;
+    ctx.deadline_ns = hwcrhk_deadline_get();
+    ctx.mpis = (HWCryptoHook_MPI *)mem;
+    jobs = (HWCRHK_JOB *)(ctx.mpis + 2 * batch->count);
+    arena = (unsigned char *)(jobs + nhelpers);
+
+    for (i = 0; i < batch->count; i++) {
+        HWCRHK_RSA_BATCH_ITEM *item = &batch->items[i];
+        HWCryptoHook_MPI *in = &ctx.mpis[2 * i], *out = in + 1;
+        const BIGNUM *n = NULL;
+        int num, ok = 0;
+
+        in->buf = out->buf = NULL;
+        ERR_set_mark();
+
+        if (item->rsa == NULL || !RSA_get_ex_data(item->rsa, hndidx_rsa)) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_RSA_BATCH, HWCRHK_R_NO_KEY);
+            goto next;
+        }
+        in->buf = arena;
+        out->buf = arena + hwcrhk_rsa_batch_mpi_size(item->rsa);
+        in->size = out->size = hwcrhk_rsa_batch_mpi_size(item->rsa);
+        arena += 2 * in->size;
+
+        /* The output buffer doubles as scratch space for the padding */
+        num = RSA_size(item->rsa);
+        switch (item->padding) {
+        case RSA_PKCS1_PADDING:
+            ok = RSA_padding_add_PKCS1_type_1(out->buf, num,
+                                              item->in, (int)item->inlen);
+            break;
+        case RSA_NO_PADDING:
+            ok = RSA_padding_add_none(out->buf, num,
+                                      item->in, (int)item->inlen);
+            break;
+        default:
+            HWCRHKerr(HWCRHK_F_HWCRHK_RSA_BATCH, HWCRHK_R_INVALID_ARGUMENT);
+            break;
+        }
+        if (!ok)
+            goto next;
+
+        RSA_get0_key(item->rsa, &n, NULL, NULL);
+        if (BN_bin2bn(out->buf, num, bn) == NULL
+            || n == NULL || BN_ucmp(bn, n) >= 0
+            || !hwcrhk_mpi_set_bn(in, bn)) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_RSA_BATCH, HWCRHK_R_INVALID_ARGUMENT);
+            ok = 0;
+        }
+
+     next:
+        if (!ok) {
+            in->buf = NULL;
+            item->error = ERR_peek_last_error();
+        }
+        ERR_pop_to_mark();
+    }
+    BN_free(bn);
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.done, NULL);
+
+    for (j = 0; j < nhelpers; j++) {
+        jobs[j].fn = hwcrhk_rsa_batch_helper;
+        jobs[j].arg = &ctx;
+        pthread_mutex_lock(&ctx.lock);
+        ctx.helpers++;
+        pthread_mutex_unlock(&ctx.lock);
+        if (!hwcrhk_pool_submit(&jobs[j])) {
+            pthread_mutex_lock(&ctx.lock);
+            ctx.helpers--;
+            pthread_mutex_unlock(&ctx.lock);
+            break;
+        }
     }
 
- err:
-    return to_return;
+    hwcrhk_rsa_batch_drain(&ctx);
+
+    pthread_mutex_lock(&ctx.lock);
+    while (ctx.helpers > 0)
+        pthread_cond_wait(&ctx.done, &ctx.lock);
+    pthread_mutex_unlock(&ctx.lock);
+
+    pthread_cond_destroy(&ctx.done);
+    pthread_mutex_destroy(&ctx.lock);
+    OPENSSL_free(mem);
+
+    for (i = 0; i < batch->count; i++)
+        if (!batch->items[i].status)
+            failed++;
+    if (failed) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_RSA_BATCH, HWCRHK_R_REQUEST_FAILED);
+        return 0;
+    }
+    return 1;
 }
 
-/* This function is aliased to mod_exp (with the mont stuff dropped). */
-static int hwcrhk_rsa_bn_mod_exp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
-                               const BIGNUM *m, BN_CTX *ctx,
-                               BN_MONT_CTX *m_ctx)
+#endif
+
+#ifndef OPENSSL_NO_DSA
+/*
+ * This function is aliased to mod_exp (with the dsa and mont dropped).
+ * It is only called when signing, with a secret exponent, so when it is
+ * made in software that is with the constant time exponentiation, as
+ * OpenSSL's own DSA does.
+ */
+static int hwcrhk_dsa_bn_mod_exp(DSA *dsa, BIGNUM *r, const BIGNUM *a,
+                                 const BIGNUM *p, const BIGNUM *m,
+                                 BN_CTX *ctx, BN_MONT_CTX *m_ctx)
 {
+    if (__atomic_load_n(&hwcrhk_dsa_offload, __ATOMIC_RELAXED)
+        == HWCRHK_DSA_OFFLOAD_NONE)
+        return BN_mod_exp_mont_consttime(r, a, p, m, ctx, m_ctx);
     return hwcrhk_bn_mod_exp(r, a, p, m, ctx);
 }
 
-static int hwcrhk_rsa_finish(RSA *rsa)
+/*
+ * The library has no dual exponentiation, so the two halves are made as
+ * separate requests and multiplied together here.  Both go through
+ * hwcrhk_bn_mod_exp(), and so are subject to the same limits, deadlines
+ * and software fallback as any other mod_exp.  That is two round trips
+ * for what OpenSSL does in about the time of one exponentiation, hence
+ * DSA_OFFLOAD 2 being needed for it.
+ */
+static int hwcrhk_dsa_mod_exp(DSA *dsa, BIGNUM *rr, const BIGNUM *a1,
+                              const BIGNUM *p1, const BIGNUM *a2,
+                              const BIGNUM *p2, const BIGNUM *m,
+                              BN_CTX *ctx, BN_MONT_CTX *in_mont)
 {
-    HWCryptoHook_RSAKeyHandle *hptr;
+    BIGNUM *t;
+    int to_return = 0;
 
-    hptr = RSA_get_ex_data(rsa, hndidx_rsa);
-    if (hptr) {
-        p_hwcrhk_RSAUnloadKey(*hptr, NULL);
-        OPENSSL_free(hptr);
-        RSA_set_ex_data(rsa, hndidx_rsa, NULL);
-    }
-    return 1;
-}
+    if (__atomic_load_n(&hwcrhk_dsa_offload, __ATOMIC_RELAXED)
+        != HWCRHK_DSA_OFFLOAD_ALL)
+        return BN_mod_exp2_mont(rr, a1, p1, a2, p2, m, ctx, in_mont);
 
+    BN_CTX_start(ctx);
+    if ((t = BN_CTX_get(ctx)) == NULL)
+        goto err;
+    if (!hwcrhk_bn_mod_exp(rr, a1, p1, m, ctx)
+        || !hwcrhk_bn_mod_exp(t, a2, p2, m, ctx)
+        || !BN_mod_mul(rr, rr, t, m, ctx))
+        goto err;
+    to_return = 1;
+ err:
+    BN_CTX_end(ctx);
+    return to_return;
+}
 #endif
 
 #ifndef OPENSSL_NO_DH
@@ -1345,6 +7266,17 @@ static int hwcrhk_dh_bn_mod_exp(const DH *dh, BIGNUM *r,
 {
     return hwcrhk_bn_mod_exp(r, a, p, m, ctx);
 }
+
+static int hwcrhk_dh_generate_key(DH *dh)
+{
+    const BIGNUM *priv_key;
+
+    /* A DH with a private key already only wants the public key made */
+    DH_get0_key(dh, NULL, &priv_key);
+    if (priv_key == NULL && hwcrhk_dh_pool_take(dh))
+        return 1;
+    return DH_meth_get_generate_key(DH_OpenSSL())(dh);
+}
 #endif
 
 /* Random bytes are good */
@@ -1353,16 +7285,20 @@ static int hwcrhk_rand_bytes(unsigned char *buf, int num)
     char tempbuf[1024];
     HWCryptoHook_ErrMsgBuf rmsg;
     int to_return = 0, ret;
+    HWCRHK_OP op;
 
     rmsg.buf = tempbuf;
     rmsg.size = sizeof(tempbuf);
 
-    if (!hwcrhk_context) {
-        HWCRHKerr(HWCRHK_F_HWCRHK_RAND_BYTES, HWCRHK_R_NOT_INITIALISED);
+    if (!hwcrhk_ready(HWCRHK_F_HWCRHK_RAND_BYTES, 0))
         goto err;
-    }
 
+    if (!hwcrhk_op_begin(&op, HWCRHK_F_HWCRHK_RAND_BYTES, 0))
+        goto err;
     ret = p_hwcrhk_RandomBytes(hwcrhk_context, buf, num, &rmsg);
+    hwcrhk_op_end(&op, ret);
+    hwcrhk_trace_add(HWCRHK_TRACE_RAND_BYTES, op.start_ns,
+                     num > UINT16_MAX / 8 ? UINT16_MAX : num * 8, 0, 0, ret);
 
     if (ret < 0) {
         /*
@@ -1384,9 +7320,396 @@ static int hwcrhk_rand_bytes(unsigned char *buf, int num)
     return to_return;
 }
 
+/* Not before the library is loaded, nor while the circuit breaker is open */
 static int hwcrhk_rand_status(void)
 {
-    return 1;
+    switch (__atomic_load_n(&hwcrhk_lazy.state, __ATOMIC_ACQUIRE)) {
+    case HWCRHK_LAZY_LOADING:
+        return 0;
+    case HWCRHK_LAZY_DONE:
+        if (!hwcrhk_lazy.ok)
+            return 0;
+        break;
+    }
+    return !hwcrhk_breaker_open();
+}
+
+/*
+ * Non-blocking submission, see HWCRHK_ASYNC_API in e_chil.h.  Every request
+ * is a pool job.  Once it has run, it is moved to its queue's completion
+ * list and the queue's file descriptor is signalled, so that a single
+ * event loop thread can keep any number of requests in flight.
+ */
+#define HWCRHK_ASYNC_RSA                1
+#define HWCRHK_ASYNC_MOD_EXP            2
+#define HWCRHK_ASYNC_MOD_EXP_CRT        3
+#define HWCRHK_ASYNC_RAND_BYTES         4
+
+typedef struct hwcrhk_async_req_st HWCRHK_ASYNC_REQ;
+struct hwcrhk_async_req_st {
+    HWCRHK_JOB job;
+    HWCRHK_ASYNC_QUEUE *queue;
+    HWCRHK_ASYNC_REQ *next;
+    int type;
+    uint64_t token;
+    uint64_t deadline_ns;       /* the submitter's */
+    void *arg;
+    int status;
+    unsigned long error;
+    BIGNUM *r;
+    BIGNUM *bn[6];
+#ifndef OPENSSL_NO_RSA
+    RSA *rsa;
+#endif
+    unsigned char *buf;
+    size_t len;
+};
+
+struct hwcrhk_async_queue_st {
+    int fds[2];                 /* fds[0] is the one handed out */
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    HWCRHK_ASYNC_REQ *head, *tail;      /* completed requests */
+    size_t inflight;
+    uint64_t last_token;
+};
+
+static void hwcrhk_async_req_free(HWCRHK_ASYNC_REQ *req)
+{
+    int i;
+
+    for (i = 0; i < 6; i++)
+        BN_clear_free(req->bn[i]);
+#ifndef OPENSSL_NO_RSA
+    RSA_free(req->rsa);
+#endif
+    OPENSSL_free(req);
+}
+
+static void hwcrhk_async_signal(HWCRHK_ASYNC_QUEUE *queue)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    uint64_t one = 1;
+
+    while (write(queue->fds[1], &one, sizeof(one)) < 0 && errno == EINTR)
+        continue;
+#else
+    char one = 1;
+
+    /* A full pipe is fine, the read end is readable already */
+    while (write(queue->fds[1], &one, 1) < 0 && errno == EINTR)
+        continue;
+#endif
+}
+
+static void hwcrhk_async_run(void *arg)
+{
+    HWCRHK_ASYNC_REQ *req = arg;
+    HWCRHK_ASYNC_QUEUE *queue = req->queue;
+    uint64_t deadline_ns = hwcrhk_deadline_get();
+
+    /* Always a pool worker: the submitter's deadline is carried over */
+    hwcrhk_deadline_set(req->deadline_ns);
+    ERR_set_mark();
+    switch (req->type) {
+#ifndef OPENSSL_NO_RSA
+    case HWCRHK_ASYNC_RSA:
+        req->status = hwcrhk_rsa_mod_exp(req->r, req->bn[0], req->rsa, NULL);
+        break;
+#endif
+    case HWCRHK_ASYNC_MOD_EXP:
+        req->status = hwcrhk_bn_mod_exp(req->r, req->bn[0], req->bn[1],
+                                        req->bn[2], NULL);
+        break;
+    case HWCRHK_ASYNC_MOD_EXP_CRT:
+        req->status = hwcrhk_mod_exp_crt(req->r, req->bn[0], req->bn[1],
+                                         req->bn[2], req->bn[3], req->bn[4],
+                                         req->bn[5], NULL);
+        break;
+    case HWCRHK_ASYNC_RAND_BYTES:
+        req->status = hwcrhk_rand_bytes(req->buf, (int)req->len);
+        break;
+    }
+    if (!req->status)
+        req->error = ERR_peek_last_error();
+    ERR_pop_to_mark();
+    hwcrhk_deadline_set(deadline_ns);
+
+    /*
+     * The queue may be freed as soon as inflight drops to zero, so it is
+     * signalled before the lock is released.
+     */
+    pthread_mutex_lock(&queue->lock);
+    req->next = NULL;
+    if (queue->tail != NULL)
+        queue->tail->next = req;
+    else
+        queue->head = req;
+    queue->tail = req;
+    if (--queue->inflight == 0)
+        pthread_cond_broadcast(&queue->idle);
+    hwcrhk_async_signal(queue);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static HWCRHK_ASYNC_QUEUE *hwcrhk_async_queue_new(void)
+{
+    HWCRHK_ASYNC_QUEUE *queue;
+
+    if ((queue = OPENSSL_zalloc(sizeof(*queue))) == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_ASYNC_QUEUE_NEW, ERR_R_MALLOC_FAILURE);
+        return NULL;
+    }
+#ifdef HAVE_SYS_EVENTFD_H
+    queue->fds[0] = queue->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->fds[0] < 0) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_ASYNC_QUEUE_NEW, ERR_R_SYS_LIB);
+        OPENSSL_free(queue);
+        return NULL;
+    }
+#else
+    if (pipe(queue->fds) != 0) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_ASYNC_QUEUE_NEW, ERR_R_SYS_LIB);
+        OPENSSL_free(queue);
+        return NULL;
+    }
+    if (fcntl(queue->fds[0], F_SETFL, O_NONBLOCK) != 0
+        || fcntl(queue->fds[1], F_SETFL, O_NONBLOCK) != 0
+        || fcntl(queue->fds[0], F_SETFD, FD_CLOEXEC) != 0
+        || fcntl(queue->fds[1], F_SETFD, FD_CLOEXEC) != 0) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_ASYNC_QUEUE_NEW, ERR_R_SYS_LIB);
+        close(queue->fds[0]);
+        close(queue->fds[1]);
+        OPENSSL_free(queue);
+        return NULL;
+    }
+#endif
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->idle, NULL);
+    return queue;
+}
+
+static void hwcrhk_async_queue_free(HWCRHK_ASYNC_QUEUE *queue)
+{
+    HWCRHK_ASYNC_REQ *req;
+
+    if (queue == NULL)
+        return;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->inflight > 0)
+        pthread_cond_wait(&queue->idle, &queue->lock);
+    pthread_mutex_unlock(&queue->lock);
+
+    while ((req = queue->head) != NULL) {
+        queue->head = req->next;
+        hwcrhk_async_req_free(req);
+    }
+    close(queue->fds[0]);
+    if (queue->fds[1] != queue->fds[0])
+        close(queue->fds[1]);
+    pthread_cond_destroy(&queue->idle);
+    pthread_mutex_destroy(&queue->lock);
+    OPENSSL_free(queue);
+}
+
+static int hwcrhk_async_queue_fd(HWCRHK_ASYNC_QUEUE *queue)
+{
+    return queue->fds[0];
+}
+
+static HWCRHK_ASYNC_REQ *hwcrhk_async_req_new(int type, BIGNUM *r, void *arg)
+{
+    HWCRHK_ASYNC_REQ *req;
+
+    if ((req = OPENSSL_zalloc(sizeof(*req))) == NULL) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_ASYNC_SUBMIT, ERR_R_MALLOC_FAILURE);
+        return NULL;
+    }
+    req->type = type;
+    req->r = r;
+    req->arg = arg;
+    req->deadline_ns = hwcrhk_deadline_get();
+    return req;
+}
+
+/* Copy the operands of |req|, which takes ownership of the copies */
+static int hwcrhk_async_req_set_bn(HWCRHK_ASYNC_REQ *req, int n, ...)
+{
+    va_list args;
+    int i, ok = 1;
+
+    va_start(args, n);
+    for (i = 0; i < n; i++) {
+        const BIGNUM *bn = va_arg(args, const BIGNUM *);
+
+        if (bn == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_ASYNC_SUBMIT,
+                      ERR_R_PASSED_NULL_PARAMETER);
+            ok = 0;
+            break;
+        }
+        if ((req->bn[i] = BN_dup(bn)) == NULL) {
+            HWCRHKerr(HWCRHK_F_HWCRHK_ASYNC_SUBMIT, ERR_R_MALLOC_FAILURE);
+            ok = 0;
+            break;
+        }
+    }
+    va_end(args);
+    return ok;
+}
+
+static uint64_t hwcrhk_async_submit(HWCRHK_ASYNC_QUEUE *queue,
+                                    HWCRHK_ASYNC_REQ *req)
+{
+    uint64_t token;
+
+    /* The request itself waits for a lazy initialisation, if need be */
+    if (__atomic_load_n(&hwcrhk_lazy.state, __ATOMIC_ACQUIRE)
+        != HWCRHK_LAZY_LOADING && !hwcrhk_context) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_ASYNC_SUBMIT, HWCRHK_R_NOT_INITIALISED);
+        hwcrhk_async_req_free(req);
+        return 0;
+    }
+
+    req->queue = queue;
+    req->job.fn = hwcrhk_async_run;
+    req->job.arg = req;
+
+    pthread_mutex_lock(&queue->lock);
+    token = req->token = ++queue->last_token;
+    queue->inflight++;
+    pthread_mutex_unlock(&queue->lock);
+
+    /*
+     * Once submitted, |req| belongs to the worker and then to poll().  When
+     * no worker can be started, the request fails rather than being made
+     * here, which would block the caller's event loop.
+     */
+    if (!hwcrhk_pool_submit(&req->job)) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_ASYNC_SUBMIT, HWCRHK_R_REQUEST_FAILED);
+        pthread_mutex_lock(&queue->lock);
+        if (--queue->inflight == 0)
+            pthread_cond_broadcast(&queue->idle);
+        pthread_mutex_unlock(&queue->lock);
+        hwcrhk_async_req_free(req);
+        return 0;
+    }
+    return token;
+}
+
+#ifndef OPENSSL_NO_RSA
+static uint64_t hwcrhk_async_submit_rsa(HWCRHK_ASYNC_QUEUE *queue, BIGNUM *r,
+                                        const BIGNUM *in, RSA *rsa, void *arg)
+{
+    HWCRHK_ASYNC_REQ *req;
+
+    if ((req = hwcrhk_async_req_new(HWCRHK_ASYNC_RSA, r, arg)) == NULL)
+        return 0;
+    if (rsa == NULL || !RSA_up_ref(rsa)) {
+        HWCRHKerr(HWCRHK_F_HWCRHK_ASYNC_SUBMIT, ERR_R_PASSED_NULL_PARAMETER);
+        hwcrhk_async_req_free(req);
+        return 0;
+    }
+    req->rsa = rsa;
+    if (!hwcrhk_async_req_set_bn(req, 1, in)) {
+        hwcrhk_async_req_free(req);
+        return 0;
+    }
+    return hwcrhk_async_submit(queue, req);
+}
+#endif
+
+static uint64_t hwcrhk_async_submit_mod_exp(HWCRHK_ASYNC_QUEUE *queue,
+                                            BIGNUM *r, const BIGNUM *a,
+                                            const BIGNUM *p, const BIGNUM *m,
+                                            void *arg)
+{
+    HWCRHK_ASYNC_REQ *req;
+
+    if ((req = hwcrhk_async_req_new(HWCRHK_ASYNC_MOD_EXP, r, arg)) == NULL)
+        return 0;
+    if (!hwcrhk_async_req_set_bn(req, 3, a, p, m)) {
+        hwcrhk_async_req_free(req);
+        return 0;
+    }
+    return hwcrhk_async_submit(queue, req);
+}
+
+static uint64_t hwcrhk_async_submit_mod_exp_crt(HWCRHK_ASYNC_QUEUE *queue,
+                                                BIGNUM *r, const BIGNUM *a,
+                                                const BIGNUM *p,
+                                                const BIGNUM *q,
+                                                const BIGNUM *dmp1,
+                                                const BIGNUM *dmq1,
+                                                const BIGNUM *iqmp, void *arg)
+{
+    HWCRHK_ASYNC_REQ *req;
+
+    if ((req = hwcrhk_async_req_new(HWCRHK_ASYNC_MOD_EXP_CRT, r, arg)) == NULL)
+        return 0;
+    if (!hwcrhk_async_req_set_bn(req, 6, a, p, q, dmp1, dmq1, iqmp)) {
+        hwcrhk_async_req_free(req);
+        return 0;
+    }
+    return hwcrhk_async_submit(queue, req);
+}
+
+static uint64_t hwcrhk_async_submit_rand_bytes(HWCRHK_ASYNC_QUEUE *queue,
+                                               unsigned char *buf, size_t len,
+                                               void *arg)
+{
+    HWCRHK_ASYNC_REQ *req;
+
+    if ((req = hwcrhk_async_req_new(HWCRHK_ASYNC_RAND_BYTES, NULL, arg))
+        == NULL)
+        return 0;
+    req->buf = buf;
+    req->len = len;
+    return hwcrhk_async_submit(queue, req);
+}
+
+static int hwcrhk_async_poll(HWCRHK_ASYNC_QUEUE *queue,
+                             HWCRHK_ASYNC_RESULT *results, int max)
+{
+    HWCRHK_ASYNC_REQ *done = NULL, **tail = &done, *req;
+    int n = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    while (n < max && (req = queue->head) != NULL) {
+        if ((queue->head = req->next) == NULL)
+            queue->tail = NULL;
+        *tail = req;
+        tail = &req->next;
+        n++;
+    }
+    *tail = NULL;
+    pthread_mutex_unlock(&queue->lock);
+
+    for (n = 0; (req = done) != NULL; n++) {
+        done = req->next;
+        results[n].token = req->token;
+        results[n].arg = req->arg;
+        results[n].status = req->status;
+        results[n].error = req->error;
+        hwcrhk_async_req_free(req);
+    }
+    return n;
+}
+
+static void hwcrhk_get_async_api(HWCRHK_ASYNC_API *api)
+{
+    memset(api, 0, sizeof(*api));
+    api->queue_new = hwcrhk_async_queue_new;
+    api->queue_free = hwcrhk_async_queue_free;
+    api->queue_fd = hwcrhk_async_queue_fd;
+#ifndef OPENSSL_NO_RSA
+    api->submit_rsa = hwcrhk_async_submit_rsa;
+#endif
+    api->submit_mod_exp = hwcrhk_async_submit_mod_exp;
+    api->submit_mod_exp_crt = hwcrhk_async_submit_mod_exp_crt;
+    api->submit_rand_bytes = hwcrhk_async_submit_rand_bytes;
+    api->poll = hwcrhk_async_poll;
 }
 
 /*
@@ -1421,11 +7744,104 @@ static void hwcrhk_mutex_destroy(HWCryptoHook_Mutex * mt)
     CRYPTO_THREAD_lock_free(mt->lock);
 }
 
+/*
+ * The FAST_MUTEXES are held in the HWCryptoHook_Mutex the library has
+ * allocated, with nothing else to allocate.  |state| is 0 when unlocked,
+ * 1 when locked and 2 when there may be sleepers.  A contended lock is
+ * first spun on, for about as long as it took to be released the last
+ * few times, before the thread goes to sleep on a futex (or yields, where
+ * there are no futexes).  On a single CPU, the holder can't release it
+ * while we spin, so we don't.
+ *
+ * "chil-bench -test mutex" compares these with the default callbacks, and
+ * is the way to tune the spin limit, which may be set at build time.
+ */
+#ifndef HWCRHK_MUTEX_MAX_SPINS
+# define HWCRHK_MUTEX_MAX_SPINS         200
+#endif
+
+static int hwcrhk_mutex_spin_limit = -1;     /* set on first use */
+
+#if defined(__i386__) || defined(__x86_64__)
+# define hwcrhk_cpu_relax()     __asm__ __volatile__("pause" ::: "memory")
+#else
+# define hwcrhk_cpu_relax()     __asm__ __volatile__("" ::: "memory")
+#endif
+
+static int hwcrhk_fast_mutex_init(HWCryptoHook_Mutex * mt,
+                                  HWCryptoHook_CallerContext * cactx)
+{
+    if (__atomic_load_n(&hwcrhk_mutex_spin_limit, __ATOMIC_RELAXED) < 0)
+        __atomic_store_n(&hwcrhk_mutex_spin_limit,
+                         sysconf(_SC_NPROCESSORS_ONLN) > 1
+                         ? HWCRHK_MUTEX_MAX_SPINS : 0, __ATOMIC_RELAXED);
+    mt->lock = NULL;
+    mt->state = 0;
+    mt->spins = 0;
+    return 0;                   /* success */
+}
+
+/* A rough moving average, racy updates are of no consequence */
+static void hwcrhk_fast_mutex_adapt(HWCryptoHook_Mutex * mt, int n)
+{
+    int spins = __atomic_load_n(&mt->spins, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&mt->spins, spins + (n - spins) / 8, __ATOMIC_RELAXED);
+}
+
+static int hwcrhk_fast_mutex_lock(HWCryptoHook_Mutex * mt)
+{
+    int c = 0, n, max;
+
+    if (__atomic_compare_exchange_n(&mt->state, &c, 1, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED))
+        return 0;
+
+    max = 2 * __atomic_load_n(&mt->spins, __ATOMIC_RELAXED) + 10;
+    if (max > hwcrhk_mutex_spin_limit)
+        max = hwcrhk_mutex_spin_limit;
+    for (n = 0; n < max; n++) {
+        hwcrhk_cpu_relax();
+        c = 0;
+        if (__atomic_load_n(&mt->state, __ATOMIC_RELAXED) == 0
+            && __atomic_compare_exchange_n(&mt->state, &c, 1, 0,
+                                           __ATOMIC_ACQUIRE,
+                                           __ATOMIC_RELAXED)) {
+            hwcrhk_fast_mutex_adapt(mt, n);
+            return 0;
+        }
+    }
+    hwcrhk_fast_mutex_adapt(mt, max);
+
+    while (__atomic_exchange_n(&mt->state, 2, __ATOMIC_ACQUIRE) != 0) {
+#ifdef HWCRHK_USE_FUTEX
+        syscall(SYS_futex, &mt->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+#else
+        sched_yield();
+#endif
+    }
+    return 0;
+}
+
+static void hwcrhk_fast_mutex_unlock(HWCryptoHook_Mutex * mt)
+{
+    if (__atomic_exchange_n(&mt->state, 0, __ATOMIC_RELEASE) == 2) {
+#ifdef HWCRHK_USE_FUTEX
+        syscall(SYS_futex, &mt->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+    }
+}
+
+static void hwcrhk_fast_mutex_destroy(HWCryptoHook_Mutex * mt)
+{
+}
+
 static int hwcrhk_get_pass(const char *prompt_info,
                            int *len_io, char *buf,
                            HWCryptoHook_PassphraseContext * ppctx,
                            HWCryptoHook_CallerContext * cactx)
 {
+    HWCRHK_CONFIG config;
     pem_password_cb *callback = NULL;
     void *callback_data = NULL;
     UI_METHOD *ui_method = NULL;
@@ -1436,6 +7852,9 @@ static int hwcrhk_get_pass(const char *prompt_info,
     if (prompt_info && !*prompt_info)
         prompt_info = NULL;
 
+    /* The one handed to the library is a placeholder */
+    hwcrhk_config_get(&config);
+    cactx = &config.password_context;
     if (cactx) {
         if (cactx->ui_method)
             ui_method = cactx->ui_method;
@@ -1495,11 +7914,15 @@ static int hwcrhk_insert_card(const char *prompt_info,
                               HWCryptoHook_PassphraseContext * ppctx,
                               HWCryptoHook_CallerContext * cactx)
 {
+    HWCRHK_CONFIG config;
     int ok = -1;
     UI *ui;
     void *callback_data = NULL;
     UI_METHOD *ui_method = NULL;
 
+    /* The one handed to the library is a placeholder */
+    hwcrhk_config_get(&config);
+    cactx = &config.password_context;
     if (cactx) {
         if (cactx->ui_method)
             ui_method = cactx->ui_method;
@@ -1558,13 +7981,14 @@ static int hwcrhk_insert_card(const char *prompt_info,
 
 static void hwcrhk_log_message(void *logstr, const char *message)
 {
-    BIO *lstream = NULL;
-
-    if (logstr)
-        lstream = *(BIO **)logstr;
-    if (lstream) {
-        BIO_printf(lstream, "%s\n", message);
-    }
+    if (logstr == NULL
+        || __atomic_load_n((BIO **)logstr, __ATOMIC_RELAXED) == NULL)
+        return;
+    if (__atomic_load_n(&hwcrhk_log.running, __ATOMIC_ACQUIRE)
+        || hwcrhk_log_start())
+        hwcrhk_log_push(message);
+    else
+        hwcrhk_log_write(message);
 }
 
 /*
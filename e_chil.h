@@ -0,0 +1,250 @@
+/* ====================================================================
+ * Copyright (c) 2001 The OpenSSL Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. All advertising materials mentioning features or use of this
+ *    software must display the following acknowledgment:
+ *    "This product includes software developed by the OpenSSL Project
+ *    for use in the OpenSSL Toolkit. (http://www.openssl.org/)"
+ *
+ * 4. The names "OpenSSL Toolkit" and "OpenSSL Project" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For written permission, please contact
+ *    openssl-core@openssl.org.
+ *
+ * 5. Products derived from this software may not be called "OpenSSL"
+ *    nor may "OpenSSL" appear in their names without prior written
+ *    permission of the OpenSSL Project.
+ *
+ * 6. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by the OpenSSL Project
+ *    for use in the OpenSSL Toolkit (http://www.openssl.org/)"
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE OpenSSL PROJECT ``AS IS'' AND ANY
+ * EXPRESSED OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE OpenSSL PROJECT OR
+ * ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ * ====================================================================
+ */
+
+/*
+ * Structures exchanged with the CHIL engine through its internal control
+ * commands.  Those commands take a pointer argument and are therefore not
+ * reachable from configuration files; applications call them by name:
+ *
+ *     ENGINE_ctrl_cmd(e, "RSA_BATCH", 0, &batch, NULL, 0);
+ */
+
+#ifndef HEADER_E_CHIL_H
+# define HEADER_E_CHIL_H
+
+# include <stddef.h>
+# include <stdint.h>
+# include <openssl/bn.h>
+# include <openssl/rsa.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * One RSA private key operation for the "RSA_BATCH" command.  |rsa| must
+ * be a key obtained from ENGINE_load_private_key() on this engine.  |in|
+ * is padded according to |padding| (RSA_PKCS1_PADDING or RSA_NO_PADDING)
+ * and the result is written big-endian to |out|, which must have room for
+ * RSA_size(rsa) bytes.
+ */
+typedef struct {
+    RSA *rsa;
+    int padding;
+    const unsigned char *in;
+    size_t inlen;
+    unsigned char *out;
+    size_t outlen;              /* set on success */
+    int status;                 /* 1 on success, 0 on failure */
+    unsigned long error;        /* OpenSSL error code when status is 0 */
+} HWCRHK_RSA_BATCH_ITEM;
+
+typedef struct {
+    HWCRHK_RSA_BATCH_ITEM *items;
+    size_t count;
+} HWCRHK_RSA_BATCH;
+
+/*
+ * Non-blocking submission interface, for applications that run their own
+ * event loop.  "GET_ASYNC_API" fills in a HWCRHK_ASYNC_API.
+ *
+ * Requests are submitted on a completion queue and run on the engine's
+ * worker threads, never on the calling thread.  Each submit function
+ * returns a non-zero token, or 0 if the request could not be queued, which
+ * includes the case where no worker thread could be started; the error
+ * queue then says why.  The arguments are copied, except for
+ * the result (|r| or |buf|), which must stay valid until the request has
+ * completed.  When requests complete, the queue's file descriptor becomes
+ * readable; read it to reset it (it is an eventfd where available, the
+ * read end of a pipe otherwise), then call poll() until it returns 0.
+ *
+ * queue_free() waits for the queue's outstanding requests to finish.
+ */
+typedef struct hwcrhk_async_queue_st HWCRHK_ASYNC_QUEUE;
+
+typedef struct {
+    uint64_t token;
+    void *arg;                  /* as given to the submit function */
+    int status;                 /* 1 on success, 0 on failure */
+    unsigned long error;        /* OpenSSL error code when status is 0 */
+} HWCRHK_ASYNC_RESULT;
+
+typedef struct {
+    HWCRHK_ASYNC_QUEUE *(*queue_new) (void);
+    void (*queue_free) (HWCRHK_ASYNC_QUEUE *queue);
+    int (*queue_fd) (HWCRHK_ASYNC_QUEUE *queue);
+    uint64_t (*submit_rsa) (HWCRHK_ASYNC_QUEUE *queue, BIGNUM *r,
+                            const BIGNUM *in, RSA *rsa, void *arg);
+    uint64_t (*submit_mod_exp) (HWCRHK_ASYNC_QUEUE *queue, BIGNUM *r,
+                                const BIGNUM *a, const BIGNUM *p,
+                                const BIGNUM *m, void *arg);
+    uint64_t (*submit_mod_exp_crt) (HWCRHK_ASYNC_QUEUE *queue, BIGNUM *r,
+                                    const BIGNUM *a, const BIGNUM *p,
+                                    const BIGNUM *q, const BIGNUM *dmp1,
+                                    const BIGNUM *dmq1, const BIGNUM *iqmp,
+                                    void *arg);
+    uint64_t (*submit_rand_bytes) (HWCRHK_ASYNC_QUEUE *queue,
+                                   unsigned char *buf, size_t len,
+                                   void *arg);
+    /* Returns the number of results stored, at most |max| */
+    int (*poll) (HWCRHK_ASYNC_QUEUE *queue, HWCRHK_ASYNC_RESULT *results,
+                 int max);
+} HWCRHK_ASYNC_API;
+
+/* Counters since the engine was loaded, filled in by "GET_STATS" */
+typedef struct {
+    uint64_t overloaded;        /* requests turned away by the limiter */
+    uint64_t deadline_dropped;  /* requests past their deadline, not made */
+    uint64_t deadline_late;     /* requests completed past their deadline */
+    uint64_t software_fallbacks; /* requests computed in software instead */
+    uint64_t breaker_trips;     /* times the circuit breaker opened */
+    uint64_t breaker_rejected;  /* requests refused while it was open */
+    uint64_t log_dropped;       /* log messages lost to a full buffer */
+    uint64_t dh_pool_hits;      /* DH key pairs taken from the pool */
+    uint64_t dh_pool_misses;    /* pool groups' pairs made on demand */
+    uint64_t software_batches;  /* multi-buffer software batches made */
+    uint64_t software_batched;  /* exponentiations made in them */
+    uint64_t sign_cache_hits;   /* signatures found in the cache */
+    uint64_t sign_cache_misses; /* signatures looked for and not found */
+    uint64_t residency_hits;    /* requests on keys that were loaded */
+    uint64_t residency_misses;  /* requests that had to load their key */
+    uint64_t residency_evictions; /* keys unloaded to make room */
+    uint64_t trace_dropped;     /* trace records lost to a full buffer */
+} HWCRHK_STATS;
+
+/*
+ * The usage of one key loaded from the HSM, since it was loaded, as
+ * reported by "TOP_KEYS".  Requests are timed from the moment they are
+ * admitted, and the percentiles are upper bounds, within a quarter of the
+ * true latency.
+ */
+# define HWCRHK_KEY_ID_MAX 64
+
+typedef struct {
+    char key_id[HWCRHK_KEY_ID_MAX]; /* truncated if need be */
+    int replicas;               /* handles asked for */
+    uint64_t ops;               /* requests made on the key */
+    uint64_t errors;            /* of those, the ones that failed */
+    uint64_t p50_us;            /* median latency, in microseconds */
+    uint64_t p99_us;            /* 99th percentile latency */
+} HWCRHK_KEY_USAGE;
+
+# define HWCRHK_TOP_BY_OPS      0
+# define HWCRHK_TOP_BY_P99      1
+
+/*
+ * "TOP_KEYS" stores the usage of at most |max| keys in |keys|, those with
+ * the most requests or the slowest first, and sets |count|.
+ */
+typedef struct {
+    int by;                     /* HWCRHK_TOP_BY_OPS or HWCRHK_TOP_BY_P99 */
+    HWCRHK_KEY_USAGE *keys;
+    size_t max;
+    size_t count;
+} HWCRHK_TOP_KEYS;
+
+/*
+ * The load on the HSM, for applications that would rather send work
+ * elsewhere when it is saturated.  "GET_LOAD_API" fills in a
+ * HWCRHK_LOAD_API, whose functions take no lock and allocate nothing, so
+ * that they can be called for every connection accepted.
+ */
+typedef struct {
+    uint32_t inflight;          /* requests being served by the HSM */
+    uint32_t waiting;           /* requests waiting to be sent to it */
+    uint32_t slots;             /* requests it may be sent at once */
+    uint64_t service_ns;        /* moving average of the time they take */
+    uint64_t queue_delay_ns;    /* estimated wait of a new request */
+} HWCRHK_LOAD;
+
+typedef struct {
+    void (*get) (HWCRHK_LOAD *load);
+    uint64_t (*queue_delay_ns) (void);
+} HWCRHK_LOAD_API;
+
+/*
+ * The file written by "TRACE": a HWCRHK_TRACE_HEADER followed by one
+ * HWCRHK_TRACE_RECORD for every request made to the HSM, in the byte
+ * order of the host that made them.  Child processes append their own
+ * records to the same file, so the records are only roughly in order of
+ * their start times.
+ */
+# define HWCRHK_TRACE_MAGIC     "CHILTRC1"
+
+typedef struct {
+    char magic[8];
+    uint64_t realtime_ns;       /* wall clock time the trace started */
+} HWCRHK_TRACE_HEADER;
+
+# define HWCRHK_TRACE_RSA           1   /* with a key held in the HSM */
+# define HWCRHK_TRACE_MOD_EXP       2
+# define HWCRHK_TRACE_MOD_EXP_CRT   3
+# define HWCRHK_TRACE_RAND_BYTES    4
+# define HWCRHK_TRACE_KEY_LOAD      5   /* one handle */
+
+/*
+ * |key_hash| is the low 32 bits of the 64-bit FNV-1a hash of the key_id,
+ * less any "#N" suffix.  |bits| is the size of the modulus (of both
+ * primes for MOD_EXP_CRT), or of the random bytes asked for, up to 65535.
+ */
+typedef struct {
+    uint64_t start_ns;          /* since the trace started */
+    uint32_t duration_us;
+    uint32_t key_hash;          /* 0 for requests without a key */
+    uint16_t bits;
+    uint16_t exp_bits;          /* the exponent's size, for MOD_EXP */
+    uint8_t type;               /* HWCRHK_TRACE_* */
+    int8_t result;              /* 0, or the library's error code */
+    uint16_t reserved;
+} HWCRHK_TRACE_RECORD;
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -73,6 +73,9 @@ static ERR_STRING_DATA HWCRHK_str_functs[] = {
     {ERR_FUNC(HWCRHK_F_HWCRHK_BN_MOD_EXP), "HWCRHK_BN_MOD_EXP"},
     {ERR_FUNC(HWCRHK_F_HWCRHK_RAND_BYTES), "HWCRHK_RAND_BYTES"},
     {ERR_FUNC(HWCRHK_F_HWCRHK_RSA_MOD_EXP), "HWCRHK_RSA_MOD_EXP"},
+    {ERR_FUNC(HWCRHK_F_HWCRHK_RSA_BATCH), "HWCRHK_RSA_BATCH"},
+    {ERR_FUNC(HWCRHK_F_HWCRHK_ASYNC_QUEUE_NEW), "HWCRHK_ASYNC_QUEUE_NEW"},
+    {ERR_FUNC(HWCRHK_F_HWCRHK_ASYNC_SUBMIT), "HWCRHK_ASYNC_SUBMIT"},
     {0, NULL}
 };
 
@@ -93,6 +96,11 @@ static ERR_STRING_DATA HWCRHK_str_reasons[] = {
     {ERR_REASON(HWCRHK_R_REQUEST_FAILED), "request failed"},
     {ERR_REASON(HWCRHK_R_REQUEST_FALLBACK), "request fallback"},
     {ERR_REASON(HWCRHK_R_UNIT_FAILURE), "unit failure"},
+    {ERR_REASON(HWCRHK_R_INVALID_ARGUMENT), "invalid argument"},
+    {ERR_REASON(HWCRHK_R_OVERLOADED), "overloaded"},
+    {ERR_REASON(HWCRHK_R_DEADLINE_EXCEEDED), "deadline exceeded"},
+    {ERR_REASON(HWCRHK_R_HSM_UNAVAILABLE), "hsm unavailable"},
+    {ERR_REASON(HWCRHK_R_TRACE_FAILURE), "trace failure"},
     {0, NULL}
 };
 
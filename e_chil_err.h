@@ -80,6 +80,9 @@ static void ERR_HWCRHK_error(int function, int reason, char *file, int line);
 # define HWCRHK_F_HWCRHK_RSA_MOD_EXP                      109
 # define HWCRHK_F_BIND_HELPER                             110
 # define HWCRHK_F_HWCRHK_MUTEX_INIT                       111
+# define HWCRHK_F_HWCRHK_RSA_BATCH                        112
+# define HWCRHK_F_HWCRHK_ASYNC_QUEUE_NEW                  113
+# define HWCRHK_F_HWCRHK_ASYNC_SUBMIT                     114
 
 /* Reason codes. */
 # define HWCRHK_R_ALREADY_LOADED                          100
@@ -96,6 +99,11 @@ static void ERR_HWCRHK_error(int function, int reason, char *file, int line);
 # define HWCRHK_R_REQUEST_FAILED                          111
 # define HWCRHK_R_REQUEST_FALLBACK                        112
 # define HWCRHK_R_UNIT_FAILURE                            113
+# define HWCRHK_R_INVALID_ARGUMENT                        114
+# define HWCRHK_R_OVERLOADED                              115
+# define HWCRHK_R_DEADLINE_EXCEEDED                       116
+# define HWCRHK_R_HSM_UNAVAILABLE                         117
+# define HWCRHK_R_TRACE_FAILURE                           119
 
 #ifdef  __cplusplus
 }